@@ -0,0 +1,739 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <random>
+#include <cmath>
+#include <limits>
+#include <cstring>
+#include <filesystem>
+#include <algorithm>
+#include "affinity_propagation.h"
+#include "parser.h"
+#include "pipeline.h"
+#include "distributed_affinity_propagation.h"
+#include "simd.h"
+#include "threadpool.h"
+#include "datasets.h"
+#include "reference.h"
+
+/**
+ * Benchmark harness, build and run with 'make bench' or 'make bench BENCH_ARGS="--n 5000 --threads 1,2,4,8"'
+ *
+ * Generates a Gaussian blob dataset, times parsing, similarity construction, every AP phase and the whole fit
+ * for each thread count, writes results.csv and results.json and reports the scaling efficiency
+ * relative to the smallest thread count.
+ * Before timing anything it checks that every SIMD variant agrees with the scalar kernels, that the labels
+ * of a small fit match a textbook reference implementation and that a single precision fit of the same data
+ * finds the labels of the double precision one, that packed similarities give the labels of dense ones and that a fit
+ * resumed from a checkpoint ends like an uninterrupted one and that worker processes over either transport agree with a
+ * single process fit, the exit code is non-zero when a check fails
+ */
+
+namespace Bench
+{
+    struct Options
+    {
+        size_t n = 2000;
+        size_t d = 16;
+        size_t clusters = 10;
+        std::vector<uint32_t> threads;
+        unsigned int repeat = 3;
+        unsigned int max_iter = 200;
+        double damping = 0.5;
+        size_t reference_n = 200;
+        uint64_t seed = 1;
+        std::string out = "bench_results";
+    };
+
+    /// @brief All timings of one stage at one thread count
+    struct Measurement
+    {
+        std::string stage;
+        uint32_t threads;
+        std::vector<double> samples;
+
+        inline double min() const { return *std::min_element(samples.begin(), samples.end()); }
+
+        inline double mean() const
+        {
+            double sum = 0.0;
+            for (double sample : samples)
+                sum += sample;
+            return sum / samples.size();
+        }
+    };
+
+    struct Check
+    {
+        std::string name;
+        bool passed;
+        std::string detail;
+    };
+
+    /// @brief Swallows anything printed to std::cout while a benchmark runs
+    class QuietCout
+    {
+    public:
+        QuietCout() : saved_(std::cout.rdbuf(&sink_)) {}
+        ~QuietCout() { std::cout.rdbuf(saved_); }
+
+    private:
+        struct NullBuffer : std::streambuf
+        {
+            int overflow(int c) override { return c; }
+        };
+
+        NullBuffer sink_;
+        std::streambuf *saved_;
+    };
+
+    template <typename F>
+    inline double timeMs(F &&fn)
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        fn();
+        return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    }
+
+    inline void usage()
+    {
+        std::cout << "usage: bench [--n points] [--d dimensions] [--clusters k] [--threads 1,2,4] [--repeat r]\n"
+                     "             [--max-iter i] [--damping l] [--reference-n points] [--seed s] [--out directory]\n";
+    }
+
+    inline std::vector<uint32_t> parseThreads(const std::string &list)
+    {
+        std::vector<uint32_t> threads;
+        std::stringstream stream(list);
+        std::string item;
+        while (std::getline(stream, item, ','))
+        {
+            threads.push_back(static_cast<uint32_t>(std::stoul(item)));
+        }
+        return threads;
+    }
+
+    /// @brief Powers of two up to the hardware thread count, plus the count itself
+    inline std::vector<uint32_t> defaultThreads()
+    {
+        uint32_t hardware = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<uint32_t> threads;
+        for (uint32_t t = 1; t < hardware; t *= 2)
+        {
+            threads.push_back(t);
+        }
+        threads.push_back(hardware);
+        return threads;
+    }
+
+    inline Options parseOptions(int argc, char *argv[])
+    {
+        Options options;
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string arg = argv[i];
+            if (arg == "--help" || arg == "-h")
+            {
+                usage();
+                std::exit(EXIT_SUCCESS);
+            }
+            if (i + 1 >= argc)
+            {
+                throw std::invalid_argument("Missing value for " + arg);
+            }
+            std::string value = argv[++i];
+
+            if (arg == "--n")
+                options.n = std::stoull(value);
+            else if (arg == "--d")
+                options.d = std::stoull(value);
+            else if (arg == "--clusters")
+                options.clusters = std::stoull(value);
+            else if (arg == "--threads")
+                options.threads = parseThreads(value);
+            else if (arg == "--repeat")
+                options.repeat = std::max(1ul, std::stoul(value));
+            else if (arg == "--max-iter")
+                options.max_iter = std::stoul(value);
+            else if (arg == "--damping")
+                options.damping = std::stod(value);
+            else if (arg == "--reference-n")
+                options.reference_n = std::stoull(value);
+            else if (arg == "--seed")
+                options.seed = std::stoull(value);
+            else if (arg == "--out")
+                options.out = value;
+            else
+                throw std::invalid_argument("Unknown option " + arg);
+        }
+
+        if (options.threads.empty())
+        {
+            options.threads = defaultThreads();
+        }
+        std::sort(options.threads.begin(), options.threads.end());
+        options.threads.erase(std::unique(options.threads.begin(), options.threads.end()), options.threads.end());
+        if (options.threads.front() == 0)
+        {
+            throw std::invalid_argument("Thread counts have to be positive");
+        }
+        return options;
+    }
+
+    /// @brief Names of the kernels of a variant that disagree with the scalar ones on random rows.
+    ///        The maximum of a + s and of r + a is planted twice, so rowTop2 has to return first == second, responsibilityRow
+    ///        has to take its tied branch and argmaxSum has to keep the first of the two. Message kernels have to match bit for bit,
+    ///        dot products up to reduction order
+    inline std::vector<std::string> crossCheck(AP::Simd::Isa isa, uint64_t seed)
+    {
+        // Not a multiple of any vector width, positions 1024 to 1030 are in the scalar tail of every variant
+        constexpr size_t n = 1031;
+        // Positions of the tied maximum: in different lanes, in the same vector, in a vector and the tail, both in the tail
+        const std::pair<size_t, size_t> ties[] = {{3, 517}, {8, 9}, {40, 1027}, {1025, 1030}};
+
+        const AP::Simd::Kernels &scalar = AP::Simd::kernels(AP::Simd::Isa::Scalar);
+        const AP::Simd::Kernels &simd = AP::Simd::kernels(isa);
+        std::mt19937_64 generator(seed);
+        std::normal_distribution<double> normal(0.0, 100.0);
+        auto row = [&]()
+        {
+            std::vector<double> v(n);
+            for (double &value : v)
+                value = normal(generator);
+            return v;
+        };
+
+        std::vector<std::string> failures;
+        auto fail = [&](const std::string &kernel)
+        {
+            if (std::find(failures.begin(), failures.end(), kernel) == failures.end())
+                failures.push_back(kernel);
+        };
+        auto close = [](double x, double y)
+        { return std::abs(x - y) <= 1e-12 * std::max(1.0, std::abs(y)); };
+
+        for (auto [p, q] : ties)
+        {
+            std::vector<double> s = row(), a = row(), r = row(), diagonal = row(), sums = row();
+            for (double &value : a)
+                value = std::min(0.0, value);
+
+            // Whole numbers with a zero availability, so both sums are exact in float as well
+            double top_as = -std::numeric_limits<double>::infinity();
+            double top_ra = -std::numeric_limits<double>::infinity();
+            for (size_t k = 0; k < n; ++k)
+            {
+                top_as = std::max(top_as, a[k] + s[k]);
+                top_ra = std::max(top_ra, r[k] + a[k]);
+            }
+            a[p] = a[q] = 0.0;
+            s[p] = s[q] = std::ceil(top_as) + 100.0;
+            r[p] = r[q] = std::ceil(top_ra) + 100.0;
+
+            double first, second, first_ref, second_ref;
+            simd.rowTop2(a.data(), s.data(), n, first, second);
+            scalar.rowTop2(a.data(), s.data(), n, first_ref, second_ref);
+            if (first_ref != second_ref)
+                fail("planted tie");
+            if (first != first_ref || second != second_ref)
+                fail("rowTop2");
+
+            std::vector<double> out = r, out_ref = r;
+            simd.responsibilityRow(s.data(), a.data(), out.data(), n, first_ref, second_ref, 0.5);
+            scalar.responsibilityRow(s.data(), a.data(), out_ref.data(), n, first_ref, second_ref, 0.5);
+            if (out != out_ref)
+                fail("responsibilityRow");
+
+            out = sums;
+            out_ref = sums;
+            simd.accumulatePositive(r.data(), out.data(), n);
+            scalar.accumulatePositive(r.data(), out_ref.data(), n);
+            if (out != out_ref)
+                fail("accumulatePositive");
+
+            out = a;
+            out_ref = a;
+            simd.availabilityRow(r.data(), diagonal.data(), sums.data(), out.data(), n, 0.5);
+            scalar.availabilityRow(r.data(), diagonal.data(), sums.data(), out_ref.data(), n, 0.5);
+            if (out != out_ref)
+                fail("availabilityRow");
+
+            size_t argmax_ref = scalar.argmaxSum(r.data(), a.data(), n);
+            if (argmax_ref != p)
+                fail("planted tie");
+            if (simd.argmaxSum(r.data(), a.data(), n) != argmax_ref)
+                fail("argmaxSum");
+
+            if (!close(simd.dot(r.data(), s.data(), n), scalar.dot(r.data(), s.data(), n)))
+                fail("dot");
+            if (!close(simd.negSquaredEuclidean(r.data(), s.data(), n), scalar.negSquaredEuclidean(r.data(), s.data(), n)))
+                fail("negSquaredEuclidean");
+
+            // Single precision message kernels, on the same rows rounded to float
+            const AP::Simd::FloatKernels &single = simd.single;
+            const AP::Simd::FloatKernels &single_ref = scalar.single;
+            std::vector<float> fs(s.begin(), s.end()), fa(a.begin(), a.end()), fr(r.begin(), r.end());
+            std::vector<float> fdiagonal(diagonal.begin(), diagonal.end()), fsums(sums.begin(), sums.end());
+
+            float ffirst, fsecond, ffirst_ref, fsecond_ref;
+            single.rowTop2(fa.data(), fs.data(), n, ffirst, fsecond);
+            single_ref.rowTop2(fa.data(), fs.data(), n, ffirst_ref, fsecond_ref);
+            if (ffirst_ref != fsecond_ref)
+                fail("planted tie<float>");
+            if (ffirst != ffirst_ref || fsecond != fsecond_ref)
+                fail("rowTop2<float>");
+
+            std::vector<float> fout = fr, fout_ref = fr;
+            single.responsibilityRow(fs.data(), fa.data(), fout.data(), n, ffirst_ref, fsecond_ref, 0.5f);
+            single_ref.responsibilityRow(fs.data(), fa.data(), fout_ref.data(), n, ffirst_ref, fsecond_ref, 0.5f);
+            if (fout != fout_ref)
+                fail("responsibilityRow<float>");
+
+            fout = fsums;
+            fout_ref = fsums;
+            single.accumulatePositive(fr.data(), fout.data(), n);
+            single_ref.accumulatePositive(fr.data(), fout_ref.data(), n);
+            if (fout != fout_ref)
+                fail("accumulatePositive<float>");
+
+            out = sums;
+            out_ref = sums;
+            single.accumulatePositiveWide(fr.data(), out.data(), n);
+            single_ref.accumulatePositiveWide(fr.data(), out_ref.data(), n);
+            if (out != out_ref)
+                fail("accumulatePositiveWide");
+
+            fout = fa;
+            fout_ref = fa;
+            single.availabilityRow(fr.data(), fdiagonal.data(), fsums.data(), fout.data(), n, 0.5f);
+            single_ref.availabilityRow(fr.data(), fdiagonal.data(), fsums.data(), fout_ref.data(), n, 0.5f);
+            if (fout != fout_ref)
+                fail("availabilityRow<float>");
+
+            size_t fargmax_ref = single_ref.argmaxSum(fr.data(), fa.data(), n);
+            if (fargmax_ref != p)
+                fail("planted tie<float>");
+            if (single.argmaxSum(fr.data(), fa.data(), n) != fargmax_ref)
+                fail("argmaxSum<float>");
+
+            double tile[16], tile_ref[16];
+            simd.dotTile(r.data(), 7, s.data(), 11, n - 40, tile, 4);
+            scalar.dotTile(r.data(), 7, s.data(), 11, n - 40, tile_ref, 4);
+            for (size_t t = 0; t < 16; ++t)
+            {
+                if (!close(tile[t], tile_ref[t]))
+                {
+                    fail("dotTile");
+                    break;
+                }
+            }
+        }
+
+        return failures;
+    }
+
+    /// @brief Every SIMD variant the CPU supports against the scalar kernels, see crossCheck()
+    inline Check checkSimd(uint64_t seed)
+    {
+        std::ostringstream detail;
+        bool passed = true;
+
+        for (AP::Simd::Isa isa : AP::Simd::available())
+        {
+            std::vector<std::string> failures = crossCheck(isa, seed);
+            detail << AP::Simd::kernels(isa).name << (failures.empty() ? " ok" : " FAILED:");
+            for (const std::string &failure : failures)
+                detail << " " << failure;
+            detail << "; ";
+            passed &= failures.empty();
+        }
+
+        return Check{"simd", passed, detail.str()};
+    }
+
+    /// @brief Labels of a small fit against the textbook implementation run for the same number of iterations
+    inline Check checkReference(const Options &options, const std::string &file)
+    {
+        Blobs blobs = generateBlobs(options.reference_n, options.d, options.clusters, 1.0, 10.0, options.seed + 1);
+        writeTXT(file, blobs.points);
+
+        AP::Matrix similarities;
+        std::vector<int> labels;
+        unsigned int iterations = 0;
+        {
+            QuietCout quiet;
+            AP::Parser parser;
+            parser.parseTXT(file);
+            similarities = parser.getSimilarity(AP::Median);
+            AP::AffinityPropagation ap(similarities, options.max_iter, options.damping);
+            ap.fit();
+            labels = ap.getLabels();
+            iterations = ap.getIterations();
+        }
+
+        std::vector<int> expected = referenceLabels(similarities, iterations, options.damping);
+        size_t mismatches = 0;
+        for (size_t i = 0; i < labels.size(); ++i)
+        {
+            mismatches += labels[i] != expected[i];
+        }
+
+        std::ostringstream detail;
+        detail << options.reference_n << " points, " << iterations << " iterations, " << mismatches << " labels differ";
+        return Check{"reference", mismatches == 0, detail.str()};
+    }
+
+    /// @brief Clusters of a single precision fit with double column sums against a double precision fit of the same blobs
+    inline Check checkPrecision(const Options &options, const std::string &file)
+    {
+        AP::ValidationReport validation;
+        {
+            QuietCout quiet;
+            AP::Parser parser;
+            parser.parseTXT(file);
+            AP::Matrix reference = parser.getSimilarity(AP::Median);
+            AP::MatrixF similarities = parser.getSimilarity<float>(AP::Median);
+            // With light damping the messages oscillate between near-tied exemplars of a blob and rounding decides where
+            // they settle, heavier damping lets both precisions converge on the same messages
+            AP::AffinityPropagationMixed ap(similarities, options.max_iter, std::max(options.damping, 0.9));
+            ap.setValidation(reference);
+            ap.fit();
+            validation = *ap.getValidation();
+        }
+
+        std::ostringstream detail;
+        detail << validation.points << " points, " << validation.mismatched_labels << " labels differ, " << validation.exemplars << " exemplars against "
+               << validation.reference_exemplars;
+        // The exemplars have to be the same, or at most one point in a hundred may end in another cluster
+        bool passed = validation.same_exemplars || validation.mismatched_labels * 100 <= validation.points;
+        return Check{"precision", passed, detail.str()};
+    }
+
+    /// @brief Labels of a fit over packed symmetric similarities against a fit over the dense matrix, they have to agree exactly
+    ///        and the packed matrix has to take less memory
+    inline Check checkPacked(const Options &options, const std::string &file)
+    {
+        std::vector<int> dense_labels;
+        std::vector<int> packed_labels;
+        size_t dense_bytes = 0;
+        size_t packed_bytes = 0;
+        {
+            QuietCout quiet;
+            AP::Parser parser;
+            parser.parseTXT(file);
+            AP::Matrix dense = parser.getSimilarity(AP::Median);
+            AP::PackedSymmetricMatrix packed = parser.getPackedSimilarity(AP::Median);
+            dense_bytes = dense.rows() * dense.stride() * sizeof(double);
+            packed_bytes = packed.bytes();
+
+            AP::AffinityPropagation dense_ap(dense, options.max_iter, options.damping);
+            dense_ap.fit();
+            dense_labels = dense_ap.getLabels();
+            AP::AffinityPropagation packed_ap(packed, options.max_iter, options.damping);
+            packed_ap.fit();
+            packed_labels = packed_ap.getLabels();
+        }
+
+        size_t mismatches = 0;
+        for (size_t i = 0; i < dense_labels.size(); ++i)
+        {
+            mismatches += dense_labels[i] != packed_labels[i];
+        }
+
+        std::ostringstream detail;
+        detail << dense_labels.size() << " points, " << mismatches << " labels differ, " << packed_bytes << " bytes against " << dense_bytes;
+        bool passed = mismatches == 0 && packed_labels.size() == dense_labels.size() && packed_bytes < dense_bytes;
+        return Check{"packed", passed, detail.str()};
+    }
+
+    /// @brief A fit interrupted halfway and continued from its last checkpoint by a fresh object against an uninterrupted fit,
+    ///        labels and iteration counts have to agree exactly
+    inline Check checkCheckpoint(const Options &options, const std::string &file, const std::string &checkpoint)
+    {
+        std::vector<int> labels;
+        std::vector<int> resumed_labels;
+        unsigned int iterations = 0;
+        unsigned int resumed_iterations = 0;
+        uint64_t checkpoints = 0;
+        {
+            QuietCout quiet;
+            AP::Parser parser;
+            parser.parseTXT(file);
+            AP::Matrix similarities = parser.getSimilarity(AP::Median);
+
+            AP::AffinityPropagation ap(similarities, options.max_iter, options.damping);
+            ap.fit();
+            labels = ap.getLabels();
+            iterations = ap.getIterations();
+
+            // Stands in for a killed process, the fit stops by an exception from its iteration callback
+            unsigned int every = std::max(1u, iterations / 4);
+            unsigned int stop = iterations / 2 + 1;
+            {
+                AP::AffinityPropagation interrupted(similarities, options.max_iter, options.damping);
+                interrupted.setCheckpoint(checkpoint, every);
+                interrupted.getInstrumentation().setCallback(
+                    [stop](const AP::IterationStats &stats)
+                    {
+                        if (stats.iteration + 1 == stop)
+                            throw std::runtime_error("Interrupted");
+                    });
+                try
+                {
+                    interrupted.fit();
+                }
+                catch (const std::runtime_error &)
+                {
+                }
+                checkpoints = interrupted.getInstrumentation().counter(AP::Counter::Checkpoints);
+            }
+
+            if (checkpoints > 0)
+            {
+                AP::AffinityPropagation resumed(similarities);
+                resumed.resume(checkpoint);
+                resumed.fit();
+                resumed_labels = resumed.getLabels();
+                resumed_iterations = resumed.getIterations();
+            }
+            std::filesystem::remove(checkpoint);
+        }
+
+        size_t mismatches = 0;
+        for (size_t i = 0; i < std::min(labels.size(), resumed_labels.size()); ++i)
+        {
+            mismatches += labels[i] != resumed_labels[i];
+        }
+
+        std::ostringstream detail;
+        detail << checkpoints << " checkpoints, " << mismatches << " labels differ, " << resumed_iterations << " iterations against " << iterations;
+        bool passed = checkpoints > 0 && resumed_labels.size() == labels.size() && mismatches == 0 && resumed_iterations == iterations;
+        return Check{"checkpoint", passed, detail.str()};
+    }
+
+    /// @brief Fits by two worker processes over each transport against a single process fit of the same similarities,
+    ///        every worker has to end with its labels and iteration count
+    inline Check checkDistributed(const Options &options, const std::string &file, const std::string &similarity_file)
+    {
+        constexpr unsigned int workers = 2;
+        std::ostringstream detail;
+        bool passed = true;
+        {
+            QuietCout quiet;
+            AP::Parser parser;
+            parser.parseTXT(file);
+            AP::Matrix similarities = parser.getSimilarity(AP::Median);
+            parser.writeSimilarity(similarity_file, AP::Median);
+
+            AP::AffinityPropagation ap(similarities, options.max_iter, options.damping);
+            ap.fit();
+            const std::vector<int> &labels = ap.getLabels();
+            unsigned int iterations = ap.getIterations();
+
+            // Every pool is stopped by now, launch() forks and a worker that disagrees fails its launch by throwing
+            for (AP::Distributed::TransportKind kind : {AP::Distributed::TransportKind::SharedMemory, AP::Distributed::TransportKind::Socket})
+            {
+                bool agreed = AP::Distributed::launch(workers, kind,
+                    [&](AP::Distributed::Transport &transport)
+                    {
+                        AP::DistributedAffinityPropagation distributed(transport, similarity_file, options.max_iter, options.damping);
+                        distributed.setThreadCount(1);
+                        distributed.fit();
+                        if (distributed.getLabels() != labels || distributed.getIterations() != iterations)
+                            throw std::runtime_error("Rank " + std::to_string(transport.rank()) + " disagrees");
+                    });
+                detail << workers << " workers over " << (kind == AP::Distributed::TransportKind::SharedMemory ? "shared memory" : "sockets")
+                       << (agreed ? " ok" : " FAILED") << "; ";
+                passed &= agreed;
+            }
+            std::filesystem::remove(similarity_file);
+        }
+
+        return Check{"distributed", passed, detail.str()};
+    }
+
+    /// @param report receives the instrumentation report of the last fit
+    inline std::vector<Measurement> run(const Options &options, const std::string &file, std::string &report)
+    {
+        std::vector<Measurement> results;
+
+        for (uint32_t threads : options.threads)
+        {
+            Threading::ThreadPool::setDefaultThreadCount(threads);
+            std::map<std::string, Measurement> stages;
+            auto record = [&](const std::string &stage, double ms)
+            {
+                Measurement &m = stages[stage];
+                m.stage = stage;
+                m.threads = threads;
+                m.samples.push_back(ms);
+            };
+
+            for (unsigned int rep = 0; rep < options.repeat; ++rep)
+            {
+                QuietCout quiet;
+                AP::Parser parser;
+                double parse_ms = timeMs([&]
+                                         { parser.parseTXT(file); });
+                record("parse", parse_ms);
+
+                AP::Matrix similarities;
+                double similarity_ms = timeMs([&]
+                                              { similarities = parser.getSimilarity(AP::Median); });
+                record("similarity", similarity_ms);
+
+                AP::AffinityPropagation ap(similarities, options.max_iter, options.damping);
+                double fit_ms = timeMs([&]
+                                       { ap.fit(); });
+                record("fit", fit_ms);
+                record("staged", parse_ms + similarity_ms + fit_ms);
+
+                // The same run end to end through the overlapping front end on one shared pool
+                record("pipeline", timeMs([&]
+                                          {
+                                              AP::Pipeline pipeline(options.max_iter, options.damping);
+                                              pipeline.loadTXT(file, AP::Median);
+                                              pipeline.fit(); }));
+
+                const AP::Instrumentation &instrumentation = ap.getInstrumentation();
+                for (AP::Phase phase : {AP::Phase::Initialize, AP::Phase::Responsibility, AP::Phase::Availability, AP::Phase::Exemplars, AP::Phase::Clusters})
+                {
+                    record(AP::Instrumentation::name(phase), instrumentation.phase(phase).total_ms);
+                }
+                record("iterations", ap.getIterations());
+                report = instrumentation.toJSON();
+            }
+
+            for (const char *stage : {"parse", "similarity", "initialize", "responsibility", "availability", "exemplars", "clusters", "fit", "staged", "pipeline", "iterations"})
+            {
+                results.push_back(stages[stage]);
+            }
+        }
+
+        Threading::ThreadPool::setDefaultThreadCount(0);
+        return results;
+    }
+
+    /// @brief Speedup of the best time relative to the smallest thread count measured for the same stage
+    inline double speedup(const std::vector<Measurement> &results, const Measurement &m)
+    {
+        for (const Measurement &base : results)
+        {
+            if (base.stage == m.stage)
+                return m.min() > 0.0 ? base.min() / m.min() : 1.0;
+        }
+        return 1.0;
+    }
+
+    inline void writeCSV(const std::string &filename, const Options &options, const std::vector<Measurement> &results)
+    {
+        std::ofstream out(filename, std::ios::trunc);
+        out << "n,d,clusters,threads,stage,min_ms,mean_ms,speedup,efficiency\n";
+        for (const Measurement &m : results)
+        {
+            if (m.stage == "iterations")
+                continue;
+            double s = speedup(results, m);
+            out << options.n << "," << options.d << "," << options.clusters << "," << m.threads << "," << m.stage << ","
+                << m.min() << "," << m.mean() << "," << s << "," << s * options.threads.front() / m.threads << "\n";
+        }
+    }
+
+    inline void writeJSON(const std::string &filename, const Options &options, const std::vector<Measurement> &results, const std::vector<Check> &checks,
+                          const std::string &report)
+    {
+        std::ofstream out(filename, std::ios::trunc);
+        out << "{\n  \"config\": {\"n\": " << options.n << ", \"d\": " << options.d << ", \"clusters\": " << options.clusters
+            << ", \"repeat\": " << options.repeat << ", \"max_iter\": " << options.max_iter << ", \"damping\": " << options.damping
+            << ", \"seed\": " << options.seed << ", \"simd\": \"" << AP::Simd::best().name << "\"},\n";
+
+        out << "  \"checks\": [";
+        for (size_t c = 0; c < checks.size(); ++c)
+        {
+            out << (c ? ", " : "") << "{\"name\": \"" << checks[c].name << "\", \"passed\": " << (checks[c].passed ? "true" : "false")
+                << ", \"detail\": \"" << checks[c].detail << "\"}";
+        }
+        out << "],\n";
+
+        out << "  \"results\": [\n";
+        for (size_t r = 0; r < results.size(); ++r)
+        {
+            const Measurement &m = results[r];
+            double s = speedup(results, m);
+            out << "    {\"threads\": " << m.threads << ", \"stage\": \"" << m.stage << "\", \"min\": " << m.min() << ", \"mean\": " << m.mean()
+                << ", \"speedup\": " << s << ", \"efficiency\": " << s * options.threads.front() / m.threads << ", \"samples\": [";
+            for (size_t i = 0; i < m.samples.size(); ++i)
+            {
+                out << (i ? ", " : "") << m.samples[i];
+            }
+            out << "]}" << (r + 1 < results.size() ? "," : "") << "\n";
+        }
+        out << "  ],\n  \"last_fit\": " << report << "\n}\n";
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    using namespace Bench;
+
+    Options options;
+    try
+    {
+        options = parseOptions(argc, argv);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    std::filesystem::create_directories(options.out);
+    std::string reference_file = (std::filesystem::path(options.out) / "reference.txt").string();
+    std::string data_file = (std::filesystem::path(options.out) / "blobs.txt").string();
+
+    std::vector<Check> checks;
+    checks.push_back(checkSimd(options.seed));
+    checks.push_back(checkReference(options, reference_file));
+    checks.push_back(checkPrecision(options, reference_file));
+    checks.push_back(checkPacked(options, reference_file));
+    checks.push_back(checkCheckpoint(options, reference_file, (std::filesystem::path(options.out) / "checkpoint.ap").string()));
+    checks.push_back(checkDistributed(options, reference_file, (std::filesystem::path(options.out) / "similarities.bin").string()));
+    for (const Check &check : checks)
+    {
+        std::cout << (check.passed ? "PASS " : "FAIL ") << check.name << ": " << check.detail << "\n";
+    }
+
+    Blobs blobs = generateBlobs(options.n, options.d, options.clusters, 1.0, 10.0, options.seed);
+    writeTXT(data_file, blobs.points);
+    std::cout << "Benchmarking " << options.n << " points in " << options.d << " dimensions from " << options.clusters
+              << " blobs, " << options.repeat << " repeats, simd " << AP::Simd::best().name << "\n";
+
+    std::string report;
+    std::vector<Measurement> results = run(options, data_file, report);
+
+    std::cout << "\n"
+              << std::left << std::setw(10) << "threads" << std::setw(16) << "stage" << std::right << std::setw(12) << "min ms"
+              << std::setw(12) << "mean ms" << std::setw(10) << "speedup" << std::setw(12) << "efficiency" << "\n";
+    for (const Measurement &m : results)
+    {
+        if (m.stage == "iterations")
+            continue;
+        double s = speedup(results, m);
+        std::cout << std::left << std::setw(10) << m.threads << std::setw(16) << m.stage << std::right << std::fixed << std::setprecision(2)
+                  << std::setw(12) << m.min() << std::setw(12) << m.mean() << std::setw(10) << s << std::setw(12)
+                  << s * options.threads.front() / m.threads << "\n";
+    }
+
+    writeCSV((std::filesystem::path(options.out) / "results.csv").string(), options, results);
+    writeJSON((std::filesystem::path(options.out) / "results.json").string(), options, results, checks, report);
+    std::cout << "\nResults written to " << options.out << "/results.csv and " << options.out << "/results.json" << std::endl;
+
+    bool passed = std::all_of(checks.begin(), checks.end(), [](const Check &check)
+                              { return check.passed; });
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,78 @@
+#pragma once
+#include <random>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iomanip>
+#include <stdexcept>
+#include "matrix.h"
+
+namespace Bench
+{
+    /// @brief Points drawn around randomly placed centers, with the center each point was drawn from
+    struct Blobs
+    {
+        AP::Matrix points;
+        std::vector<int> truth;
+    };
+
+    /// @brief Isotropic Gaussian blobs. Centers are uniform in [-box, box]^d, every blob gets n / clusters points
+    ///        with standard deviation spread along each axis. The same seed always gives the same dataset
+    inline Blobs generateBlobs(size_t n, size_t d, size_t clusters, double spread = 1.0, double box = 10.0, uint64_t seed = 1)
+    {
+        if (clusters == 0 || d == 0)
+        {
+            throw std::invalid_argument("Blobs need at least one cluster and one dimension");
+        }
+
+        std::mt19937_64 generator(seed);
+        std::uniform_real_distribution<double> uniform(-box, box);
+        std::normal_distribution<double> normal(0.0, spread);
+
+        AP::Matrix centers(clusters, d);
+        for (size_t c = 0; c < clusters; ++c)
+        {
+            for (size_t k = 0; k < d; ++k)
+            {
+                centers(c, k) = uniform(generator);
+            }
+        }
+
+        Blobs blobs{AP::Matrix(n, d), std::vector<int>(n)};
+        for (size_t i = 0; i < n; ++i)
+        {
+            size_t c = i % clusters;
+            blobs.truth[i] = static_cast<int>(c);
+            for (size_t k = 0; k < d; ++k)
+            {
+                blobs.points(i, k) = centers(c, k) + normal(generator);
+            }
+        }
+        return blobs;
+    }
+
+    /// @brief Write points in the whitespace separated format read by Parser::parseTXT
+    inline void writeTXT(const std::string &filename, const AP::Matrix &points)
+    {
+        std::ofstream out(filename, std::ios::trunc);
+        if (!out)
+        {
+            throw std::runtime_error("Error creating file: " + filename);
+        }
+
+        out << std::setprecision(17);
+        for (size_t i = 0; i < points.rows(); ++i)
+        {
+            for (size_t k = 0; k < points.cols(); ++k)
+            {
+                out << (k ? " " : "") << points(i, k);
+            }
+            out << '\n';
+        }
+
+        if (!out)
+        {
+            throw std::runtime_error("Error writing file: " + filename);
+        }
+    }
+}
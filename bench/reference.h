@@ -0,0 +1,74 @@
+#pragma once
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include "matrix.h"
+
+namespace Bench
+{
+    /// @brief Textbook affinity propagation straight from the update equations, O(n^3) per iteration.
+    ///        Runs exactly the given number of iterations with the same damping as AP::AffinityPropagation,
+    ///        so the labels of an optimized fit can be compared one to one
+    inline std::vector<int> referenceLabels(const AP::Matrix &s, unsigned int iterations, double damping)
+    {
+        size_t n = s.rows();
+        AP::Matrix r(n, n, 0.0);
+        AP::Matrix a(n, n, 0.0);
+        AP::Matrix updated(n, n, 0.0);
+
+        for (unsigned int iter = 0; iter < iterations; ++iter)
+        {
+            // r(i,k) = s(i,k) - max_{k' != k} (a(i,k') + s(i,k'))
+            for (size_t i = 0; i < n; ++i)
+            {
+                for (size_t k = 0; k < n; ++k)
+                {
+                    double best = -std::numeric_limits<double>::infinity();
+                    for (size_t other = 0; other < n; ++other)
+                    {
+                        if (other != k)
+                            best = std::max(best, a(i, other) + s(i, other));
+                    }
+                    r(i, k) = damping * r(i, k) + (1.0 - damping) * (s(i, k) - best);
+                }
+            }
+
+            // a(i,k) = min(0, r(k,k) + sum_{i' not in {i,k}} max(0, r(i',k))), a(k,k) = sum_{i' != k} max(0, r(i',k))
+            for (size_t i = 0; i < n; ++i)
+            {
+                for (size_t k = 0; k < n; ++k)
+                {
+                    double sum = 0.0;
+                    for (size_t other = 0; other < n; ++other)
+                    {
+                        if (other != i && other != k)
+                            sum += std::max(0.0, r(other, k));
+                    }
+                    updated(i, k) = i == k ? sum : std::min(0.0, r(k, k) + sum);
+                }
+            }
+            for (size_t i = 0; i < n; ++i)
+            {
+                for (size_t k = 0; k < n; ++k)
+                {
+                    a(i, k) = damping * a(i, k) + (1.0 - damping) * updated(i, k);
+                }
+            }
+        }
+
+        std::vector<int> labels(n, 0);
+        for (size_t i = 0; i < n; ++i)
+        {
+            double best = -std::numeric_limits<double>::infinity();
+            for (size_t k = 0; k < n; ++k)
+            {
+                if (r(i, k) + a(i, k) > best)
+                {
+                    best = r(i, k) + a(i, k);
+                    labels[i] = static_cast<int>(k);
+                }
+            }
+        }
+        return labels;
+    }
+}
@@ -3,38 +3,175 @@
 #include <vector>
 #include <cmath>
 #include <chrono>
+#include <algorithm>
+#include <memory>
+#include <optional>
+#include <string>
+#include <stdexcept>
+#include <type_traits>
 #include "matrix.h"
+#include "similarity_provider.h"
 #include "threadpool.h"
+#include "simd.h"
+#include "instrumentation.h"
+#include "binary_format.h"
+#include "checkpoint.h"
 
 namespace AP
 {
     const double NEG_INFINITY = -std::numeric_limits<double>::infinity();
 
-    class AffinityPropagation
+    /// @brief How the labels of a reduced precision fit compare to those of a double precision fit of the same problem,
+    ///        see BasicAffinityPropagation::setValidation()
+    struct ValidationReport
     {
+        /// @brief Points whose exemplar differs from the one the double precision fit picked
+        size_t mismatched_labels = 0;
+        size_t points = 0;
+        size_t exemplars = 0;
+        size_t reference_exemplars = 0;
+        /// @brief Whether both fits chose exactly the same exemplars
+        bool same_exemplars = false;
+        unsigned int reference_iterations = 0;
+        bool reference_converged = false;
+    };
+
+    /// @brief Affinity propagation over dense n x n matrices of T.
+    ///        With T = float the similarities and both message matrices take half the memory and bandwidth of double
+    ///        and the kernels process twice the lanes. The column sums of positive responsibilities are accumulated in Sum,
+    ///        which can be double to keep the sums over many rows accurate while the matrices stay in float
+    template <typename T = double, typename Sum = T>
+    class BasicAffinityPropagation
+    {
+        static_assert(std::is_same_v<T, float> || std::is_same_v<T, double>, "Values have to be float or double");
+        static_assert(std::is_floating_point_v<Sum> && sizeof(Sum) >= sizeof(T), "Sums need at least the precision of the values");
+
     public:
-        AffinityPropagation(const Matrix &similarities, unsigned int max_iter = 200)
-            : similarities_(similarities), max_iter_(max_iter) {}
+        /// @param similarities n x n similarity matrix with the preferences on the diagonal
+        /// @param max_iter upper bound on the number of message passing iterations
+        /// @param damping weight of the previous message when blending with the new one, in [0, 1)
+        /// @param convergence_iter number of iterations the exemplar set has to stay unchanged to stop early,
+        ///        0 disables early termination
+        BasicAffinityPropagation(const BasicMatrix<T> &similarities, unsigned int max_iter = 200, double damping = 0.5, unsigned int convergence_iter = 15)
+            : stored_(std::make_unique<StoredSimilarities<T>>(similarities)), similarities_(*stored_), max_iter_(max_iter), damping_(damping),
+              convergence_iter_(convergence_iter)
+        {
+            checkDamping(damping);
+        }
+
+        /// @brief Fit over a packed symmetric similarity matrix, see Parser::getPackedSimilarity(). The matrix has to outlive the fits
+        BasicAffinityPropagation(const BasicPackedSymmetricMatrix<T> &similarities, unsigned int max_iter = 200, double damping = 0.5, unsigned int convergence_iter = 15)
+            : stored_(std::make_unique<PackedSimilarities<T>>(similarities)), similarities_(*stored_), max_iter_(max_iter), damping_(damping),
+              convergence_iter_(convergence_iter)
+        {
+            checkDamping(damping);
+        }
+
+        /// @brief Fit over similarities read tile by tile from a provider, such as PointSimilarities which never stores the matrix.
+        ///        The provider has to outlive the fits
+        BasicAffinityPropagation(const BasicSimilarityProvider<T> &similarities, unsigned int max_iter = 200, double damping = 0.5, unsigned int convergence_iter = 15)
+            : similarities_(similarities), max_iter_(max_iter), damping_(damping), convergence_iter_(convergence_iter)
+        {
+            checkDamping(damping);
+        }
 
         inline void fit()
         {
-            thread_pool_.start();
+            instrumentation_.reset();
+            // A shared pool is started and stopped by its owner
+            if (pool_ == &thread_pool_)
+            {
+                if (thread_count_)
+                    thread_pool_.start(*thread_count_);
+                else
+                    thread_pool_.start();
+            }
 
-            initialize();
+            {
+                auto timer = instrumentation_.time(Phase::Initialize);
+                initialize();
+            }
 
-            for (unsigned int iter = 0; iter < max_iter_; ++iter)
+            converged_ = false;
+            iterations_ = resumed_ ? resumed_iteration_ : 0;
+            unsigned int stable_iterations = resumed_ ? resumed_stable_iterations_ : 0;
+            resumed_ = false;
+            uint64_t source_hash = 0;
+            if constexpr (std::is_same_v<T, double>)
+            {
+                source_hash = checkpoint_ ? sourceHash() : 0;
+            }
+
+            for (unsigned int iter = iterations_; iter < max_iter_; ++iter)
             {
                 auto start = std::chrono::high_resolution_clock::now();
-                updateResponsibility();
-                updateAvailability();
-                auto end = std::chrono::high_resolution_clock::now();
-                auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
-                std::cout << "Iteration " << iter << " out of " << max_iter_ << " finished in " << duration.count() << " milliseconds" << std::endl;
+                IterationStats stats;
+                stats.iteration = iter;
+                {
+                    auto timer = instrumentation_.time(Phase::Responsibility);
+                    stats.responsibility_delta = updateResponsibility();
+                }
+                {
+                    auto timer = instrumentation_.time(Phase::Availability);
+                    stats.availability_delta = updateAvailability();
+                }
+                {
+                    auto timer = instrumentation_.time(Phase::Exemplars);
+                    stats.exemplar_changes = updateExemplars();
+                }
+                stats.exemplars = exemplar_count_;
+                stats.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+                iterations_ = iter + 1;
+                instrumentation_.count(Counter::Iterations);
+                instrumentation_.iteration(stats);
+
+                stable_iterations = stats.exemplar_changes > 0 ? 0 : stable_iterations + 1;
+                if (convergence_iter_ > 0 && stable_iterations >= convergence_iter_ && exemplar_count_ > 0)
+                {
+                    converged_ = true;
+                    break;
+                }
+
+                if constexpr (std::is_same_v<T, double>)
+                {
+                    if (checkpoint_ && checkpoint_->due(iterations_))
+                    {
+                        auto timer = instrumentation_.time(Phase::Checkpoint);
+                        CheckpointState state{iterations_, stable_iterations, max_iter_, convergence_iter_, damping_, {}};
+                        bool written = checkpoint_->write(state, source_hash, responsibilities_, availabilities_, *pool_);
+                        instrumentation_.count(written ? Counter::Checkpoints : Counter::CheckpointsSkipped);
+                    }
+                }
             }
 
-            identifyClusters();
+            {
+                auto timer = instrumentation_.time(Phase::Clusters);
+                identifyClusters();
+            }
+
+            if (checkpoint_)
+            {
+                checkpoint_->wait();
+            }
 
-            thread_pool_.stop();
+            // The double precision copy is placed by the workers before they stop, the reference fit starts its own
+            std::optional<Matrix> converted;
+            if (validate_ && !validation_reference_)
+            {
+                converted = materialize();
+            }
+
+            if (pool_ == &thread_pool_)
+                thread_pool_.stop();
+            instrumentation_.threadPool(pool_->stats());
+            instrumentation_.log(Verbosity::Summary, converged_ ? "Converged" : "Did not converge", " after ", iterations_, " iterations");
+            instrumentation_.logPhases();
+            instrumentation_.logTopology();
+
+            if (validate_)
+            {
+                validate(validation_reference_ ? *validation_reference_ : *converted);
+            }
         }
 
         inline const std::vector<int> &getLabels() const
@@ -42,6 +179,141 @@ namespace AP
             return labels_;
         }
 
+        /// @brief After every fit, fit the same problem again in double precision and compare the labels, see getValidation().
+        ///        Meant for checking that reduced precision is good enough for a kind of data, as it needs the memory and time of the double fit on top.
+        ///        The reference fit runs on the similarities converted to double, which carry the rounding to T and with it
+        ///        ties the original values may not have, prefer the overload taking the original similarities when they are at hand
+        inline void setValidation(bool validate)
+        {
+            validate_ = validate;
+            validation_reference_ = nullptr;
+        }
+
+        /// @brief Validate every fit against a double precision fit of reference, the similarities the ones of this fit were rounded from.
+        ///        reference has to outlive the fits
+        inline void setValidation(const Matrix &reference)
+        {
+            size_t n = similarities_.size();
+            if (reference.rows() != n || reference.cols() != n)
+            {
+                throw std::invalid_argument("Reference similarities have to be of size " + std::to_string(n) + "x" + std::to_string(n));
+            }
+            validate_ = true;
+            validation_reference_ = &reference;
+        }
+
+        /// @brief Comparison with the double precision fit, empty unless the last fit ran with validation
+        inline const std::optional<ValidationReport> &getValidation() const
+        {
+            return validation_;
+        }
+
+        /// @brief Whether the last fit stopped because the exemplar set stabilized
+        inline bool hasConverged() const
+        {
+            return converged_;
+        }
+
+        /// @brief Number of message passing iterations the last fit used
+        inline unsigned int getIterations() const
+        {
+            return iterations_;
+        }
+
+        /// @brief Preferences used instead of the diagonal of the similarity matrix, one per point.
+        ///        Lets several fits share one matrix, an empty vector goes back to the diagonal
+        inline void setPreferences(std::vector<double> preferences)
+        {
+            preferences_ = std::move(preferences);
+        }
+
+        /// @brief Start the next fit from the messages of the previous one instead of from zero,
+        ///        usually converges faster after a small change of the preferences.
+        ///        When rows and columns were appended to the similarity matrix since, the messages are extended with zeros
+        inline void setWarmStart(bool warm_start)
+        {
+            warm_start_ = warm_start;
+        }
+
+        /// @brief Write the iteration counters, configuration and messages to filename after every few iterations,
+        ///        in the background, so an interrupted fit can be continued with resume(). An empty filename turns checkpoints off
+        /// @param every number of iterations between checkpoints
+        inline void setCheckpoint(const std::string &filename, unsigned int every = 10)
+            requires std::is_same_v<T, double>
+        {
+            checkpoint_ = filename.empty() ? nullptr : std::make_unique<CheckpointWriter>(filename, every);
+        }
+
+        /// @brief Load a checkpoint so the next fit() continues where the checkpointed one stopped,
+        ///        with its damping, iteration limit and convergence criterion.
+        ///        The similarities and preferences have to be the ones the checkpoint was taken with
+        inline void resume(const std::string &filename)
+            requires std::is_same_v<T, double>
+        {
+            CheckpointState state;
+            uint64_t source_hash;
+            Matrix messages = readCheckpoint(filename, state, source_hash);
+
+            size_t n = similarities_.size();
+            if (messages.cols() != n)
+            {
+                throw std::invalid_argument("Checkpoint holds messages of " + std::to_string(messages.cols()) + " points, expected " + std::to_string(n));
+            }
+            if (source_hash != sourceHash())
+            {
+                throw std::invalid_argument("Checkpoint was taken with different similarities or preferences: " + filename);
+            }
+            if (state.damping < 0.0 || state.damping >= 1.0)
+            {
+                throw std::runtime_error("Corrupt checkpoint: " + filename);
+            }
+
+            responsibilities_ = Matrix(n, n);
+            availabilities_ = Matrix(n, n);
+            for (size_t i = 0; i < n; ++i)
+            {
+                std::copy_n(messages.row(i).data(), n, responsibilities_.row(i).data());
+                std::copy_n(messages.row(n + i).data(), n, availabilities_.row(i).data());
+            }
+
+            damping_ = state.damping;
+            max_iter_ = static_cast<unsigned int>(state.max_iter);
+            convergence_iter_ = static_cast<unsigned int>(state.convergence_iter);
+            resumed_iteration_ = static_cast<unsigned int>(state.iteration);
+            resumed_stable_iterations_ = static_cast<unsigned int>(state.stable_iterations);
+            resumed_ = true;
+
+            exemplars_.assign(n, 0);
+            updateExemplars();
+        }
+
+        /// @brief Workers started by fit(), 0 runs the fit on the calling thread. Defaults to ThreadPool::defaultThreadCount()
+        inline void setThreadCount(uint32_t count)
+        {
+            thread_count_ = count;
+        }
+
+        /// @brief Run fits on a pool the caller has started and stops, shared with other stages, see Pipeline.
+        ///        setThreadCount() has no effect then
+        inline void setThreadPool(Threading::ThreadPool &pool)
+        {
+            pool_ = &pool;
+        }
+
+        /// @brief Allocate the message matrices and place them by first touch now rather than when fit() starts.
+        ///        Only needs the number of points, so with a shared pool it can run as a task while the similarities are still computed
+        inline void prepare()
+        {
+            allocateMessages(similarities_.size());
+            prepared_ = true;
+        }
+
+        /// @brief Timers, counters and per-iteration statistics of the last fit, also where verbosity is configured
+        inline Instrumentation &getInstrumentation()
+        {
+            return instrumentation_;
+        }
+
         inline std::vector<int> getUniqueClusters()
         {
             std::vector<int> lbls_(labels_);
@@ -52,97 +324,256 @@ namespace AP
         }
 
     private:
+        static inline void checkDamping(double damping)
+        {
+            if (damping < 0.0 || damping >= 1.0)
+            {
+                throw std::invalid_argument("Damping has to be in range [0, 1)");
+            }
+        }
+
         inline void initialize()
         {
-            auto start = std::chrono::high_resolution_clock::now();
             unsigned int n = similarities_.size();
+            if (!preferences_.empty() && preferences_.size() != n)
+            {
+                throw std::invalid_argument("Expected " + std::to_string(n) + " preferences, got " + std::to_string(preferences_.size()));
+            }
 
-            responsibilities_.resize(n, std::vector<double>(n, 0.0));
-            availabilities_.resize(n, std::vector<double>(n, 0.0));
+            if (resumed_)
+            {
+                instrumentation_.log(Verbosity::Summary, "Resuming from a checkpoint after ", resumed_iteration_, " iterations");
+                return;
+            }
 
-            auto end = std::chrono::high_resolution_clock::now();
-            auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+            size_t previous = responsibilities_.rows();
+            if (warm_start_ && previous > 0 && previous <= n)
+            {
+                if (previous < n)
+                {
+                    // Points were appended to the matrix, their messages start at zero next to the existing ones
+                    responsibilities_.resize(n, n, 0.0);
+                    availabilities_.resize(n, n, 0.0);
+                    exemplars_.resize(n, 0);
+                }
+                instrumentation_.log(Verbosity::Summary, "Continuing from the messages of the previous fit with ", n - previous, " new points");
+                return;
+            }
+
+            if (prepared_ && previous == n)
+            {
+                prepared_ = false;
+                instrumentation_.log(Verbosity::Summary, "Using matrices of size ", n, "x", n, " prepared ahead of the fit");
+                return;
+            }
 
-            std::cout << "Prepared matrices of size " << n << "x" << n << " in " << duration.count() << " milliseconds" << std::endl;
-            ;
+            allocateMessages(n);
+            instrumentation_.log(Verbosity::Summary, "Prepared matrices of size ", n, "x", n);
         }
 
-        inline void updateResponsibility()
+        /// @brief Zeroed message matrices, each row block zeroed by the worker that updates it in every iteration
+        inline void allocateMessages(size_t n)
         {
-            unsigned int n = similarities_.size();
+            responsibilities_ = BasicMatrix<T>::uninitialized(n, n);
+            availabilities_ = BasicMatrix<T>::uninitialized(n, n);
+            firstTouch(responsibilities_, *pool_);
+            firstTouch(availabilities_, *pool_);
+            exemplars_.assign(n, 0);
+            exemplar_count_ = 0;
+        }
 
-            for (unsigned int i = 0; i < n; ++i)
-            {
+        /// @return largest change of a responsibility when deltas are tracked, NaN otherwise
+        inline double updateResponsibility()
+        {
+            unsigned int n = similarities_.size();
+            bool track = instrumentation_.trackDeltas();
+            std::atomic<double> delta{0.0};
 
-                for (unsigned int k = 0; k < n; ++k)
+            // r(i,k) = s(i,k) - max_{k' != k} (a(i,k') + s(i,k'))
+            // The maximum excluding k is the row maximum unless k is the argmax,
+            // in which case it is the second largest value, so one scan per row suffices
+            // Similarities come a tile of rows at a time, a computing provider fills scratch while the tile stays in cache
+            size_t tile_rows = similarities_.tileRows();
+            forRowBlocks(
+                [&, n](size_t begin, size_t end)
                 {
-                    thread_pool_.queue_job(
-                        [&, i, k, n]()
+                    std::vector<T> old;
+                    BasicMatrix<T> scratch;
+                    double task_delta = 0.0;
+                    for (size_t tile_begin = begin; tile_begin < end; tile_begin += tile_rows)
+                    {
+                        size_t tile_end = std::min(end, tile_begin + tile_rows);
+                        BasicMatrixView<const T> tile = similarities_.rows(tile_begin, tile_end, scratch);
+                        for (unsigned int i = tile_begin; i < tile_end; ++i)
                         {
-                            double max_val = NEG_INFINITY;
+                            const T *s = tile.row(i - tile_begin).data();
+                            const T *a = availabilities_.row(i).data();
+                            T *r = responsibilities_.row(i).data();
+                            if (track)
+                                old.assign(r, r + n);
 
-                            for (unsigned int kk = 0; kk < k; ++kk)
+                            T first, second;
+                            if (preferences_.empty())
                             {
-                                double val = availabilities_[i][kk] + similarities_[i][kk];
-                                if (val > max_val)
-                                    max_val = val;
+                                simd_.rowTop2(a, s, n, first, second);
+                                simd_.responsibilityRow(s, a, r, n, first, second, static_cast<T>(damping_));
                             }
-
-                            for (unsigned int kk = k + 1; kk < n; ++kk)
+                            else
                             {
-                                double val = availabilities_[i][kk] + similarities_[i][kk];
-                                if (val > max_val)
-                                    max_val = val;
+                                // The shared row is read as it is and this fit's preference replaces s(i,i) around it:
+                                // the top two skip column i and take its overridden value, r(i,i) is then recomputed
+                                T preference = static_cast<T>(preferences_[i]);
+                                T r_ii = r[i];
+                                T after_first, after_second;
+                                simd_.rowTop2(a, s, i, first, second);
+                                simd_.rowTop2(a + i + 1, s + i + 1, n - i - 1, after_first, after_second);
+                                Simd::Scalar::insertTop2<T>(after_first, first, second);
+                                Simd::Scalar::insertTop2<T>(after_second, first, second);
+                                Simd::Scalar::insertTop2<T>(a[i] + preference, first, second);
+                                simd_.responsibilityRow(s, a, r, n, first, second, static_cast<T>(damping_));
+                                r[i] = r_ii;
+                                simd_.responsibilityRow(&preference, a + i, r + i, 1, first, second, static_cast<T>(damping_));
                             }
 
-                            responsibilities_[i][k] = similarities_[i][k] - max_val;
-                        });
-                }
-            }
+                            if (track)
+                                task_delta = std::max(task_delta, maxAbsDifference(old.data(), r, n));
+                        }
+                    }
+                    if (track)
+                        atomicMax(delta, task_delta);
+                });
 
-            thread_pool_.wait();
+            return track ? delta.load() : std::numeric_limits<double>::quiet_NaN();
         }
 
-        inline void updateAvailability()
+        /// @return largest change of an availability when deltas are tracked, NaN otherwise
+        inline double updateAvailability()
         {
             unsigned int n = similarities_.size();
+            size_t blocks = rowBlocks(n);
+            bool track = instrumentation_.trackDeltas();
+            std::atomic<double> delta{0.0};
+            constexpr unsigned int per_line = MATRIX_ALIGNMENT / sizeof(T);
+            size_t strips = (n + per_line - 1) / per_line;
 
-            for (unsigned int i = 0; i < n; ++i)
+            // a(i,k) = min(0, r(k,k) + sum_{i' not in {i,k}} max(0, r(i',k)))
+            // a(k,k) = sum_{i' != k} max(0, r(i',k))
+            // Every row block sums its positive responsibilities per column on the worker owning its rows,
+            // the block sums are added up in block order and the contribution of row i is subtracted back out,
+            // so all passes over the matrices stay on the rows of their worker
+            if (partial_sums_.rows() != blocks || partial_sums_.cols() != n)
             {
-                for (unsigned int k = 0; k < n; ++k)
+                partial_sums_ = BasicMatrix<Sum>::uninitialized(blocks, n);
+            }
+            sums_.resize(n);
+            diagonal_.resize(n);
+
+            pool_->parallel_for_static(0, blocks,
+                [&, n](size_t first_block, size_t last_block)
                 {
-                    thread_pool_.queue_job(
-                        [&, i, k, n]()
+                    for (size_t b = first_block; b < last_block; ++b)
+                    {
+                        Sum *partial = partial_sums_.row(b).data();
+                        std::fill_n(partial, n, Sum(0));
+                        auto [begin, end] = rowBlock(n, b);
+                        for (size_t i = begin; i < end; ++i)
                         {
-                            if (i != k)
-                            {
-                                double sum = 0.0;
-                                for (unsigned int ii = 0; ii < n; ++ii)
-                                {
-                                    if (ii != i && ii != k)
-                                    {
-                                        sum += std::max(0.0, responsibilities_[ii][k]);
-                                    }
-                                }
-                                availabilities_[i][k] = std::min(0.0, responsibilities_[k][k] + sum);
-                            }
+                            if constexpr (std::is_same_v<T, Sum>)
+                                simd_.accumulatePositive(responsibilities_.row(i).data(), partial, n);
                             else
+                                simd_.accumulatePositiveWide(responsibilities_.row(i).data(), partial, n);
+                        }
+                    }
+                });
+
+            pool_->parallel_for(0, strips, Threading::grainSize(*pool_, strips),
+                [&, n](size_t first_strip, size_t last_strip)
+                {
+                    for (size_t strip = first_strip; strip < last_strip; ++strip)
+                    {
+                        unsigned int begin = strip * per_line;
+                        unsigned int end = std::min<size_t>(n, begin + per_line);
+                        Sum total[per_line];
+                        std::copy(partial_sums_.row(0).data() + begin, partial_sums_.row(0).data() + end, total);
+                        for (size_t b = 1; b < blocks; ++b)
+                        {
+                            const Sum *partial = partial_sums_.row(b).data() + begin;
+                            for (unsigned int j = 0; j < end - begin; ++j)
                             {
-                                double sum = 0.0;
-                                for (unsigned int ii = 0; ii < n; ++ii)
-                                {
-                                    if (ii != k)
-                                    {
-                                        sum += std::max(0.0, responsibilities_[ii][k]);
-                                    }
-                                }
-                                availabilities_[i][k] = sum;
+                                total[j] += partial[j];
                             }
-                        });
-                }
+                        }
+                        for (unsigned int j = begin; j < end; ++j)
+                        {
+                            diagonal_[j] = responsibilities_(j, j);
+                            sums_[j] = static_cast<T>(total[j - begin] - std::max<Sum>(0, diagonal_[j]));
+                        }
+                    }
+                });
+
+            forRowBlocks(
+                [&, n](size_t begin, size_t end)
+                {
+                    std::vector<T> old;
+                    double task_delta = 0.0;
+                    for (size_t i = begin; i < end; ++i)
+                    {
+                        T *a = availabilities_.row(i).data();
+                        T old_diagonal = a[i];
+                        if (track)
+                            old.assign(a, a + n);
+
+                        simd_.availabilityRow(responsibilities_.row(i).data(), diagonal_.data(), sums_.data(), a, n, static_cast<T>(damping_));
+                        a[i] = static_cast<T>(damping_ * old_diagonal + (1.0 - damping_) * sums_[i]);
+
+                        if (track)
+                            task_delta = std::max(task_delta, maxAbsDifference(old.data(), a, n));
+                    }
+                    if (track)
+                        atomicMax(delta, task_delta);
+                });
+
+            return track ? delta.load() : std::numeric_limits<double>::quiet_NaN();
+        }
+
+        /// @brief Recompute the exemplar set from the diagonal, point k is an exemplar when r(k,k) + a(k,k) > 0
+        /// @return number of points that joined or left the exemplar set
+        inline unsigned int updateExemplars()
+        {
+            unsigned int n = similarities_.size();
+            unsigned int changed = 0;
+            exemplar_count_ = 0;
+
+            for (unsigned int k = 0; k < n; ++k)
+            {
+                char is_exemplar = responsibilities_(k, k) + availabilities_(k, k) > 0.0;
+                changed += is_exemplar != exemplars_[k];
+                exemplars_[k] = is_exemplar;
+                exemplar_count_ += is_exemplar;
             }
 
-            thread_pool_.wait();
+            return changed;
+        }
+
+        /// @brief Identifies the problem a checkpoint belongs to, the similarities and any preferences overriding their diagonal
+        inline uint64_t sourceHash() const
+            requires std::is_same_v<T, double>
+        {
+            uint64_t h = similarities_.hash();
+            return preferences_.empty() ? h : Binary::hash(preferences_.data(), preferences_.size() * sizeof(double), h);
+        }
+
+        /// @brief Run fn(row_begin, row_end) over the row blocks of every worker, see parallel_for_static.
+        ///        A worker gets the same rows in every call, the ones it touched first in initialize()
+        template <typename F>
+        inline void forRowBlocks(F &&fn)
+        {
+            size_t n = similarities_.size();
+            pool_->parallel_for_static(0, rowBlocks(n),
+                [&](size_t first_block, size_t last_block)
+                {
+                    fn(rowBlock(n, first_block).first, rowBlock(n, last_block - 1).second);
+                });
         }
 
         inline void identifyClusters()
@@ -152,30 +583,107 @@ namespace AP
             labels_.resize(n, -1);
             for (unsigned int i = 0; i < n; ++i)
             {
-                double max_val = NEG_INFINITY;
-                int exemplar = -1;
+                labels_[i] = simd_.argmaxSum(responsibilities_.row(i).data(), availabilities_.row(i).data(), n);
+            }
+        }
 
-                for (unsigned int k = 0; k < n; ++k)
+        /// @brief The similarities converted to double, every row written by the worker owning it
+        inline Matrix materialize()
+        {
+            size_t n = similarities_.size();
+            size_t tile_rows = similarities_.tileRows();
+            Matrix result = Matrix::uninitialized(n, n);
+            forRowBlocks(
+                [&, n](size_t begin, size_t end)
                 {
-                    double val = responsibilities_[i][k] + availabilities_[i][k];
-                    if (val > max_val)
+                    BasicMatrix<T> scratch;
+                    for (size_t tile_begin = begin; tile_begin < end; tile_begin += tile_rows)
                     {
-                        max_val = val;
-                        exemplar = k;
+                        size_t tile_end = std::min(end, tile_begin + tile_rows);
+                        BasicMatrixView<const T> tile = similarities_.rows(tile_begin, tile_end, scratch);
+                        for (size_t i = tile_begin; i < tile_end; ++i)
+                        {
+                            auto row = tile.row(i - tile_begin);
+                            double *out = result.row(i).data();
+                            std::copy(row.begin(), row.end(), out);
+                            std::fill(out + n, out + result.stride(), 0.0);
+                        }
                     }
-                }
+                });
+            return result;
+        }
 
-                labels_[i] = exemplar;
+        /// @brief Fit the double precision copy of the similarities with the same settings and compare its labels to ours
+        inline void validate(const Matrix &reference)
+        {
+            BasicAffinityPropagation<double> fit(reference, max_iter_, damping_, convergence_iter_);
+            fit.setPreferences(preferences_);
+            if (thread_count_)
+                fit.setThreadCount(*thread_count_);
+            fit.fit();
+
+            const std::vector<int> &expected = fit.getLabels();
+            ValidationReport report;
+            report.points = labels_.size();
+            for (size_t i = 0; i < labels_.size(); ++i)
+            {
+                report.mismatched_labels += labels_[i] != expected[i];
             }
+            std::vector<int> ours = getUniqueClusters();
+            std::vector<int> theirs = fit.getUniqueClusters();
+            report.exemplars = ours.size();
+            report.reference_exemplars = theirs.size();
+            report.same_exemplars = ours == theirs;
+            report.reference_iterations = fit.getIterations();
+            report.reference_converged = fit.hasConverged();
+            validation_ = report;
+
+            instrumentation_.log(Verbosity::Summary, "Validation: ", report.mismatched_labels, " of ", report.points, " labels differ from double precision, ",
+                                 report.exemplars, " exemplars against ", report.reference_exemplars,
+                                 report.same_exemplars ? ", the same ones" : ", not the same ones");
         }
 
     private:
         Threading::ThreadPool thread_pool_{};
-        const Matrix &similarities_;
+        /// @brief Pool fits run on, thread_pool_ unless a shared one was set
+        Threading::ThreadPool *pool_ = &thread_pool_;
+        std::optional<uint32_t> thread_count_;
+        const Simd::MessageKernels<T> &simd_ = Simd::messages<T>(Simd::best());
+        /// @brief Provider over the matrix passed to the constructor, empty when a provider was passed instead
+        std::unique_ptr<BasicSimilarityProvider<T>> stored_;
+        const BasicSimilarityProvider<T> &similarities_;
         unsigned int max_iter_;
+        double damping_;
+        unsigned int convergence_iter_;
+        std::vector<double> preferences_;
+        bool warm_start_ = false;
+        /// @brief Messages were allocated by prepare() and not used by a fit yet
+        bool prepared_ = false;
+        std::unique_ptr<CheckpointWriter> checkpoint_;
+        bool resumed_ = false;
+        unsigned int resumed_iteration_ = 0;
+        unsigned int resumed_stable_iterations_ = 0;
+        bool converged_ = false;
+        unsigned int iterations_ = 0;
+        Instrumentation instrumentation_;
+        bool validate_ = false;
+        const Matrix *validation_reference_ = nullptr;
+        std::optional<ValidationReport> validation_;
 
-        Matrix responsibilities_;
-        Matrix availabilities_;
+        BasicMatrix<T> responsibilities_;
+        BasicMatrix<T> availabilities_;
+        /// @brief Column sums of positive responsibilities of every row block
+        BasicMatrix<Sum> partial_sums_;
+        std::vector<T> sums_;
+        std::vector<T> diagonal_;
         std::vector<int> labels_;
+        std::vector<char> exemplars_;
+        unsigned int exemplar_count_ = 0;
     };
+
+    using AffinityPropagation = BasicAffinityPropagation<double>;
+    /// @brief Everything in single precision
+    using AffinityPropagationF = BasicAffinityPropagation<float>;
+    /// @brief Single precision matrices with the column sums accumulated in double
+    using AffinityPropagationMixed = BasicAffinityPropagation<float, double>;
 }
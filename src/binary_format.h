@@ -0,0 +1,211 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <memory>
+#include <fstream>
+#include <stdexcept>
+#include <cstdio>
+#include "matrix.h"
+#include "mapped_file.h"
+
+namespace AP
+{
+    /// Compact binary container for point and similarity matrices.
+    /// A file is a fixed 128 byte header followed by the rows, each padded to the matrix row stride,
+    /// so a mapped file can back an AP::Matrix directly without copying or parsing
+    namespace Binary
+    {
+        constexpr char MAGIC[8] = {'A', 'P', 'M', 'A', 'T', 'R', 'I', 'X'};
+        constexpr uint32_t VERSION = 1;
+        constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+        enum class Kind : uint32_t
+        {
+            Points = 1,
+            Similarity = 2,
+            /// Responsibilities stacked over availabilities, with a CheckpointState after the header, see checkpoint.h
+            Checkpoint = 3,
+            /// Exemplar coordinates, with their indices among the training points after the header, see model.h
+            Model = 4
+        };
+
+        enum class DType : uint32_t
+        {
+            Float64 = 1
+        };
+
+        enum class Metric : uint32_t
+        {
+            None = 0,
+            NegSquaredEuclidean = 1,
+            NegEuclidean = 2,
+            Manhattan = 3,
+            Cosine = 4,
+            Pearson = 5
+        };
+
+        /// @brief Value of Header::diagonal when no diagonal policy applies, such as for points
+        constexpr int32_t NO_DIAGONAL = -1;
+
+        struct Header
+        {
+            char magic[8];
+            uint32_t version;
+            uint32_t byte_order;
+            Kind kind;
+            DType dtype;
+            uint64_t rows;
+            uint64_t cols;
+            uint64_t stride;
+            uint64_t data_offset;
+            /// @brief Hash of the data the matrix was computed from, the source file for points and the points for similarities
+            uint64_t source_hash;
+            Metric metric;
+            /// @brief Diagonal policy the stored diagonal was filled with, NO_DIAGONAL for points
+            int32_t diagonal;
+            /// @brief Statistics of the similarity matrix used to derive the preference, see Parser::getSimilarity
+            double stat_min;
+            double stat_max;
+            double stat_median;
+            uint8_t reserved[32];
+        };
+        static_assert(sizeof(Header) == 128, "Binary header has to stay 128 bytes");
+
+        /// @brief Header for a matrix of the given shape with every other field zeroed
+        inline Header makeHeader(Kind kind, size_t rows, size_t cols)
+        {
+            Header header{};
+            std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+            header.version = VERSION;
+            header.byte_order = BYTE_ORDER_MARK;
+            header.kind = kind;
+            header.dtype = DType::Float64;
+            header.rows = rows;
+            header.cols = cols;
+            header.stride = Matrix::paddedStride(cols);
+            header.data_offset = std::max<size_t>(sizeof(Header), MATRIX_ALIGNMENT);
+            header.metric = Metric::None;
+            header.diagonal = NO_DIAGONAL;
+            return header;
+        }
+
+        inline Header makeHeader(Kind kind, const Matrix &m)
+        {
+            return makeHeader(kind, m.rows(), m.cols());
+        }
+
+        /// @brief 64-bit non-cryptographic hash, processes eight bytes per step
+        inline uint64_t hash(const void *data, size_t size, uint64_t seed = 0xcbf29ce484222325ull)
+        {
+            constexpr uint64_t prime = 0x100000001b3ull;
+            const unsigned char *bytes = static_cast<const unsigned char *>(data);
+            uint64_t h = seed ^ (size * prime);
+
+            size_t i = 0;
+            for (; i + 8 <= size; i += 8)
+            {
+                uint64_t word;
+                std::memcpy(&word, bytes + i, 8);
+                h = (h ^ word) * prime;
+                h ^= h >> 29;
+            }
+            for (; i < size; ++i)
+            {
+                h = (h ^ bytes[i]) * prime;
+            }
+
+            h ^= h >> 33;
+            h *= 0xff51afd7ed558ccdull;
+            h ^= h >> 33;
+            return h;
+        }
+
+        /// @brief Hash of the matrix values, row padding is ignored
+        inline uint64_t hash(const Matrix &m)
+        {
+            uint64_t h = hash(nullptr, 0, m.rows() * 31 + m.cols());
+            for (size_t i = 0; i < m.rows(); ++i)
+            {
+                h = hash(m.row(i).data(), m.cols() * sizeof(double), h);
+            }
+            return h;
+        }
+
+        /// @brief Write the header and matrix to filename. The file is written next to its destination
+        ///        and renamed into place, so readers never observe a partial file
+        /// @param extra optional bytes stored between the header and the data, header.data_offset has to leave room for them
+        inline void write(const std::string &filename, const Header &header, const Matrix &m, const void *extra = nullptr, size_t extra_size = 0)
+        {
+            if (sizeof(Header) + extra_size > header.data_offset)
+            {
+                throw std::invalid_argument("Binary header leaves no room for " + std::to_string(extra_size) + " extra bytes");
+            }
+
+            std::string temporary = filename + ".tmp";
+            {
+                std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+                if (!out)
+                {
+                    throw std::runtime_error("Error creating file: " + temporary);
+                }
+
+                out.write(reinterpret_cast<const char *>(&header), sizeof(Header));
+                if (extra_size > 0)
+                {
+                    out.write(static_cast<const char *>(extra), extra_size);
+                }
+                std::string padding(header.data_offset - sizeof(Header) - extra_size, '\0');
+                out.write(padding.data(), padding.size());
+
+                for (size_t i = 0; i < m.rows(); ++i)
+                {
+                    out.write(reinterpret_cast<const char *>(m.row(i).data()), m.stride() * sizeof(double));
+                }
+
+                if (!out)
+                {
+                    throw std::runtime_error("Error writing file: " + temporary);
+                }
+            }
+
+            if (std::rename(temporary.c_str(), filename.c_str()) != 0)
+            {
+                std::remove(temporary.c_str());
+                throw std::runtime_error("Error renaming " + temporary + " to " + filename);
+            }
+        }
+
+        /// @brief Map filename and return a matrix backed by the mapping.
+        ///        Pages are copy-on-write, so the matrix can be modified without touching the file
+        /// @param filename file written by Binary::write
+        /// @param header receives the header of the file
+        /// @param kind expected kind of matrix
+        inline Matrix read(const std::string &filename, Header &header, Kind kind)
+        {
+            auto file = std::make_shared<MappedFile>(filename, MappedFile::Mode::CopyOnWrite);
+            if (file->size() < sizeof(Header))
+            {
+                throw std::runtime_error("File too small for a binary matrix: " + filename);
+            }
+            std::memcpy(&header, file->data(), sizeof(Header));
+
+            if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION || header.byte_order != BYTE_ORDER_MARK)
+            {
+                throw std::runtime_error("Not a binary matrix of this version and byte order: " + filename);
+            }
+            if (header.kind != kind || header.dtype != DType::Float64)
+            {
+                throw std::runtime_error("Unexpected matrix kind or element type in: " + filename);
+            }
+            if (header.stride != Matrix::paddedStride(header.cols) || header.data_offset % MATRIX_ALIGNMENT != 0 ||
+                file->size() < header.data_offset + header.rows * header.stride * sizeof(double))
+            {
+                throw std::runtime_error("Corrupt binary matrix: " + filename);
+            }
+
+            double *data = reinterpret_cast<double *>(file->mutableData() + header.data_offset);
+            return Matrix(data, header.rows, header.cols, header.stride, std::move(file));
+        }
+    }
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include <string>
+#include <cstdio>
+#include <iostream>
+#include <filesystem>
+#include "binary_format.h"
+
+namespace AP
+{
+    /// @brief Directory of binary matrices addressed by a content hash.
+    ///        A failing cache never fails the run, errors are reported and the matrix is simply recomputed
+    class MatrixCache
+    {
+    public:
+        explicit MatrixCache(std::string directory)
+            : directory_(std::move(directory))
+        {
+            std::error_code ec;
+            std::filesystem::create_directories(directory_, ec);
+            if (ec)
+            {
+                std::cerr << "Cannot create cache directory " << directory_ << ": " << ec.message() << std::endl;
+            }
+        }
+
+        /// @brief Path of the cache entry for a kind of matrix and key
+        inline std::string path(Binary::Kind kind, uint64_t key) const
+        {
+            char name[64];
+            std::snprintf(name, sizeof(name), "%s-%016llx.apm", kind == Binary::Kind::Points ? "points" : "similarity",
+                          static_cast<unsigned long long>(key));
+            return (std::filesystem::path(directory_) / name).string();
+        }
+
+        /// @brief Map the cached matrix for key if there is one
+        /// @return true when header and m were filled from the cache
+        inline bool load(Binary::Kind kind, uint64_t key, Binary::Header &header, Matrix &m) const
+        {
+            std::string file = path(kind, key);
+            std::error_code ec;
+            if (!std::filesystem::exists(file, ec))
+                return false;
+
+            try
+            {
+                Matrix cached = Binary::read(file, header, kind);
+                if (header.source_hash != key)
+                    return false;
+                m = std::move(cached);
+                return true;
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "Ignoring unreadable cache entry: " << e.what() << std::endl;
+                return false;
+            }
+        }
+
+        /// @brief Store m under key, header.source_hash is set to key
+        inline void store(Binary::Kind kind, uint64_t key, Binary::Header header, const Matrix &m) const
+        {
+            header.source_hash = key;
+            try
+            {
+                Binary::write(path(kind, key), header, m);
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "Cannot write cache entry: " << e.what() << std::endl;
+            }
+        }
+
+    private:
+        std::string directory_;
+    };
+}
@@ -0,0 +1,142 @@
+#pragma once
+#include <string>
+#include <future>
+#include <fstream>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include "matrix.h"
+#include "threadpool.h"
+#include "binary_format.h"
+
+namespace AP
+{
+    /// @brief Everything besides the messages needed to continue a fit, stored right after the binary header
+    struct CheckpointState
+    {
+        /// @brief Iterations completed when the checkpoint was taken
+        uint64_t iteration;
+        /// @brief Iterations the exemplar set had been unchanged for
+        uint64_t stable_iterations;
+        uint64_t max_iter;
+        uint64_t convergence_iter;
+        double damping;
+        uint8_t reserved[24];
+    };
+    static_assert(sizeof(CheckpointState) == 64, "Checkpoint state has to stay 64 bytes");
+
+    /// @brief Offset of the messages in a checkpoint file, the header and the state each take one part of it
+    constexpr uint64_t CHECKPOINT_DATA_OFFSET = 256;
+
+    /// @brief Periodic checkpoints of the messages of a fit, written on a background thread.
+    ///        Taking a checkpoint only copies the responsibilities and availabilities into a snapshot buffer,
+    ///        which costs 2 n^2 doubles of memory. A checkpoint that comes due while the previous one is still being written is skipped,
+    ///        so a slow disk never stalls the iterations. Like the matrix cache, a failing checkpoint never fails the fit, errors are reported
+    class CheckpointWriter
+    {
+    public:
+        /// @param filename destination, replaced atomically by every checkpoint
+        /// @param every take a checkpoint after every this many iterations
+        CheckpointWriter(std::string filename, unsigned int every)
+            : filename_(std::move(filename)), every_(every)
+        {
+            if (every == 0)
+            {
+                throw std::invalid_argument("Checkpoint interval has to be positive");
+            }
+        }
+
+        CheckpointWriter(const CheckpointWriter &) = delete;
+        CheckpointWriter &operator=(const CheckpointWriter &) = delete;
+
+        ~CheckpointWriter()
+        {
+            wait();
+        }
+
+        /// @brief Whether a checkpoint is due once the given number of iterations has completed
+        inline bool due(uint64_t iterations) const
+        {
+            return iterations > 0 && iterations % every_ == 0;
+        }
+
+        /// @brief Snapshot the messages and write them in the background
+        /// @param source_hash identifies the similarities and preferences the messages belong to
+        /// @return false when the previous checkpoint is still being written and this one was skipped
+        inline bool write(const CheckpointState &state, uint64_t source_hash, const Matrix &responsibilities, const Matrix &availabilities,
+                          Threading::ThreadPool &pool)
+        {
+            if (pending_.valid() && pending_.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            {
+                return false;
+            }
+            wait();
+
+            size_t n = responsibilities.rows();
+            if (snapshot_.rows() != 2 * n || snapshot_.cols() != n)
+            {
+                snapshot_ = Matrix(2 * n, n);
+            }
+            pool.parallel_for(0, n, std::max<size_t>(1, n / (8 * std::max<size_t>(1, pool.size()))),
+                [&](size_t begin, size_t end)
+                {
+                    size_t bytes = (end - begin) * snapshot_.stride() * sizeof(double);
+                    std::memcpy(snapshot_.row(begin).data(), responsibilities.row(begin).data(), bytes);
+                    std::memcpy(snapshot_.row(n + begin).data(), availabilities.row(begin).data(), bytes);
+                });
+
+            Binary::Header header = Binary::makeHeader(Binary::Kind::Checkpoint, snapshot_);
+            header.data_offset = CHECKPOINT_DATA_OFFSET;
+            header.source_hash = source_hash;
+            pending_ = std::async(std::launch::async, [this, header, state]()
+                                  { Binary::write(filename_, header, snapshot_, &state, sizeof(state)); });
+            return true;
+        }
+
+        /// @brief Block until the checkpoint being written, if any, is on disk
+        inline void wait()
+        {
+            if (!pending_.valid())
+                return;
+            try
+            {
+                pending_.get();
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "Cannot write checkpoint: " << e.what() << std::endl;
+            }
+        }
+
+    private:
+        std::string filename_;
+        unsigned int every_;
+        Matrix snapshot_;
+        std::future<void> pending_;
+    };
+
+    /// @brief Read a checkpoint written by CheckpointWriter
+    /// @param state receives the iteration counters and configuration of the fit
+    /// @param source_hash receives the hash of the similarities and preferences the messages belong to
+    /// @return the responsibilities stacked over the availabilities, 2n x n, backed by the mapped file
+    inline Matrix readCheckpoint(const std::string &filename, CheckpointState &state, uint64_t &source_hash)
+    {
+        Binary::Header header;
+        Matrix messages = Binary::read(filename, header, Binary::Kind::Checkpoint);
+        if (header.rows != 2 * header.cols || header.data_offset < sizeof(Binary::Header) + sizeof(CheckpointState))
+        {
+            throw std::runtime_error("Corrupt checkpoint: " + filename);
+        }
+
+        std::ifstream in(filename, std::ios::binary);
+        in.seekg(sizeof(Binary::Header));
+        in.read(reinterpret_cast<char *>(&state), sizeof(state));
+        if (!in)
+        {
+            throw std::runtime_error("Error reading checkpoint: " + filename);
+        }
+
+        source_hash = header.source_hash;
+        return messages;
+    }
+}
@@ -0,0 +1,353 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <chrono>
+#include <optional>
+#include <algorithm>
+#include <stdexcept>
+#include "matrix.h"
+#include "threadpool.h"
+#include "simd.h"
+#include "binary_format.h"
+#include "instrumentation.h"
+#include "transport.h"
+
+namespace AP
+{
+    namespace Distributed
+    {
+        /// @brief Rows [first, second) of an n row matrix owned by the given rank, contiguous and balanced to within one row
+        inline std::pair<size_t, size_t> rowRange(size_t n, unsigned int rank, unsigned int size)
+        {
+            return {n * rank / size, n * (rank + 1) / size};
+        }
+    }
+
+    /// @brief Affinity propagation split over the processes of a transport group, see Distributed::launch.
+    ///        Every worker holds one contiguous slab of rows of the similarities, responsibilities and availabilities,
+    ///        so the matrices of a group can outgrow the memory of a single process or NUMA node.
+    ///        Responsibilities only need the own rows. Availabilities need the column sums of positive responsibilities,
+    ///        the workers exchange their partial sums and the responsibility diagonal in one allreduce of 2n values per iteration.
+    ///        Every worker derives the same exemplar set from the reduced values, so all of them stop after the same iteration.
+    ///        Labels are the same as those of AffinityPropagation up to rounding of the column sums
+    class DistributedAffinityPropagation
+    {
+    public:
+        /// @param transport group this worker belongs to, every rank has to construct the fit with the same arguments
+        /// @param similarity_file n x n similarity matrix in the Binary format with the preferences on the diagonal,
+        ///        only the rows of this rank are read, see Parser::writeSimilarity
+        /// @param max_iter upper bound on the number of message passing iterations
+        /// @param damping weight of the previous message when blending with the new one, in [0, 1)
+        /// @param convergence_iter number of iterations the exemplar set has to stay unchanged to stop early,
+        ///        0 disables early termination
+        DistributedAffinityPropagation(Distributed::Transport &transport, const std::string &similarity_file, unsigned int max_iter = 200,
+                                       double damping = 0.5, unsigned int convergence_iter = 15)
+            : transport_(transport), max_iter_(max_iter), damping_(damping), convergence_iter_(convergence_iter)
+        {
+            if (damping < 0.0 || damping >= 1.0)
+            {
+                throw std::invalid_argument("Damping has to be in range [0, 1)");
+            }
+
+            Binary::Header header;
+            Matrix mapped = Binary::read(similarity_file, header, Binary::Kind::Similarity);
+            if (header.rows != header.cols)
+            {
+                throw std::invalid_argument("Similarity matrix has to be square: " + similarity_file);
+            }
+
+            n_ = header.rows;
+            std::tie(first_, last_) = Distributed::rowRange(n_, transport_.rank(), transport_.size());
+            similarities_ = Matrix(last_ - first_, n_);
+            for (size_t i = first_; i < last_; ++i)
+            {
+                std::copy_n(mapped.row(i).data(), n_, similarities_.row(i - first_).data());
+            }
+        }
+
+        inline void fit()
+        {
+            instrumentation_.reset();
+            if (thread_count_)
+                thread_pool_.start(*thread_count_);
+            else
+                thread_pool_.start();
+
+            {
+                auto timer = instrumentation_.time(Phase::Initialize);
+                initialize();
+            }
+
+            converged_ = false;
+            iterations_ = 0;
+            unsigned int stable_iterations = 0;
+
+            for (unsigned int iter = 0; iter < max_iter_; ++iter)
+            {
+                auto start = std::chrono::high_resolution_clock::now();
+                IterationStats stats;
+                stats.iteration = iter;
+                {
+                    auto timer = instrumentation_.time(Phase::Responsibility);
+                    stats.responsibility_delta = updateResponsibility();
+                }
+                {
+                    auto timer = instrumentation_.time(Phase::Availability);
+                    stats.availability_delta = updateAvailability();
+                }
+                {
+                    auto timer = instrumentation_.time(Phase::Exemplars);
+                    stats.exemplar_changes = updateExemplars();
+                }
+                stats.exemplars = exemplar_count_;
+                stats.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+                iterations_ = iter + 1;
+                instrumentation_.count(Counter::Iterations);
+                instrumentation_.iteration(stats);
+
+                stable_iterations = stats.exemplar_changes > 0 ? 0 : stable_iterations + 1;
+                if (convergence_iter_ > 0 && stable_iterations >= convergence_iter_ && exemplar_count_ > 0)
+                {
+                    converged_ = true;
+                    break;
+                }
+            }
+
+            {
+                auto timer = instrumentation_.time(Phase::Clusters);
+                identifyClusters();
+            }
+
+            thread_pool_.stop();
+            instrumentation_.threadPool(thread_pool_.stats());
+            instrumentation_.log(Verbosity::Summary, "Worker ", transport_.rank(), converged_ ? " converged" : " did not converge", " after ", iterations_, " iterations");
+            instrumentation_.logPhases();
+            instrumentation_.logTopology();
+        }
+
+        /// @brief Labels of all n points, the same on every worker
+        inline const std::vector<int> &getLabels() const
+        {
+            return labels_;
+        }
+
+        /// @brief Whether the last fit stopped because the exemplar set stabilized
+        inline bool hasConverged() const
+        {
+            return converged_;
+        }
+
+        /// @brief Number of message passing iterations the last fit used
+        inline unsigned int getIterations() const
+        {
+            return iterations_;
+        }
+
+        /// @brief Rows [first, second) of the matrices held by this worker
+        inline std::pair<size_t, size_t> getRows() const
+        {
+            return {first_, last_};
+        }
+
+        /// @brief Workers started by fit() in this process, 0 runs the fit on the calling thread.
+        ///        Defaults to ThreadPool::defaultThreadCount(), with several workers on one machine split the hardware threads between them
+        inline void setThreadCount(uint32_t count)
+        {
+            thread_count_ = count;
+        }
+
+        /// @brief Timers, counters and per-iteration statistics of this worker's last fit, also where verbosity is configured.
+        ///        The deltas cover the rows of this worker and the communication phase is part of the availability phase
+        inline Instrumentation &getInstrumentation()
+        {
+            return instrumentation_;
+        }
+
+        inline std::vector<int> getUniqueClusters()
+        {
+            std::vector<int> lbls_(labels_);
+            std::sort(lbls_.begin(), lbls_.end());
+            auto last = std::unique(lbls_.begin(), lbls_.end());
+            lbls_.erase(last, lbls_.end());
+            return lbls_;
+        }
+
+    private:
+        inline void initialize()
+        {
+            size_t rows = last_ - first_;
+            responsibilities_ = Matrix(rows, n_, 0.0);
+            availabilities_ = Matrix(rows, n_, 0.0);
+            exchange_.assign(2 * n_, 0.0);
+            availability_diagonal_.assign(n_, 0.0);
+            exemplars_.assign(n_, 0);
+            exemplar_count_ = 0;
+
+            instrumentation_.log(Verbosity::Summary, "Worker ", transport_.rank(), " of ", transport_.size(), " prepared rows ", first_, " to ", last_, " of ", n_);
+        }
+
+        /// @return largest change of a responsibility of this worker when deltas are tracked, NaN otherwise
+        inline double updateResponsibility()
+        {
+            size_t rows = last_ - first_;
+            unsigned int n = n_;
+            bool track = instrumentation_.trackDeltas();
+            std::atomic<double> delta{0.0};
+
+            // Row-local, as in AffinityPropagation
+            thread_pool_.parallel_for(0, rows, Threading::grainSize(thread_pool_, rows),
+                [&, n](size_t begin, size_t end)
+                {
+                    std::vector<double> old;
+                    double task_delta = 0.0;
+                    for (size_t i = begin; i < end; ++i)
+                    {
+                        const double *s = similarities_.row(i).data();
+                        const double *a = availabilities_.row(i).data();
+                        double *r = responsibilities_.row(i).data();
+                        if (track)
+                            old.assign(r, r + n);
+
+                        double first, second;
+                        simd_.rowTop2(a, s, n, first, second);
+                        simd_.responsibilityRow(s, a, r, n, first, second, damping_);
+
+                        if (track)
+                            task_delta = std::max(task_delta, maxAbsDifference(old.data(), r, n));
+                    }
+                    if (track)
+                        atomicMax(delta, task_delta);
+                });
+
+            return track ? delta.load() : std::numeric_limits<double>::quiet_NaN();
+        }
+
+        /// @return largest change of an availability of this worker when deltas are tracked, NaN otherwise
+        inline double updateAvailability()
+        {
+            size_t rows = last_ - first_;
+            unsigned int n = n_;
+            bool track = instrumentation_.trackDeltas();
+            std::atomic<double> delta{0.0};
+            constexpr unsigned int per_line = MATRIX_ALIGNMENT / sizeof(double);
+            size_t strips = (n + per_line - 1) / per_line;
+
+            // The first half of the exchange receives this worker's column sums of positive responsibilities,
+            // the second half the responsibility diagonal of its rows, zero elsewhere, so the allreduce yields both in full
+            std::fill(exchange_.begin(), exchange_.end(), 0.0);
+            double *sums = exchange_.data();
+            double *diagonal = exchange_.data() + n;
+
+            thread_pool_.parallel_for(0, strips, Threading::grainSize(thread_pool_, strips),
+                [&, n](size_t first_strip, size_t last_strip)
+                {
+                    unsigned int begin = first_strip * per_line;
+                    unsigned int width = std::min<size_t>(n, last_strip * per_line) - begin;
+                    for (size_t i = 0; i < rows; ++i)
+                    {
+                        simd_.accumulatePositive(responsibilities_.row(i).data() + begin, sums + begin, width);
+                    }
+                });
+            for (size_t k = first_; k < last_; ++k)
+            {
+                diagonal[k] = responsibilities_(k - first_, k);
+            }
+
+            {
+                auto timer = instrumentation_.time(Phase::Communication);
+                transport_.allreduce(exchange_.data(), exchange_.size());
+            }
+
+            // Every worker keeps the same copy of the availability diagonal, which the exemplar set is read from
+            for (size_t k = 0; k < n; ++k)
+            {
+                sums[k] -= std::max(0.0, diagonal[k]);
+                availability_diagonal_[k] = damping_ * availability_diagonal_[k] + (1.0 - damping_) * sums[k];
+            }
+
+            // With the column sums complete the rows are independent
+            thread_pool_.parallel_for(0, rows, Threading::grainSize(thread_pool_, rows),
+                [&, n](size_t begin, size_t end)
+                {
+                    std::vector<double> old;
+                    double task_delta = 0.0;
+                    for (size_t i = begin; i < end; ++i)
+                    {
+                        double *a = availabilities_.row(i).data();
+                        if (track)
+                            old.assign(a, a + n);
+
+                        simd_.availabilityRow(responsibilities_.row(i).data(), diagonal, sums, a, n, damping_);
+                        a[first_ + i] = availability_diagonal_[first_ + i];
+
+                        if (track)
+                            task_delta = std::max(task_delta, maxAbsDifference(old.data(), a, n));
+                    }
+                    if (track)
+                        atomicMax(delta, task_delta);
+                });
+
+            return track ? delta.load() : std::numeric_limits<double>::quiet_NaN();
+        }
+
+        /// @brief Recompute the exemplar set from the reduced diagonals, point k is an exemplar when r(k,k) + a(k,k) > 0
+        /// @return number of points that joined or left the exemplar set
+        inline unsigned int updateExemplars()
+        {
+            const double *diagonal = exchange_.data() + n_;
+            unsigned int changed = 0;
+            exemplar_count_ = 0;
+
+            for (size_t k = 0; k < n_; ++k)
+            {
+                char is_exemplar = diagonal[k] + availability_diagonal_[k] > 0.0;
+                changed += is_exemplar != exemplars_[k];
+                exemplars_[k] = is_exemplar;
+                exemplar_count_ += is_exemplar;
+            }
+
+            return changed;
+        }
+
+        /// @brief Label the own rows and gather all labels on every worker
+        inline void identifyClusters()
+        {
+            std::vector<double> labels(n_, 0.0);
+            for (size_t i = first_; i < last_; ++i)
+            {
+                labels[i] = simd_.argmaxSum(responsibilities_.row(i - first_).data(), availabilities_.row(i - first_).data(), n_);
+            }
+            {
+                auto timer = instrumentation_.time(Phase::Communication);
+                transport_.allreduce(labels.data(), labels.size());
+            }
+            labels_.assign(labels.begin(), labels.end());
+        }
+
+    private:
+        Distributed::Transport &transport_;
+        Threading::ThreadPool thread_pool_{};
+        std::optional<uint32_t> thread_count_;
+        const Simd::Kernels &simd_ = Simd::best();
+        unsigned int max_iter_;
+        double damping_;
+        unsigned int convergence_iter_;
+        bool converged_ = false;
+        unsigned int iterations_ = 0;
+        Instrumentation instrumentation_;
+
+        size_t n_ = 0;
+        size_t first_ = 0;
+        size_t last_ = 0;
+        /// @brief Rows first_ to last_ of each matrix
+        Matrix similarities_;
+        Matrix responsibilities_;
+        Matrix availabilities_;
+        /// @brief Partial column sums and responsibility diagonal before the allreduce, the complete ones after
+        std::vector<double> exchange_;
+        std::vector<double> availability_diagonal_;
+        std::vector<int> labels_;
+        std::vector<char> exemplars_;
+        unsigned int exemplar_count_ = 0;
+    };
+}
@@ -0,0 +1,394 @@
+#pragma once
+#include <vector>
+#include <random>
+#include <chrono>
+#include <limits>
+#include <numeric>
+#include <algorithm>
+#include <stdexcept>
+#include "matrix.h"
+#include "threadpool.h"
+#include "simd.h"
+#include "similarity.h"
+#include "statistics.h"
+#include "affinity_propagation.h"
+#include "instrumentation.h"
+
+namespace AP
+{
+    /// @brief Partitioned affinity propagation for datasets whose n x n similarity matrix does not fit in memory.
+    ///        The points are shuffled into blocks of at most block_size points, every block is clustered on its own
+    ///        and the exemplars of all blocks, each weighted by the number of points it represents, are clustered again.
+    ///        Levels are added until the exemplars fit in a single block, then every point follows the chain of its
+    ///        exemplars to the final one. Memory is O(block_size^2) per worker instead of O(n^2).
+    ///        The result approximates a flat fit with the same preference, it is not identical to it
+    class HierarchicalAffinityPropagation
+    {
+    public:
+        /// @param points n x d points, compared by negative squared Euclidean distance
+        /// @param block_size largest number of points clustered together
+        /// @param max_iter upper bound on the number of message passing iterations of every block
+        /// @param damping weight of the previous message when blending with the new one, in [0, 1)
+        /// @param convergence_iter number of iterations the exemplar set of a block has to stay unchanged to stop early
+        /// @param diagonal preference policy, evaluated once on a sample of point pairs and used for every block
+        /// @param percentile percentile in [0, 100] used by the Percentile policy
+        /// @param seed seed of the partition and of the preference sample
+        HierarchicalAffinityPropagation(const Matrix &points, size_t block_size = 1000, unsigned int max_iter = 200, double damping = 0.5,
+                                        unsigned int convergence_iter = 15, Diagonal diagonal = Median, double percentile = 50.0, uint64_t seed = 1)
+            : points_(points), block_size_(block_size), max_iter_(max_iter), damping_(damping), convergence_iter_(convergence_iter),
+              diagonal_(diagonal), percentile_(percentile), seed_(seed)
+        {
+            if (damping < 0.0 || damping >= 1.0)
+            {
+                throw std::invalid_argument("Damping has to be in range [0, 1)");
+            }
+            if (block_size < 2)
+            {
+                throw std::invalid_argument("Block size has to be at least 2");
+            }
+            if (!(percentile >= 0.0 && percentile <= 100.0))
+            {
+                throw std::invalid_argument("Percentile has to be in range [0, 100]");
+            }
+        }
+
+        inline void fit()
+        {
+            instrumentation_.reset();
+            thread_pool_.start();
+
+            size_t n = points_.rows();
+            converged_ = true;
+            levels_ = 0;
+            labels_.assign(n, -1);
+
+            {
+                auto timer = instrumentation_.time(Phase::Initialize);
+                preference_ = estimatePreference();
+            }
+
+            if (n == 0)
+            {
+                thread_pool_.stop();
+                return;
+            }
+
+            // parents[level][b] is the position of the exemplar of point b of a level among the points of the next level
+            std::vector<int> current(n);
+            std::iota(current.begin(), current.end(), 0);
+            std::vector<double> weights(n, 1.0);
+            std::vector<std::vector<int>> parents;
+            std::vector<std::vector<int>> level_points;
+            std::mt19937_64 generator(seed_);
+
+            while (true)
+            {
+                auto start = std::chrono::high_resolution_clock::now();
+                size_t count = current.size();
+                size_t blocks = (count + block_size_ - 1) / block_size_;
+
+                std::vector<size_t> order(count);
+                std::iota(order.begin(), order.end(), 0);
+                if (blocks > 1)
+                {
+                    std::shuffle(order.begin(), order.end(), generator);
+                }
+
+                std::vector<int> parent = clusterLevel(current, weights, order, blocks);
+                parents.push_back(parent);
+                level_points.push_back(current);
+                ++levels_;
+
+                std::vector<int> exemplars;
+                std::vector<double> exemplar_weights;
+                std::vector<int> position(count, -1);
+                for (size_t b = 0; b < count; ++b)
+                {
+                    int e = parent[b];
+                    if (position[e] < 0)
+                    {
+                        position[e] = static_cast<int>(exemplars.size());
+                        exemplars.push_back(current[e]);
+                        exemplar_weights.push_back(0.0);
+                    }
+                    exemplar_weights[position[e]] += weights[b];
+                }
+
+                instrumentation_.log(Verbosity::Summary, "Level ", levels_, " clustered ", count, " points in ", blocks, blocks == 1 ? " block" : " blocks",
+                                     " into ", exemplars.size(), " exemplars in ",
+                                     std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count(), " milliseconds");
+
+                if (blocks == 1)
+                {
+                    break;
+                }
+                if (exemplars.size() == count)
+                {
+                    thread_pool_.stop();
+                    throw std::runtime_error("Hierarchical affinity propagation made no progress, lower the preference or raise the block size");
+                }
+
+                // Turn the parents into positions among the next level
+                for (size_t b = 0; b < count; ++b)
+                {
+                    parents.back()[b] = position[parent[b]];
+                }
+                current = std::move(exemplars);
+                weights = std::move(exemplar_weights);
+            }
+
+            {
+                auto timer = instrumentation_.time(Phase::Clusters);
+
+                // Follow every point through the levels, the last level still holds positions within that level
+                std::vector<int> final_exemplar(level_points.back().size());
+                for (size_t b = 0; b < final_exemplar.size(); ++b)
+                {
+                    final_exemplar[b] = level_points.back()[parents.back()[b]];
+                }
+                for (size_t level = parents.size() - 1; level-- > 0;)
+                {
+                    std::vector<int> below(parents[level].size());
+                    for (size_t b = 0; b < below.size(); ++b)
+                    {
+                        below[b] = final_exemplar[parents[level][b]];
+                    }
+                    final_exemplar = std::move(below);
+                }
+                labels_ = std::move(final_exemplar);
+            }
+
+            thread_pool_.stop();
+            instrumentation_.threadPool(thread_pool_.stats());
+            instrumentation_.log(Verbosity::Summary, converged_ ? "Every block converged" : "Some blocks did not converge", ", ", levels_, levels_ == 1 ? " level" : " levels");
+            instrumentation_.logPhases();
+        }
+
+        /// @brief Index of the final exemplar of every point
+        inline const std::vector<int> &getLabels() const
+        {
+            return labels_;
+        }
+
+        /// @brief Whether every block of every level converged
+        inline bool hasConverged() const
+        {
+            return converged_;
+        }
+
+        /// @brief Number of levels the last fit needed, 1 when all points fit in a single block
+        inline unsigned int getLevels() const
+        {
+            return levels_;
+        }
+
+        /// @brief Preference the last fit used for every block
+        inline double getPreference() const
+        {
+            return preference_;
+        }
+
+        /// @brief Timers and counters of the last fit, also where verbosity is configured
+        inline Instrumentation &getInstrumentation()
+        {
+            return instrumentation_;
+        }
+
+        inline std::vector<int> getUniqueClusters()
+        {
+            std::vector<int> lbls_(labels_);
+            std::sort(lbls_.begin(), lbls_.end());
+            auto last = std::unique(lbls_.begin(), lbls_.end());
+            lbls_.erase(last, lbls_.end());
+            return lbls_;
+        }
+
+    private:
+        /// @brief Result of clustering one block
+        struct BlockResult
+        {
+            std::vector<int> exemplars;
+            unsigned int iterations = 0;
+            bool converged = false;
+        };
+
+        /// @brief Cluster every block of a level
+        /// @param current point indices of this level
+        /// @param weights number of original points each of them represents
+        /// @param order positions within current, block b takes the b-th equal share of it
+        /// @return position within current of the exemplar of every position
+        inline std::vector<int> clusterLevel(const std::vector<int> &current, const std::vector<double> &weights, const std::vector<size_t> &order, size_t blocks)
+        {
+            size_t count = current.size();
+            std::vector<BlockResult> results(blocks);
+            auto blockRange = [&](size_t b)
+            {
+                return std::make_pair(b * count / blocks, (b + 1) * count / blocks);
+            };
+
+            // Blocks are independent, with enough of them each runs on one worker, otherwise they take turns using all of them
+            bool block_parallel = blocks >= thread_pool_.size();
+            auto runBlock = [&](size_t b)
+            {
+                auto [begin, end] = blockRange(b);
+                std::vector<size_t> members(order.begin() + begin, order.begin() + end);
+                results[b] = clusterBlock(current, weights, members, !block_parallel);
+            };
+
+            if (block_parallel)
+            {
+                thread_pool_.parallel_for(0, blocks, 1,
+                    [&](size_t begin, size_t end)
+                    {
+                        for (size_t b = begin; b < end; ++b)
+                            runBlock(b);
+                    });
+            }
+            else
+            {
+                for (size_t b = 0; b < blocks; ++b)
+                    runBlock(b);
+            }
+
+            std::vector<int> parent(count, -1);
+            for (size_t b = 0; b < blocks; ++b)
+            {
+                auto [begin, end] = blockRange(b);
+                for (size_t m = begin; m < end; ++m)
+                {
+                    parent[order[m]] = static_cast<int>(order[begin + results[b].exemplars[m - begin]]);
+                }
+                converged_ = converged_ && results[b].converged;
+                instrumentation_.count(Counter::Iterations, results[b].iterations);
+                instrumentation_.count(Counter::SimilarityEntries, (end - begin) * (end - begin));
+            }
+            return parent;
+        }
+
+        /// @brief Weighted affinity propagation over one block. A point standing in for w original points
+        ///        gets s'(i, k) = w * s(i, k), so choosing an exemplar costs what it would cost all of them
+        /// @param members positions within current of the points of the block
+        /// @param use_pool true to run the fit of the block on the running pool, false to run it on the calling thread
+        /// @return exemplar of every member, as an index into members
+        inline BlockResult clusterBlock(const std::vector<int> &current, const std::vector<double> &weights, const std::vector<size_t> &members, bool use_pool)
+        {
+            size_t m = members.size();
+            size_t d = points_.cols();
+
+            Matrix block_points(m, d);
+            for (size_t a = 0; a < m; ++a)
+            {
+                auto src = points_.row(current[members[a]]);
+                std::copy(src.begin(), src.end(), block_points.row(a).begin());
+            }
+
+            Matrix similarities(m, m, 0.0);
+            Similarity::Operands operands = Similarity::prepare(block_points, simd_);
+            size_t tile = Similarity::blockRows(d);
+            for (size_t row_begin = 0; row_begin < m; row_begin += tile)
+            {
+                for (size_t col_begin = row_begin; col_begin < m; col_begin += tile)
+                {
+                    size_t rows = std::min(tile, m - row_begin);
+                    size_t cols = std::min(tile, m - col_begin);
+                    Similarity::computeBlock(operands, similarities.block(row_begin, col_begin, rows, cols), row_begin, col_begin, simd_);
+                    Similarity::mirror(similarities.view(), row_begin, rows, col_begin, cols);
+                }
+            }
+
+            for (size_t a = 0; a < m; ++a)
+            {
+                double weight = weights[members[a]];
+                auto row = similarities.row(a);
+                if (weight != 1.0)
+                {
+                    for (double &value : row)
+                        value *= weight;
+                }
+                row[a] = preference_;
+            }
+
+            AffinityPropagation ap(similarities, max_iter_, damping_, convergence_iter_);
+            if (use_pool)
+            {
+                ap.setThreadPool(thread_pool_);
+            }
+            else
+            {
+                ap.setThreadCount(0);
+            }
+            ap.fit();
+
+            return BlockResult{ap.getLabels(), ap.getIterations(), ap.hasConverged()};
+        }
+
+        /// @brief Preference from about a million random pairs of distinct points,
+        ///        so every block and level uses the same one, Min and Max are estimates like Median and Percentile
+        inline double estimatePreference()
+        {
+            size_t n = points_.rows();
+            size_t d = points_.cols();
+            if (n < 2)
+            {
+                return 0.0;
+            }
+
+            size_t samples = std::min<size_t>(size_t(1) << 20, n * (n - 1));
+            std::vector<double> values(samples);
+            std::mt19937_64 generator(seed_ ^ 0x9e3779b97f4a7c15ull);
+            std::uniform_int_distribution<size_t> pick(0, n - 1);
+            for (double &value : values)
+            {
+                size_t i = pick(generator);
+                size_t j = pick(generator);
+                while (j == i)
+                    j = pick(generator);
+                value = simd_.negSquaredEuclidean(points_.row(i).data(), points_.row(j).data(), d);
+            }
+
+            auto quantile = [&](double q)
+            {
+                auto nth = values.begin() + Math::quantileRank(values.size(), q);
+                std::nth_element(values.begin(), nth, values.end());
+                return *nth;
+            };
+
+            switch (diagonal_)
+            {
+            case Min:
+                return *std::min_element(values.begin(), values.end());
+            case Max:
+                return *std::max_element(values.begin(), values.end());
+            case Median:
+                return quantile(0.5);
+            case Percentile:
+                return quantile(percentile_ / 100.0);
+            case Inf:
+                return std::numeric_limits<double>::infinity();
+            case NegInf:
+                return -std::numeric_limits<double>::infinity();
+            case Zero:
+            default:
+                return 0.0;
+            }
+        }
+
+    private:
+        Threading::ThreadPool thread_pool_{};
+        const Simd::Kernels &simd_ = Simd::best();
+        const Matrix &points_;
+        size_t block_size_;
+        unsigned int max_iter_;
+        double damping_;
+        unsigned int convergence_iter_;
+        Diagonal diagonal_;
+        double percentile_;
+        uint64_t seed_;
+        bool converged_ = false;
+        unsigned int levels_ = 0;
+        double preference_ = 0.0;
+        Instrumentation instrumentation_;
+
+        std::vector<int> labels_;
+    };
+}
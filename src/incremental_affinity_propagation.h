@@ -0,0 +1,181 @@
+#pragma once
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+#include "matrix.h"
+#include "threadpool.h"
+#include "simd.h"
+#include "similarity.h"
+#include "statistics.h"
+#include "affinity_propagation.h"
+#include "instrumentation.h"
+
+namespace AP
+{
+    /// @brief Affinity propagation over a growing set of points.
+    ///        add() appends points and computes only the similarities of the new rows and columns,
+    ///        the next fit() then continues from the messages of the previous one, with zero messages for the new points,
+    ///        instead of starting over. After adding a few percent of points this usually takes a fraction of the iterations of a cold fit
+    class IncrementalAffinityPropagation
+    {
+    public:
+        /// @param points initial n x d points, compared by negative squared Euclidean distance
+        /// @param diagonal preference policy, evaluated on the initial points and kept for every point added later
+        /// @param max_iter upper bound on the number of message passing iterations of each fit
+        /// @param damping weight of the previous message when blending with the new one, in [0, 1)
+        /// @param convergence_iter number of iterations the exemplar set has to stay unchanged to stop early
+        /// @param percentile percentile in [0, 100] used by the Percentile policy
+        IncrementalAffinityPropagation(const Matrix &points, Diagonal diagonal = Median, unsigned int max_iter = 200, double damping = 0.5,
+                                       unsigned int convergence_iter = 15, double percentile = 50.0)
+            : points_(points), affinity_propagation_(similarities_, max_iter, damping, convergence_iter)
+        {
+            if (!(percentile >= 0.0 && percentile <= 100.0))
+            {
+                throw std::invalid_argument("Percentile has to be in range [0, 100]");
+            }
+
+            affinity_propagation_.setWarmStart(true);
+            similarities_ = Matrix(points_.rows(), points_.rows(), 0.0);
+            extendSimilarities(0);
+
+            thread_pool_.start();
+            preference_ = Math::preference(similarities_.view(), diagonal, percentile, thread_pool_);
+            thread_pool_.stop();
+            setDiagonal(0);
+        }
+
+        /// @brief Append points, the next fit() continues from the current messages
+        /// @param points m x d points with the same dimension as the initial ones
+        inline void add(const Matrix &points)
+        {
+            if (points.cols() != points_.cols())
+            {
+                throw std::invalid_argument("Expected points with " + std::to_string(points_.cols()) + " dimensions, got " + std::to_string(points.cols()));
+            }
+
+            size_t first = points_.rows();
+            size_t n = first + points.rows();
+            points_.resize(n, points_.cols());
+            for (size_t i = 0; i < points.rows(); ++i)
+            {
+                auto src = points.row(i);
+                std::copy(src.begin(), src.end(), points_.row(first + i).begin());
+            }
+
+            similarities_.resize(n, n, 0.0);
+            extendSimilarities(first);
+            setDiagonal(first);
+        }
+
+        /// @brief Run message passing, from zero the first time and from the previous messages afterwards
+        inline void fit()
+        {
+            affinity_propagation_.fit();
+        }
+
+        inline const std::vector<int> &getLabels() const
+        {
+            return affinity_propagation_.getLabels();
+        }
+
+        inline bool hasConverged() const
+        {
+            return affinity_propagation_.hasConverged();
+        }
+
+        /// @brief Number of message passing iterations the last fit used
+        inline unsigned int getIterations() const
+        {
+            return affinity_propagation_.getIterations();
+        }
+
+        inline std::vector<int> getUniqueClusters()
+        {
+            return affinity_propagation_.getUniqueClusters();
+        }
+
+        inline const Matrix &getPoints() const
+        {
+            return points_;
+        }
+
+        /// @brief Similarity matrix of all points so far, with the preference on the diagonal
+        inline const Matrix &getSimilarities() const
+        {
+            return similarities_;
+        }
+
+        /// @brief Preference placed on the diagonal of every point
+        inline double getPreference() const
+        {
+            return preference_;
+        }
+
+        /// @brief Timers, counters and per-iteration statistics of the last fit, also where verbosity is configured
+        inline Instrumentation &getInstrumentation()
+        {
+            return affinity_propagation_.getInstrumentation();
+        }
+
+    private:
+        /// @brief Fill every similarity involving a point at index first or later.
+        ///        Blocks of the old rows against the new columns and the upper triangle of the new rows against the new columns
+        ///        are computed and mirrored, so the matrix stays exactly symmetric
+        inline void extendSimilarities(size_t first)
+        {
+            size_t n = points_.rows();
+            if (first >= n)
+            {
+                return;
+            }
+
+            Similarity::Operands operands = Similarity::prepare(points_, simd_);
+            size_t tile = Similarity::blockRows(points_.cols());
+            std::vector<std::pair<size_t, size_t>> blocks;
+            for (size_t col_begin = first; col_begin < n; col_begin += tile)
+            {
+                for (size_t row_begin = 0; row_begin < first; row_begin += tile)
+                {
+                    blocks.emplace_back(row_begin, col_begin);
+                }
+                for (size_t row_begin = first; row_begin <= col_begin; row_begin += tile)
+                {
+                    blocks.emplace_back(row_begin, col_begin);
+                }
+            }
+
+            MatrixView similarities = similarities_.view();
+            thread_pool_.start();
+            thread_pool_.parallel_for(0, blocks.size(), 1,
+                [&](size_t begin, size_t end)
+                {
+                    for (size_t b = begin; b < end; ++b)
+                    {
+                        auto [row_begin, col_begin] = blocks[b];
+                        size_t rows = std::min(tile, (row_begin < first ? first : n) - row_begin);
+                        size_t cols = std::min(tile, n - col_begin);
+                        Similarity::computeBlock(operands, similarities.block(row_begin, col_begin, rows, cols), row_begin, col_begin, simd_);
+                        Similarity::mirror(similarities, row_begin, rows, col_begin, cols);
+                    }
+                });
+            thread_pool_.stop();
+        }
+
+        inline void setDiagonal(size_t first)
+        {
+            for (size_t i = first; i < similarities_.rows(); ++i)
+            {
+                similarities_(i, i) = preference_;
+            }
+        }
+
+    private:
+        Threading::ThreadPool thread_pool_{};
+        const Simd::Kernels &simd_ = Simd::best();
+        Matrix points_;
+        Matrix similarities_;
+        double preference_ = 0.0;
+        AffinityPropagation affinity_propagation_;
+    };
+}
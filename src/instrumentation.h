@@ -0,0 +1,321 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "threadpool.h"
+
+namespace AP
+{
+    /// @brief How much the library writes to std::cout
+    enum class Verbosity
+    {
+        /// Nothing, the default
+        Off,
+        /// One line per phase of parsing, similarity construction and fitting
+        Summary,
+        /// Summary plus one line per message passing iteration
+        Iterations
+    };
+
+    enum class Phase
+    {
+        Parse,
+        Similarity,
+        Initialize,
+        Responsibility,
+        Availability,
+        Exemplars,
+        Clusters,
+        Checkpoint,
+        /// Waiting for and combining the partial sums of the other workers of a distributed fit
+        Communication,
+        Count
+    };
+
+    enum class Counter
+    {
+        ParsedRows,
+        SimilarityEntries,
+        CacheHits,
+        CacheMisses,
+        Iterations,
+        Checkpoints,
+        CheckpointsSkipped,
+        Count
+    };
+
+    struct PhaseStats
+    {
+        uint64_t calls = 0;
+        double total_ms = 0.0;
+        double max_ms = 0.0;
+    };
+
+    /// @brief What happened in one message passing iteration
+    struct IterationStats
+    {
+        unsigned int iteration = 0;
+        double milliseconds = 0.0;
+        /// @brief Largest absolute change of any responsibility, NaN unless message deltas are tracked
+        double responsibility_delta = std::numeric_limits<double>::quiet_NaN();
+        /// @brief Largest absolute change of any availability, NaN unless message deltas are tracked
+        double availability_delta = std::numeric_limits<double>::quiet_NaN();
+        unsigned int exemplars = 0;
+        /// @brief Points that became or stopped being exemplars in this iteration
+        unsigned int exemplar_changes = 0;
+    };
+
+    /// @brief Largest |a[k] - b[k]| over n elements
+    template <typename T>
+    inline double maxAbsDifference(const T *a, const T *b, size_t n)
+    {
+        double result = 0.0;
+        for (size_t k = 0; k < n; ++k)
+        {
+            result = std::max<double>(result, std::abs(a[k] - b[k]));
+        }
+        return result;
+    }
+
+    /// @brief Raise target to value if value is larger, safe against concurrent callers
+    inline void atomicMax(std::atomic<double> &target, double value)
+    {
+        double current = target.load(std::memory_order_relaxed);
+        while (value > current && !target.compare_exchange_weak(current, value, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    /// @brief Timers, counters and per-iteration statistics of one parser or fit.
+    ///        Everything is recorded by the thread driving the work, at phase granularity, so recording costs
+    ///        a clock read per phase. Report through a per-iteration callback, the accessors or toJSON()
+    class Instrumentation
+    {
+    public:
+        /// @brief Adds the lifetime of the timer to a phase
+        class ScopedTimer
+        {
+        public:
+            ScopedTimer(Instrumentation &instrumentation, Phase phase)
+                : instrumentation_(instrumentation), phase_(phase), start_(std::chrono::high_resolution_clock::now()) {}
+
+            ScopedTimer(const ScopedTimer &) = delete;
+            ScopedTimer &operator=(const ScopedTimer &) = delete;
+
+            ~ScopedTimer()
+            {
+                instrumentation_.record(phase_, elapsed());
+            }
+
+            /// @brief Milliseconds since the timer started
+            inline double elapsed() const
+            {
+                return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start_).count();
+            }
+
+        private:
+            Instrumentation &instrumentation_;
+            Phase phase_;
+            std::chrono::high_resolution_clock::time_point start_;
+        };
+
+        inline ScopedTimer time(Phase phase)
+        {
+            return ScopedTimer(*this, phase);
+        }
+
+        inline void record(Phase phase, double milliseconds)
+        {
+            PhaseStats &stats = phases_[static_cast<size_t>(phase)];
+            ++stats.calls;
+            stats.total_ms += milliseconds;
+            stats.max_ms = std::max(stats.max_ms, milliseconds);
+        }
+
+        inline void count(Counter counter, uint64_t amount = 1)
+        {
+            counters_[static_cast<size_t>(counter)] += amount;
+        }
+
+        /// @brief Store the statistics of an iteration, hand them to the callback and log them
+        inline void iteration(const IterationStats &stats)
+        {
+            iterations_.push_back(stats);
+            if (callback_)
+            {
+                callback_(stats);
+            }
+            log(Verbosity::Iterations, "Iteration ", stats.iteration, " finished in ", stats.milliseconds, " milliseconds, ",
+                stats.exemplars, " exemplars (", stats.exemplar_changes, " changed)");
+        }
+
+        /// @brief Add the activity of a thread pool since it was started
+        inline void threadPool(const Threading::ThreadPool::Stats &stats)
+        {
+            pool_.workers = std::max(pool_.workers, stats.workers);
+            pool_.tasks += stats.tasks;
+            pool_.steals += stats.steals;
+            pool_.max_queue_depth = std::max(pool_.max_queue_depth, stats.max_queue_depth);
+            pool_.idle_ms += stats.idle_ms;
+            if (!stats.cpus.empty())
+            {
+                pool_.affinity = stats.affinity;
+                pool_.cpus = stats.cpus;
+            }
+        }
+
+        /// @brief Log the NUMA nodes and where the workers of the last pool ran, at Summary verbosity
+        inline void logTopology() const
+        {
+            const Threading::Topology &topology = Threading::Topology::current();
+            log(Verbosity::Summary, "Topology: ", topology.nodes().size(), " NUMA nodes with ", topology.cpus(), " CPUs, ",
+                pool_.workers, " workers with ", Threading::name(pool_.affinity), " affinity");
+        }
+
+        /// @brief Log one line per phase that ran, at Summary verbosity
+        inline void logPhases() const
+        {
+            for (size_t p = 0; p < phases_.size(); ++p)
+            {
+                if (phases_[p].calls > 0)
+                {
+                    log(Verbosity::Summary, "Phase ", name(static_cast<Phase>(p)), " took ", phases_[p].total_ms, " milliseconds over ",
+                        phases_[p].calls, phases_[p].calls == 1 ? " call" : " calls");
+                }
+            }
+        }
+
+        /// @brief Write the arguments as one line to std::cout when the verbosity is at least level
+        template <typename... Args>
+        inline void log(Verbosity level, const Args &...args) const
+        {
+            if (verbosity_ != Verbosity::Off && verbosity_ >= level)
+            {
+                (std::cout << ... << args) << '\n';
+            }
+        }
+
+        inline void setVerbosity(Verbosity verbosity) { verbosity_ = verbosity; }
+        inline Verbosity verbosity() const { return verbosity_; }
+
+        /// @brief Called with the statistics of every iteration as soon as it finishes
+        inline void setCallback(std::function<void(const IterationStats &)> callback) { callback_ = std::move(callback); }
+
+        /// @brief Measure the largest message change of every iteration, costs a copy of each row before it is updated
+        inline void setTrackDeltas(bool track) { track_deltas_ = track; }
+        inline bool trackDeltas() const { return track_deltas_; }
+
+        /// @brief Forget everything recorded, settings are kept
+        inline void reset()
+        {
+            phases_ = {};
+            counters_ = {};
+            iterations_.clear();
+            pool_ = {};
+        }
+
+        inline const PhaseStats &phase(Phase phase) const { return phases_[static_cast<size_t>(phase)]; }
+        inline uint64_t counter(Counter counter) const { return counters_[static_cast<size_t>(counter)]; }
+        inline const std::vector<IterationStats> &iterations() const { return iterations_; }
+        inline const Threading::ThreadPool::Stats &poolStats() const { return pool_; }
+
+        static inline const char *name(Phase phase)
+        {
+            static const char *names[] = {"parse", "similarity", "initialize", "responsibility", "availability", "exemplars", "clusters", "checkpoint", "communication"};
+            return names[static_cast<size_t>(phase)];
+        }
+
+        static inline const char *name(Counter counter)
+        {
+            static const char *names[] = {"parsed_rows", "similarity_entries", "cache_hits", "cache_misses", "iterations", "checkpoints", "checkpoints_skipped"};
+            return names[static_cast<size_t>(counter)];
+        }
+
+        /// @brief Everything recorded as a JSON object, phases that never ran are left out
+        inline std::string toJSON() const
+        {
+            std::ostringstream out;
+            auto number = [&](double value)
+            {
+                if (std::isfinite(value))
+                    out << value;
+                else
+                    out << "null";
+            };
+
+            out << "{\"phases\": {";
+            bool first = true;
+            for (size_t p = 0; p < phases_.size(); ++p)
+            {
+                if (phases_[p].calls == 0)
+                    continue;
+                out << (first ? "" : ", ") << "\"" << name(static_cast<Phase>(p)) << "\": {\"calls\": " << phases_[p].calls << ", \"total_ms\": ";
+                number(phases_[p].total_ms);
+                out << ", \"max_ms\": ";
+                number(phases_[p].max_ms);
+                out << "}";
+                first = false;
+            }
+
+            out << "}, \"counters\": {";
+            for (size_t c = 0; c < counters_.size(); ++c)
+            {
+                out << (c ? ", " : "") << "\"" << name(static_cast<Counter>(c)) << "\": " << counters_[c];
+            }
+
+            out << "}, \"thread_pool\": {\"workers\": " << pool_.workers << ", \"tasks\": " << pool_.tasks << ", \"steals\": " << pool_.steals
+                << ", \"max_queue_depth\": " << pool_.max_queue_depth << ", \"idle_ms\": ";
+            number(pool_.idle_ms);
+            out << ", \"affinity\": \"" << Threading::name(pool_.affinity) << "\", \"cpus\": [";
+            for (size_t w = 0; w < pool_.cpus.size(); ++w)
+            {
+                out << (w ? ", " : "") << pool_.cpus[w];
+            }
+
+            const Threading::Topology &topology = Threading::Topology::current();
+            out << "]}, \"topology\": {\"nodes\": [";
+            for (size_t n = 0; n < topology.nodes().size(); ++n)
+            {
+                out << (n ? ", " : "") << "[";
+                for (size_t c = 0; c < topology.nodes()[n].size(); ++c)
+                {
+                    out << (c ? ", " : "") << topology.nodes()[n][c];
+                }
+                out << "]";
+            }
+            out << "]";
+
+            out << "}, \"iterations\": [";
+            for (size_t i = 0; i < iterations_.size(); ++i)
+            {
+                const IterationStats &it = iterations_[i];
+                out << (i ? ", " : "") << "{\"iteration\": " << it.iteration << ", \"ms\": ";
+                number(it.milliseconds);
+                out << ", \"responsibility_delta\": ";
+                number(it.responsibility_delta);
+                out << ", \"availability_delta\": ";
+                number(it.availability_delta);
+                out << ", \"exemplars\": " << it.exemplars << ", \"exemplar_changes\": " << it.exemplar_changes << "}";
+            }
+            out << "]}";
+            return out.str();
+        }
+
+    private:
+        Verbosity verbosity_ = Verbosity::Off;
+        bool track_deltas_ = false;
+        std::function<void(const IterationStats &)> callback_;
+        std::array<PhaseStats, static_cast<size_t>(Phase::Count)> phases_{};
+        std::array<uint64_t, static_cast<size_t>(Counter::Count)> counters_{};
+        std::vector<IterationStats> iterations_;
+        Threading::ThreadPool::Stats pool_;
+    };
+}
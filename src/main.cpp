@@ -2,6 +2,7 @@
 #include <chrono>
 #include "affinity_propagation.h"
 #include "parser.h"
+#include "pipeline.h"
 
 /**
  * Affinity propagation implementation by Matěj Eliáš 2023
@@ -43,13 +44,23 @@
 
 int main(int argc, char *argv[])
 {
-    AP::Parser parser{};
-    //parser.parseTXT("../data/test_extra_small.txt");
-    parser.parseCSV("../data/test.csv");
-    AP::Matrix similarities = parser.getSimilarity(AP::Diagonal::Min);
+    // Parsing, similarities and the allocation of the messages overlap on one pool
+    AP::Pipeline pipeline(10);
+    pipeline.getParser().getInstrumentation().setVerbosity(AP::Verbosity::Summary);
+    try
+    {
+        //pipeline.loadTXT("../data/test_extra_small.txt", AP::Diagonal::Min);
+        pipeline.loadCSV("../data/test.csv", AP::Diagonal::Min);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
 
     auto start = std::chrono::high_resolution_clock::now();
-    AP::AffinityPropagation affinityPropagation(similarities, 10);
+    AP::AffinityPropagation &affinityPropagation = pipeline.affinityPropagation();
+    affinityPropagation.getInstrumentation().setVerbosity(AP::Verbosity::Summary);
     affinityPropagation.fit();
 
     const std::vector<int> &labels = affinityPropagation.getLabels();
@@ -62,6 +73,8 @@ int main(int argc, char *argv[])
     }
     std::cout << " }" << std::endl;
 
+    std::cout << (affinityPropagation.hasConverged() ? "Converged" : "Did not converge") << " after " << affinityPropagation.getIterations() << " iterations" << std::endl;
+
     std::cout << "\n-------------\nCluster members:\n------------\n";
     for (size_t i = 0; i < labels.size(); ++i)
     {
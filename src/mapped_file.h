@@ -0,0 +1,167 @@
+#pragma once
+#include <string>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace AP
+{
+    /// @brief Memory mapping of a whole file, unmapped on destruction
+    class MappedFile
+    {
+    public:
+        enum class Mode
+        {
+            /// Pages can only be read
+            ReadOnly,
+            /// Pages can be written, writes stay private to the process and never reach the file
+            CopyOnWrite,
+            /// Pages can be written and writes go to the file
+            ReadWrite
+        };
+
+        MappedFile() = default;
+
+        explicit MappedFile(const std::string &filename, Mode mode = Mode::ReadOnly)
+        {
+            int fd = ::open(filename.c_str(), mode == Mode::ReadWrite ? O_RDWR : O_RDONLY);
+            if (fd < 0)
+            {
+                throw std::runtime_error("Error opening file: " + filename + ": " + std::strerror(errno));
+            }
+
+            struct stat st;
+            if (::fstat(fd, &st) != 0)
+            {
+                int err = errno;
+                ::close(fd);
+                throw std::runtime_error("Error reading size of file: " + filename + ": " + std::strerror(err));
+            }
+
+            size_ = static_cast<size_t>(st.st_size);
+            if (size_ > 0)
+            {
+                int protection = mode == Mode::ReadOnly ? PROT_READ : PROT_READ | PROT_WRITE;
+                int sharing = mode == Mode::ReadWrite ? MAP_SHARED : MAP_PRIVATE;
+                void *mapped = ::mmap(nullptr, size_, protection, sharing, fd, 0);
+                if (mapped == MAP_FAILED)
+                {
+                    int err = errno;
+                    ::close(fd);
+                    throw std::runtime_error("Error mapping file: " + filename + ": " + std::strerror(err));
+                }
+                data_ = static_cast<char *>(mapped);
+                ::madvise(mapped, size_, MADV_SEQUENTIAL);
+            }
+            ::close(fd);
+        }
+
+        /// @brief Create or truncate filename to size zero bytes and map it shared read-write.
+        ///        The file is sparse, so no data is written until pages are touched
+        static inline MappedFile create(const std::string &filename, size_t size)
+        {
+            int fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0)
+            {
+                throw std::runtime_error("Error creating file: " + filename + ": " + std::strerror(errno));
+            }
+            if (::ftruncate(fd, static_cast<off_t>(size)) != 0)
+            {
+                int err = errno;
+                ::close(fd);
+                throw std::runtime_error("Error resizing file: " + filename + ": " + std::strerror(err));
+            }
+
+            MappedFile file;
+            file.size_ = size;
+            if (size > 0)
+            {
+                void *mapped = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                if (mapped == MAP_FAILED)
+                {
+                    int err = errno;
+                    ::close(fd);
+                    throw std::runtime_error("Error mapping file: " + filename + ": " + std::strerror(err));
+                }
+                file.data_ = static_cast<char *>(mapped);
+            }
+            ::close(fd);
+            return file;
+        }
+
+        /// @brief Give the kernel an madvise hint for a range inside any mapping, the range is widened to whole pages
+        static inline void advise(const void *address, size_t length, int advice)
+        {
+            if (length == 0)
+                return;
+            uintptr_t page = static_cast<uintptr_t>(::sysconf(_SC_PAGESIZE));
+            uintptr_t begin = reinterpret_cast<uintptr_t>(address) & ~(page - 1);
+            uintptr_t end = reinterpret_cast<uintptr_t>(address) + length;
+            ::madvise(reinterpret_cast<void *>(begin), end - begin, advice);
+        }
+
+        /// @brief Start writing back dirty pages of a range of a shared mapping without waiting for it
+        static inline void flushAsync(const void *address, size_t length)
+        {
+            if (length == 0)
+                return;
+            uintptr_t page = static_cast<uintptr_t>(::sysconf(_SC_PAGESIZE));
+            uintptr_t begin = reinterpret_cast<uintptr_t>(address) & ~(page - 1);
+            uintptr_t end = reinterpret_cast<uintptr_t>(address) + length;
+            ::msync(reinterpret_cast<void *>(begin), end - begin, MS_ASYNC);
+        }
+
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+
+        MappedFile(MappedFile &&other) noexcept
+            : data_(other.data_), size_(other.size_)
+        {
+            other.data_ = nullptr;
+            other.size_ = 0;
+        }
+
+        MappedFile &operator=(MappedFile &&other) noexcept
+        {
+            if (this != &other)
+            {
+                unmap();
+                data_ = other.data_;
+                size_ = other.size_;
+                other.data_ = nullptr;
+                other.size_ = 0;
+            }
+            return *this;
+        }
+
+        ~MappedFile()
+        {
+            unmap();
+        }
+
+        inline const char *data() const { return data_; }
+        /// @brief Writable pointer, only valid for CopyOnWrite and ReadWrite mappings
+        inline char *mutableData() { return data_; }
+        inline size_t size() const { return size_; }
+        inline const char *begin() const { return data_; }
+        inline const char *end() const { return data_ + size_; }
+
+    private:
+        inline void unmap()
+        {
+            if (data_ != nullptr)
+            {
+                ::munmap(data_, size_);
+                data_ = nullptr;
+            }
+        }
+
+        char *data_ = nullptr;
+        size_t size_ = 0;
+    };
+}
@@ -2,11 +2,250 @@
 #include <iostream>
 #include <vector>
 #include <cmath>
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <span>
+#include <cstring>
+#include <limits>
+#include "threadpool.h"
 
 namespace AP
 {
+    /// @brief Alignment of every matrix row in bytes, one cache line
+    constexpr size_t MATRIX_ALIGNMENT = 64;
 
-    typedef std::vector<std::vector<double>> Matrix;
+    /// @brief Non-owning strided view of a two dimensional block of values.
+    ///        Element (i, j) lives at data[i * row_stride + j * col_stride],
+    ///        so a transposed view is just a view with swapped strides
+    template <typename T>
+    class BasicMatrixView
+    {
+    public:
+        BasicMatrixView(T *data, size_t rows, size_t cols, size_t row_stride, size_t col_stride = 1)
+            : data_(data), rows_(rows), cols_(cols), row_stride_(row_stride), col_stride_(col_stride) {}
+
+        inline T &operator()(size_t i, size_t j) const
+        {
+            return data_[i * row_stride_ + j * col_stride_];
+        }
+
+        inline size_t rows() const { return rows_; }
+        inline size_t cols() const { return cols_; }
+        inline size_t rowStride() const { return row_stride_; }
+        inline size_t colStride() const { return col_stride_; }
+        inline T *data() const { return data_; }
+
+        /// @brief Row i as a span, only valid when the view is not transposed
+        inline std::span<T> row(size_t i) const
+        {
+            return std::span<T>(data_ + i * row_stride_, cols_);
+        }
+
+        /// @brief View of the same memory with rows and columns swapped, no copy is made
+        inline BasicMatrixView transposed() const
+        {
+            return BasicMatrixView(data_, cols_, rows_, col_stride_, row_stride_);
+        }
+
+        /// @brief Sub-block starting at (row, col) with the given extent
+        inline BasicMatrixView block(size_t row, size_t col, size_t rows, size_t cols) const
+        {
+            return BasicMatrixView(data_ + row * row_stride_ + col * col_stride_, rows, cols, row_stride_, col_stride_);
+        }
+
+    private:
+        T *data_;
+        size_t rows_;
+        size_t cols_;
+        size_t row_stride_;
+        size_t col_stride_;
+    };
+
+    using MatrixView = BasicMatrixView<double>;
+
+    /// @brief Dense row-major matrix stored in a single cache-line aligned buffer.
+    ///        Rows are padded to a multiple of the cache line so every row starts aligned
+    template <typename T>
+    class BasicMatrix
+    {
+    public:
+        BasicMatrix() = default;
+
+        BasicMatrix(size_t rows, size_t cols, T value = T(0))
+            : rows_(rows), cols_(cols), stride_(paddedStride(cols)), data_(allocate(rows * paddedStride(cols)))
+        {
+            std::fill_n(data_.get(), rows_ * stride_, value);
+        }
+
+        /// @brief Matrix over memory it does not own, such as a memory mapped file.
+        ///        owner keeps that memory alive for as long as the matrix exists, data has to be MATRIX_ALIGNMENT aligned
+        BasicMatrix(T *data, size_t rows, size_t cols, size_t stride, std::shared_ptr<void> owner)
+            : rows_(rows), cols_(cols), stride_(stride), data_(data, AlignedDelete{std::move(owner)}) {}
+
+        /// @brief Matrix whose memory has not been written yet, so its pages are not placed on any NUMA node until first touched,
+        ///        see firstTouch()
+        static inline BasicMatrix uninitialized(size_t rows, size_t cols)
+        {
+            BasicMatrix m;
+            m.rows_ = rows;
+            m.cols_ = cols;
+            m.stride_ = paddedStride(cols);
+            m.data_ = allocate(rows * m.stride_);
+            return m;
+        }
+
+        BasicMatrix(const BasicMatrix &other)
+            : rows_(other.rows_), cols_(other.cols_), stride_(other.stride_), data_(allocate(other.rows_ * other.stride_))
+        {
+            if (rows_ * stride_ > 0)
+                std::memcpy(data_.get(), other.data_.get(), rows_ * stride_ * sizeof(T));
+        }
+
+        BasicMatrix(BasicMatrix &&other) noexcept = default;
+
+        BasicMatrix &operator=(const BasicMatrix &other)
+        {
+            if (this != &other)
+            {
+                BasicMatrix copy(other);
+                *this = std::move(copy);
+            }
+            return *this;
+        }
+
+        BasicMatrix &operator=(BasicMatrix &&other) noexcept = default;
+
+        inline size_t rows() const { return rows_; }
+        inline size_t cols() const { return cols_; }
+        inline size_t stride() const { return stride_; }
+        inline bool empty() const { return rows_ == 0 || cols_ == 0; }
+
+        /// @brief Row stride in elements used for a matrix with the given number of columns
+        static inline size_t paddedStride(size_t cols)
+        {
+            constexpr size_t per_line = MATRIX_ALIGNMENT / sizeof(T);
+            return (cols + per_line - 1) / per_line * per_line;
+        }
+
+        inline T *data() { return data_.get(); }
+        inline const T *data() const { return data_.get(); }
+
+        inline T &operator()(size_t i, size_t j) { return data_[i * stride_ + j]; }
+        inline const T &operator()(size_t i, size_t j) const { return data_[i * stride_ + j]; }
+
+        inline std::span<T> row(size_t i) { return std::span<T>(data_.get() + i * stride_, cols_); }
+        inline std::span<const T> row(size_t i) const { return std::span<const T>(data_.get() + i * stride_, cols_); }
+
+        /// @brief Row access so that m[i][j] keeps working
+        inline std::span<T> operator[](size_t i) { return row(i); }
+        inline std::span<const T> operator[](size_t i) const { return row(i); }
+
+        /// @brief Strided view over the whole matrix
+        inline BasicMatrixView<T> view() { return BasicMatrixView<T>(data_.get(), rows_, cols_, stride_); }
+
+        /// @brief Column-major view over the same buffer, (i, j) maps to element (j, i)
+        inline BasicMatrixView<T> transposed() { return view().transposed(); }
+
+        /// @brief View of a sub-block, used for column-oriented passes over a strip of columns
+        inline BasicMatrixView<T> block(size_t row, size_t col, size_t rows, size_t cols)
+        {
+            return view().block(row, col, rows, cols);
+        }
+
+        /// @brief Resize the matrix, existing values are kept where they fit and new cells get value
+        inline void resize(size_t new_rows, size_t new_cols, T value = T(0))
+        {
+            BasicMatrix resized(new_rows, new_cols, value);
+            size_t copy_rows = std::min(rows_, new_rows);
+            size_t copy_cols = std::min(cols_, new_cols);
+            for (size_t i = 0; i < copy_rows; ++i)
+            {
+                std::copy_n(data_.get() + i * stride_, copy_cols, resized.data_.get() + i * resized.stride_);
+            }
+            *this = std::move(resized);
+        }
+
+    private:
+        /// @brief Frees buffers we allocated, external buffers are released by dropping their owner instead
+        struct AlignedDelete
+        {
+            std::shared_ptr<void> owner;
+
+            inline void operator()(T *ptr) const
+            {
+                if (!owner)
+                    ::operator delete[](ptr, std::align_val_t(MATRIX_ALIGNMENT));
+            }
+        };
+
+        static inline std::unique_ptr<T[], AlignedDelete> allocate(size_t count)
+        {
+            if (count == 0)
+                return nullptr;
+            return std::unique_ptr<T[], AlignedDelete>(
+                static_cast<T *>(::operator new[](count * sizeof(T), std::align_val_t(MATRIX_ALIGNMENT))));
+        }
+
+        size_t rows_ = 0;
+        size_t cols_ = 0;
+        size_t stride_ = 0;
+        std::unique_ptr<T[], AlignedDelete> data_;
+    };
+
+    using Matrix = BasicMatrix<double>;
+    /// @brief Single precision storage, half the memory and bandwidth of Matrix
+    using MatrixF = BasicMatrix<float>;
+
+    /// @brief Number of row blocks an n row matrix is split into for placement and per-block partial results.
+    ///        Depends on n only, so results combined block by block do not depend on the number of workers
+    inline size_t rowBlocks(size_t n)
+    {
+        return std::clamp<size_t>(n / 64, 1, 256);
+    }
+
+    /// @brief Rows [first, second) of row block b of an n row matrix
+    inline std::pair<size_t, size_t> rowBlock(size_t n, size_t b)
+    {
+        size_t blocks = rowBlocks(n);
+        return {n * b / blocks, n * (b + 1) / blocks};
+    }
+
+    /// @brief Fill m with value, each row block on the worker parallel_for_static hands that block to,
+    ///        so with pinned workers the rows end up on the NUMA node of the worker that processes them
+    template <typename T>
+    inline void firstTouch(BasicMatrix<T> &m, Threading::ThreadPool &pool, T value = T(0))
+    {
+        size_t n = m.rows();
+        pool.parallel_for_static(0, rowBlocks(n),
+            [&](size_t first_block, size_t last_block)
+            {
+                size_t begin = rowBlock(n, first_block).first;
+                size_t end = rowBlock(n, last_block - 1).second;
+                std::fill_n(m.data() + begin * m.stride(), (end - begin) * m.stride(), value);
+            });
+    }
+
+    /// @brief Copy of m with every value converted to T, placed like firstTouch()
+    template <typename T, typename U>
+    inline BasicMatrix<T> convert(const BasicMatrix<U> &m, Threading::ThreadPool &pool)
+    {
+        BasicMatrix<T> result = BasicMatrix<T>::uninitialized(m.rows(), m.cols());
+        size_t n = m.rows();
+        pool.parallel_for_static(0, rowBlocks(n),
+            [&](size_t first_block, size_t last_block)
+            {
+                for (size_t i = rowBlock(n, first_block).first; i < rowBlock(n, last_block - 1).second; ++i)
+                {
+                    auto src = m.row(i);
+                    T *dst = result.row(i).data();
+                    std::transform(src.begin(), src.end(), dst, [](U value)
+                                   { return static_cast<T>(value); });
+                    std::fill(dst + m.cols(), dst + result.stride(), T(0));
+                }
+            });
+        return result;
+    }
 
     enum Diagonal
     {
@@ -15,27 +254,29 @@ namespace AP
         Median,
         Inf,
         NegInf,
-        Zero
+        Zero,
+        /// Value at a given percentile of the off-diagonal similarities, see Parser::getSimilarity
+        Percentile
     };
 
     inline Matrix CreateMatrix(size_t width, size_t height, double value = 0.0)
     {
-        return std::vector<std::vector<double>>(height, std::vector<double>(width, value));
+        return Matrix(height, width, value);
     }
 
     inline void ResizeMatrix(Matrix &m, size_t new_width, size_t new_height, double value = 0.0)
     {
-        m.resize(new_height, std::vector<double>(new_width, value));
+        m.resize(new_height, new_width, value);
     }
 
     inline size_t MatrixWidth(const Matrix &m)
     {
-        return m[0].size();
+        return m.cols();
     }
 
     inline size_t MatrixHeight(const Matrix &m)
     {
-        return m.size();
+        return m.rows();
     }
 
     namespace Math
@@ -47,11 +288,13 @@ namespace AP
 
             Matrix result = CreateMatrix(width, height);
 
-            for (size_t i = 0; i < width; i++)
+            for (size_t i = 0; i < height; i++)
             {
-                for (size_t j = 0; j < height; j++)
+                auto src = m.row(i);
+                auto dst = result.row(i);
+                for (size_t j = 0; j < width; j++)
                 {
-                    result[j][i] = m[j][i] * s;
+                    dst[j] = src[j] * s;
                 }
             }
 
@@ -63,13 +306,12 @@ namespace AP
             auto width = MatrixWidth(m);
             auto height = MatrixHeight(m);
             std::vector<double> medianArray{};
+            medianArray.reserve(width * height);
 
             for (size_t i = 0; i < height; ++i)
             {
-                for (size_t j = 0; j < width; ++j)
-                {
-                    medianArray.push_back(m[i][j]);
-                }
+                auto row = m.row(i);
+                medianArray.insert(medianArray.end(), row.begin(), row.end());
             }
 
             std::sort(medianArray.begin(), medianArray.end());
@@ -79,34 +321,28 @@ namespace AP
 
         inline double min(const Matrix &m)
         {
-            auto width = MatrixWidth(m);
             auto height = MatrixHeight(m);
-            std::vector<double> t{};
+            double result = std::numeric_limits<double>::infinity();
 
             for (size_t i = 0; i < height; ++i)
             {
-                for (size_t j = 0; j < width; ++j)
-                {
-                    t.push_back(m[i][j]);
-                }
+                auto row = m.row(i);
+                result = std::min(result, *std::min_element(row.begin(), row.end()));
             }
-            return *std::min_element(t.begin(), t.end());
+            return result;
         }
 
         inline double max(const Matrix &m)
         {
-            auto width = MatrixWidth(m);
             auto height = MatrixHeight(m);
-            std::vector<double> t{};
+            double result = -std::numeric_limits<double>::infinity();
 
             for (size_t i = 0; i < height; ++i)
             {
-                for (size_t j = 0; j < width; ++j)
-                {
-                    t.push_back(m[i][j]);
-                }
+                auto row = m.row(i);
+                result = std::max(result, *std::max_element(row.begin(), row.end()));
             }
-            return *std::max_element(t.begin(), t.end());
+            return result;
         }
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,287 @@
+#pragma once
+#include <cmath>
+#include <vector>
+#include <utility>
+#include <concepts>
+#include <algorithm>
+#include "matrix.h"
+#include "binary_format.h"
+
+namespace AP
+{
+    /// Similarity metrics as compile-time policies, see Parser::getSimilarity(const M &, Diagonal, double).
+    /// A policy is either accumulating, folding the coordinates of a pair one dimension at a time:
+    ///
+    ///     double accumulate(double acc, double x, double y) const;
+    ///     double finish(double acc, double term_x, double term_y) const;
+    ///
+    /// or pairwise, computing the similarity of two whole points:
+    ///
+    ///     double operator()(const double *x, const double *y, size_t d) const;
+    ///
+    /// Optionally it also has
+    ///
+    ///     void prepare(double *x, size_t d) const;        transforms every point once before any pair is formed
+    ///     double term(const double *x, size_t d) const;   per-point value handed to finish(), such as a norm
+    ///     static constexpr bool symmetric = true;         only the upper triangle is computed and mirrored
+    ///     static constexpr Binary::Metric id = ...;       identifies the metric in the similarity cache
+    ///
+    /// Everything is called from templates, so a policy is inlined into the kernel and accumulating policies
+    /// vectorize across a chunk of points. Dimensions up to FIXED_DIMENSIONS are compile-time constants in the kernel
+    namespace Metrics
+    {
+        template <typename M>
+        concept Accumulating = requires(const M &metric, double value) {
+            { metric.accumulate(value, value, value) } -> std::convertible_to<double>;
+            { metric.finish(value, value, value) } -> std::convertible_to<double>;
+        };
+
+        template <typename M>
+        concept Pairwise = requires(const M &metric, const double *x, size_t d) {
+            { metric(x, x, d) } -> std::convertible_to<double>;
+        };
+
+        template <typename M>
+        concept Metric = Accumulating<M> || Pairwise<M>;
+
+        /// @brief Dimensions for which the kernels are compiled with a constant trip count
+        constexpr size_t FIXED_DIMENSIONS = 10;
+
+        /// @brief Negative squared Euclidean distance, computed from the coordinate differences.
+        ///        Parser::getSimilarity(Diagonal, double) computes the same through dot products, which wins for many dimensions
+        struct NegSquaredEuclidean
+        {
+            static constexpr Binary::Metric id = Binary::Metric::NegSquaredEuclidean;
+            static constexpr bool symmetric = true;
+
+            inline double accumulate(double acc, double x, double y) const
+            {
+                double diff = x - y;
+                return acc + diff * diff;
+            }
+
+            inline double finish(double acc, double, double) const
+            {
+                return -acc;
+            }
+        };
+
+        /// @brief Negative Euclidean distance
+        struct NegEuclidean : NegSquaredEuclidean
+        {
+            static constexpr Binary::Metric id = Binary::Metric::NegEuclidean;
+
+            inline double finish(double acc, double, double) const
+            {
+                return -std::sqrt(acc);
+            }
+        };
+
+        /// @brief Negative Manhattan distance
+        struct Manhattan
+        {
+            static constexpr Binary::Metric id = Binary::Metric::Manhattan;
+            static constexpr bool symmetric = true;
+
+            inline double accumulate(double acc, double x, double y) const
+            {
+                return acc + std::abs(x - y);
+            }
+
+            inline double finish(double acc, double, double) const
+            {
+                return -acc;
+            }
+        };
+
+        /// @brief Cosine of the angle between two points, in [-1, 1]. A point at the origin is dissimilar to every other, at 0
+        struct Cosine
+        {
+            static constexpr Binary::Metric id = Binary::Metric::Cosine;
+            static constexpr bool symmetric = true;
+
+            inline double term(const double *x, size_t d) const
+            {
+                double squares = 0.0;
+                for (size_t k = 0; k < d; ++k)
+                {
+                    squares += x[k] * x[k];
+                }
+                return std::sqrt(squares);
+            }
+
+            inline double accumulate(double acc, double x, double y) const
+            {
+                return acc + x * y;
+            }
+
+            inline double finish(double acc, double norm_x, double norm_y) const
+            {
+                double norms = norm_x * norm_y;
+                return norms > 0.0 ? acc / norms : 0.0;
+            }
+        };
+
+        /// @brief Pearson correlation of the coordinates of two points, the cosine of the points centered on their own mean
+        struct Pearson : Cosine
+        {
+            static constexpr Binary::Metric id = Binary::Metric::Pearson;
+
+            inline void prepare(double *x, size_t d) const
+            {
+                double mean = 0.0;
+                for (size_t k = 0; k < d; ++k)
+                {
+                    mean += x[k];
+                }
+                mean /= std::max<size_t>(1, d);
+                for (size_t k = 0; k < d; ++k)
+                {
+                    x[k] -= mean;
+                }
+            }
+        };
+
+        template <typename M>
+        constexpr bool isSymmetric()
+        {
+            if constexpr (requires { M::symmetric; })
+                return M::symmetric;
+            else
+                return false;
+        }
+
+        /// @brief Whether similarities of the metric may be cached, which needs an id
+        template <typename M>
+        constexpr bool hasId()
+        {
+            return requires { M::id; };
+        }
+
+        /// @brief Points after the metric's prepare(), laid out for the kernels, with the per-point terms
+        template <Metric M>
+        class Operands
+        {
+        public:
+            /// @brief Columns of the dimension-major copy processed together, its rows are padded by as many zeros
+            static constexpr size_t CHUNK = 32;
+
+            Operands(const Matrix &points, const M &metric)
+                : Operands(points.rows(), points.cols())
+            {
+                load(points, 0, points.rows(), metric);
+            }
+
+            /// @brief Room for n points of d dimensions, filled by load()
+            Operands(size_t n, size_t d)
+                : points_(n, d), terms_(n, 0.0)
+            {
+                if constexpr (Accumulating<M>)
+                    columns_ = Matrix(d, n + CHUNK, 0.0);
+            }
+
+            /// @brief Prepare rows [begin, end) of points, which go to the same rows here.
+            ///        Disjoint ranges may be loaded concurrently, such as the chunks of a file as they are parsed
+            inline void load(const Matrix &points, size_t begin, size_t end, const M &metric)
+            {
+                size_t d = points_.cols();
+                for (size_t i = begin; i < end; ++i)
+                {
+                    double *x = points_.row(i).data();
+                    std::copy_n(points.row(i).data(), d, x);
+                    if constexpr (requires { metric.prepare(x, d); })
+                        metric.prepare(x, d);
+                    if constexpr (requires { metric.term(x, d); })
+                        terms_[i] = metric.term(x, d);
+                    if constexpr (Accumulating<M>)
+                    {
+                        for (size_t k = 0; k < d; ++k)
+                        {
+                            columns_(k, i) = x[k];
+                        }
+                    }
+                }
+            }
+
+            inline size_t size() const { return points_.rows(); }
+            inline size_t dimensions() const { return points_.cols(); }
+            inline const Matrix &points() const { return points_; }
+            inline const std::vector<double> &terms() const { return terms_; }
+            /// @brief Dimension-major copy of the points, empty for pairwise metrics
+            inline const Matrix &columns() const { return columns_; }
+
+        private:
+            Matrix points_;
+            std::vector<double> terms_;
+            Matrix columns_;
+        };
+
+        /// @brief Fill out(a, b) with the similarity of points row_begin + a and col_begin + b.
+        ///        D is the number of dimensions when it is known at compile time and 0 otherwise, see computeBlock()
+        template <size_t D, Metric M, typename T>
+        inline void computeBlockFixed(const M &metric, const Operands<M> &operands, BasicMatrixView<T> out, size_t row_begin, size_t col_begin)
+        {
+            const size_t d = D > 0 ? D : operands.dimensions();
+            const std::vector<double> &terms = operands.terms();
+
+            if constexpr (Accumulating<M>)
+            {
+                // Every dimension is a pass over a contiguous chunk of the dimension-major copy,
+                // lanes past the last column read the padding and are dropped
+                constexpr size_t CHUNK = Operands<M>::CHUNK;
+                const Matrix &columns = operands.columns();
+                double acc[CHUNK];
+                for (size_t a = 0; a < out.rows(); ++a)
+                {
+                    size_t i = row_begin + a;
+                    const double *x = operands.points().row(i).data();
+                    for (size_t b = 0; b < out.cols(); b += CHUNK)
+                    {
+                        size_t count = std::min(CHUNK, out.cols() - b);
+                        std::fill_n(acc, CHUNK, 0.0);
+                        for (size_t k = 0; k < d; ++k)
+                        {
+                            const double value = x[k];
+                            const double *column = columns.row(k).data() + col_begin + b;
+                            for (size_t t = 0; t < CHUNK; ++t)
+                            {
+                                acc[t] = metric.accumulate(acc[t], value, column[t]);
+                            }
+                        }
+                        for (size_t t = 0; t < count; ++t)
+                        {
+                            out(a, b + t) = static_cast<T>(metric.finish(acc[t], terms[i], terms[col_begin + b + t]));
+                        }
+                    }
+                }
+            }
+            else
+            {
+                for (size_t a = 0; a < out.rows(); ++a)
+                {
+                    const double *x = operands.points().row(row_begin + a).data();
+                    for (size_t b = 0; b < out.cols(); ++b)
+                    {
+                        out(a, b) = static_cast<T>(metric(x, operands.points().row(col_begin + b).data(), d));
+                    }
+                }
+            }
+        }
+
+        /// @brief computeBlockFixed() compiled for the dimension of the operands when it is at most FIXED_DIMENSIONS
+        template <Metric M, typename T>
+        inline void computeBlock(const M &metric, const Operands<M> &operands, BasicMatrixView<T> out, size_t row_begin, size_t col_begin)
+        {
+            size_t d = operands.dimensions();
+            bool fixed = [&]<size_t... D>(std::index_sequence<D...>)
+            {
+                return ((d == D + 1 && (computeBlockFixed<D + 1>(metric, operands, out, row_begin, col_begin), true)) || ...);
+            }(std::make_index_sequence<FIXED_DIMENSIONS>{});
+
+            if (!fixed)
+            {
+                computeBlockFixed<0>(metric, operands, out, row_begin, col_begin);
+            }
+        }
+    }
+}
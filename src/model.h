@@ -0,0 +1,321 @@
+#pragma once
+#include <span>
+#include <vector>
+#include <string>
+#include <limits>
+#include <fstream>
+#include <numeric>
+#include <algorithm>
+#include <stdexcept>
+#include "matrix.h"
+#include "threadpool.h"
+#include "binary_format.h"
+
+namespace AP
+{
+    /// @brief Fitted clustering that assigns new points to the most similar exemplar, by negative squared Euclidean distance.
+    ///        Keeps only the exemplar coordinates. With many exemplars in few dimensions the nearest one is found through a k-d tree,
+    ///        otherwise by a vectorized scan over all of them. predict() is safe to call from several threads at once
+    class Model
+    {
+    public:
+        Model() = default;
+
+        /// @param points the points that were clustered
+        /// @param labels exemplar index of every point, as returned by getLabels() of any of the fits
+        Model(const Matrix &points, const std::vector<int> &labels)
+        {
+            if (labels.size() != points.rows())
+            {
+                throw std::invalid_argument("Expected " + std::to_string(points.rows()) + " labels, got " + std::to_string(labels.size()));
+            }
+
+            std::vector<int> exemplars(labels);
+            std::sort(exemplars.begin(), exemplars.end());
+            exemplars.erase(std::unique(exemplars.begin(), exemplars.end()), exemplars.end());
+
+            Matrix centres(exemplars.size(), points.cols());
+            for (size_t e = 0; e < exemplars.size(); ++e)
+            {
+                if (exemplars[e] < 0 || static_cast<size_t>(exemplars[e]) >= points.rows())
+                {
+                    throw std::invalid_argument("Label " + std::to_string(exemplars[e]) + " is not the index of a point");
+                }
+                auto src = points.row(exemplars[e]);
+                std::copy(src.begin(), src.end(), centres.row(e).begin());
+            }
+            build(std::move(centres), std::move(exemplars));
+        }
+
+        /// @brief Index of the most similar exemplar among the training points, ties go to the lowest index
+        inline int predict(std::span<const double> point) const
+        {
+            if (point.size() != dimensions())
+            {
+                throw std::invalid_argument("Expected a point with " + std::to_string(dimensions()) + " dimensions, got " + std::to_string(point.size()));
+            }
+            if (exemplars_.empty())
+            {
+                throw std::logic_error("Model has no exemplars");
+            }
+            return exemplars_[nearest(point.data())];
+        }
+
+        /// @brief predict() for every row of points, rows are spread over the workers of the model's pool.
+        ///        Unlike predict() this must not be called from several threads at once
+        inline std::vector<int> predictBatch(const Matrix &points)
+        {
+            if (points.rows() > 0 && points.cols() != dimensions())
+            {
+                throw std::invalid_argument("Expected points with " + std::to_string(dimensions()) + " dimensions, got " + std::to_string(points.cols()));
+            }
+            if (exemplars_.empty())
+            {
+                throw std::logic_error("Model has no exemplars");
+            }
+
+            size_t n = points.rows();
+            std::vector<int> labels(n);
+            thread_pool_.start();
+            size_t grain = std::max<size_t>(64, n / (8 * std::max<size_t>(1, thread_pool_.size())));
+            thread_pool_.parallel_for(0, n, grain,
+                [&](size_t begin, size_t end)
+                {
+                    for (size_t i = begin; i < end; ++i)
+                    {
+                        labels[i] = exemplars_[nearest(points.row(i).data())];
+                    }
+                });
+            thread_pool_.stop();
+            return labels;
+        }
+
+        /// @brief Indices of the exemplars among the training points, ascending
+        inline const std::vector<int> &getExemplars() const
+        {
+            return exemplars_;
+        }
+
+        /// @brief Coordinates of the exemplars, row e belongs to getExemplars()[e]
+        inline const Matrix &getCentres() const
+        {
+            return centres_;
+        }
+
+        inline size_t dimensions() const
+        {
+            return centres_.cols();
+        }
+
+        /// @brief Whether predictions go through the k-d tree rather than a scan
+        inline bool usesTree() const
+        {
+            return !nodes_.empty();
+        }
+
+        /// @brief Store the model in the Binary format, the exemplar indices follow the header
+        inline void save(const std::string &filename) const
+        {
+            std::vector<int64_t> indices(exemplars_.begin(), exemplars_.end());
+            size_t extra = indices.size() * sizeof(int64_t);
+
+            Binary::Header header = Binary::makeHeader(Binary::Kind::Model, centres_);
+            header.metric = Binary::Metric::NegSquaredEuclidean;
+            header.data_offset = (sizeof(Binary::Header) + extra + MATRIX_ALIGNMENT - 1) / MATRIX_ALIGNMENT * MATRIX_ALIGNMENT;
+            Binary::write(filename, header, centres_, indices.data(), extra);
+        }
+
+        /// @brief Replace the model with one written by save() and rebuild its index
+        inline void load(const std::string &filename)
+        {
+            Binary::Header header;
+            Matrix mapped = Binary::read(filename, header, Binary::Kind::Model);
+            if (header.data_offset < sizeof(Binary::Header) + header.rows * sizeof(int64_t))
+            {
+                throw std::runtime_error("Corrupt model: " + filename);
+            }
+
+            std::vector<int64_t> indices(header.rows);
+            std::ifstream in(filename, std::ios::binary);
+            in.seekg(sizeof(Binary::Header));
+            in.read(reinterpret_cast<char *>(indices.data()), indices.size() * sizeof(int64_t));
+            if (!in)
+            {
+                throw std::runtime_error("Error reading model: " + filename);
+            }
+
+            build(Matrix(mapped), std::vector<int>(indices.begin(), indices.end()));
+        }
+
+    private:
+        /// @brief k-d tree node, leaves own a contiguous range of the tree-ordered exemplars
+        struct Node
+        {
+            uint32_t begin;
+            uint32_t end;
+            int32_t left = -1;
+            int32_t right = -1;
+            uint32_t dim = 0;
+            double split = 0.0;
+        };
+
+        /// @brief Below this many exemplars or above this many dimensions the vectorized scan beats the tree,
+        ///        the tree prunes too little of clustered data in more dimensions
+        static constexpr size_t TREE_MIN_EXEMPLARS = 64;
+        static constexpr size_t TREE_MAX_DIMENSIONS = 6;
+        static constexpr size_t LEAF_SIZE = 8;
+        static constexpr size_t SCAN_CHUNK = 64;
+
+        inline void build(Matrix centres, std::vector<int> exemplars)
+        {
+            centres_ = std::move(centres);
+            exemplars_ = std::move(exemplars);
+            nodes_.clear();
+
+            size_t k = centres_.rows();
+            size_t d = centres_.cols();
+            order_.resize(k);
+            std::iota(order_.begin(), order_.end(), 0);
+            if (k >= TREE_MIN_EXEMPLARS && d <= TREE_MAX_DIMENSIONS)
+            {
+                buildNode(0, static_cast<uint32_t>(k));
+            }
+
+            // Dimension-major copy in tree order, so a scan over a range of exemplars runs along contiguous memory
+            // for every dimension and vectorizes across exemplars however few dimensions there are.
+            // The zero padding lets every scan work on whole chunks
+            transposed_ = Matrix(d, k + SCAN_CHUNK, 0.0);
+            for (size_t t = 0; t < k; ++t)
+            {
+                for (size_t j = 0; j < d; ++j)
+                {
+                    transposed_(j, t) = centres_(order_[t], j);
+                }
+            }
+        }
+
+        /// @return index of the new node
+        inline int32_t buildNode(uint32_t begin, uint32_t end)
+        {
+            int32_t index = static_cast<int32_t>(nodes_.size());
+            nodes_.push_back(Node{begin, end});
+            if (end - begin <= LEAF_SIZE)
+            {
+                return index;
+            }
+
+            // Split at the median of the dimension with the largest spread
+            size_t d = centres_.cols();
+            uint32_t dim = 0;
+            double widest = -1.0;
+            for (size_t k = 0; k < d; ++k)
+            {
+                double low = std::numeric_limits<double>::infinity(), high = -low;
+                for (uint32_t t = begin; t < end; ++t)
+                {
+                    double value = centres_(order_[t], k);
+                    low = std::min(low, value);
+                    high = std::max(high, value);
+                }
+                if (high - low > widest)
+                {
+                    widest = high - low;
+                    dim = static_cast<uint32_t>(k);
+                }
+            }
+
+            uint32_t mid = begin + (end - begin) / 2;
+            std::nth_element(order_.begin() + begin, order_.begin() + mid, order_.begin() + end,
+                             [&](size_t x, size_t y)
+                             { return centres_(x, dim) < centres_(y, dim); });
+
+            nodes_[index].dim = dim;
+            nodes_[index].split = centres_(order_[mid], dim);
+            int32_t left = buildNode(begin, mid);
+            int32_t right = buildNode(mid, end);
+            nodes_[index].left = left;
+            nodes_[index].right = right;
+            return index;
+        }
+
+        /// @brief Position of the nearest exemplar, the lowest position among equally near ones
+        inline size_t nearest(const double *x) const
+        {
+            size_t best = std::numeric_limits<size_t>::max();
+            double best_distance = std::numeric_limits<double>::infinity();
+            if (nodes_.empty())
+            {
+                scan<SCAN_CHUNK>(x, 0, centres_.rows(), best, best_distance);
+            }
+            else
+            {
+                search(0, x, best, best_distance);
+            }
+            return best;
+        }
+
+        inline void search(int32_t index, const double *x, size_t &best, double &best_distance) const
+        {
+            const Node &node = nodes_[index];
+            if (node.left < 0)
+            {
+                scan<LEAF_SIZE>(x, node.begin, node.end, best, best_distance);
+                return;
+            }
+
+            double offset = x[node.dim] - node.split;
+            int32_t near = offset < 0.0 ? node.left : node.right;
+            int32_t far = offset < 0.0 ? node.right : node.left;
+            search(near, x, best, best_distance);
+            if (offset * offset <= best_distance)
+            {
+                search(far, x, best, best_distance);
+            }
+        }
+
+        /// @brief Squared distances to the exemplars at tree positions [begin, end), CHUNK at a time.
+        ///        The fixed trip count lets the compiler vectorize the inner loop, lanes past end read padding and are ignored
+        template <size_t CHUNK>
+        inline void scan(const double *x, size_t begin, size_t end, size_t &best, double &best_distance) const
+        {
+            double distances[CHUNK];
+            size_t d = transposed_.rows();
+
+            for (size_t first = begin; first < end; first += CHUNK)
+            {
+                size_t count = std::min(CHUNK, end - first);
+                std::fill_n(distances, CHUNK, 0.0);
+                for (size_t j = 0; j < d; ++j)
+                {
+                    const double *column = transposed_.row(j).data() + first;
+                    double value = x[j];
+                    for (size_t t = 0; t < CHUNK; ++t)
+                    {
+                        double diff = value - column[t];
+                        distances[t] += diff * diff;
+                    }
+                }
+
+                for (size_t t = 0; t < count; ++t)
+                {
+                    size_t e = order_[first + t];
+                    if (distances[t] < best_distance || (distances[t] == best_distance && e < best))
+                    {
+                        best_distance = distances[t];
+                        best = e;
+                    }
+                }
+            }
+        }
+
+    private:
+        Threading::ThreadPool thread_pool_{};
+        Matrix centres_;
+        std::vector<int> exemplars_;
+
+        std::vector<Node> nodes_;
+        /// @brief Position of every exemplar in tree order, the identity without a tree
+        std::vector<size_t> order_;
+        Matrix transposed_;
+    };
+}
@@ -0,0 +1,398 @@
+#pragma once
+#include <iostream>
+#include <vector>
+#include <string>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+#include <filesystem>
+#include <initializer_list>
+#include <cstdint>
+#include <unistd.h>
+#include "matrix.h"
+#include "threadpool.h"
+#include "simd.h"
+#include "mapped_file.h"
+#include "binary_format.h"
+#include "instrumentation.h"
+
+namespace AP
+{
+    /// @brief Affinity propagation for similarity matrices larger than memory.
+    ///        The similarity matrix is mapped from a binary matrix file, see Parser::writeSimilarity,
+    ///        and responsibilities and availabilities live in memory mapped work files.
+    ///        Every phase streams over the matrices in row tiles sized to the memory budget,
+    ///        prefetching the next tile and releasing finished ones, so only a few tiles are resident at a time.
+    ///        Column sums are added in the row block order of AffinityPropagation, so it produces the same messages and labels bit for bit
+    class OutOfCoreAffinityPropagation
+    {
+    public:
+        /// @param similarity_file n x n similarity matrix in the Binary format with the preferences on the diagonal
+        /// @param work_directory directory for the responsibility and availability work files, they are unlinked as soon as they are mapped
+        /// @param memory_budget bytes of matrix rows kept resident at a time, split evenly between the three matrices
+        ///        and between the tile being processed and the one prefetched
+        /// @param max_iter upper bound on the number of message passing iterations
+        /// @param damping weight of the previous message when blending with the new one, in [0, 1)
+        /// @param convergence_iter number of iterations the exemplar set has to stay unchanged to stop early,
+        ///        0 disables early termination
+        OutOfCoreAffinityPropagation(const std::string &similarity_file, const std::string &work_directory, size_t memory_budget = size_t(1) << 30,
+                                     unsigned int max_iter = 200, double damping = 0.5, unsigned int convergence_iter = 15)
+            : work_directory_(work_directory), max_iter_(max_iter), damping_(damping), convergence_iter_(convergence_iter)
+        {
+            if (damping < 0.0 || damping >= 1.0)
+            {
+                throw std::invalid_argument("Damping has to be in range [0, 1)");
+            }
+
+            Binary::Header header;
+            similarities_ = Binary::read(similarity_file, header, Binary::Kind::Similarity);
+            if (header.rows != header.cols)
+            {
+                throw std::invalid_argument("Similarity matrix has to be square: " + similarity_file);
+            }
+
+            // The responsibility pass holds a tile of all three matrices while the next one is prefetched, see forEachTile()
+            size_t row_bytes = similarities_.stride() * sizeof(double);
+            tile_rows_ = std::max<size_t>(1, memory_budget / (2 * 3 * row_bytes));
+        }
+
+        inline void fit()
+        {
+            instrumentation_.reset();
+            thread_pool_.start();
+
+            {
+                auto timer = instrumentation_.time(Phase::Initialize);
+                initialize();
+            }
+
+            converged_ = false;
+            iterations_ = 0;
+            unsigned int stable_iterations = 0;
+
+            for (unsigned int iter = 0; iter < max_iter_; ++iter)
+            {
+                auto start = std::chrono::high_resolution_clock::now();
+                IterationStats stats;
+                stats.iteration = iter;
+                {
+                    auto timer = instrumentation_.time(Phase::Responsibility);
+                    stats.responsibility_delta = updateResponsibility();
+                }
+                {
+                    auto timer = instrumentation_.time(Phase::Availability);
+                    stats.availability_delta = updateAvailability();
+                }
+                {
+                    auto timer = instrumentation_.time(Phase::Exemplars);
+                    stats.exemplar_changes = updateExemplars();
+                }
+                stats.exemplars = exemplar_count_;
+                stats.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+                iterations_ = iter + 1;
+                instrumentation_.count(Counter::Iterations);
+                instrumentation_.iteration(stats);
+
+                stable_iterations = stats.exemplar_changes > 0 ? 0 : stable_iterations + 1;
+                if (convergence_iter_ > 0 && stable_iterations >= convergence_iter_ && exemplar_count_ > 0)
+                {
+                    converged_ = true;
+                    break;
+                }
+            }
+
+            {
+                auto timer = instrumentation_.time(Phase::Clusters);
+                identifyClusters();
+            }
+
+            thread_pool_.stop();
+            instrumentation_.threadPool(thread_pool_.stats());
+            instrumentation_.log(Verbosity::Summary, converged_ ? "Converged" : "Did not converge", " after ", iterations_, " iterations");
+            instrumentation_.logPhases();
+        }
+
+        inline const std::vector<int> &getLabels() const
+        {
+            return labels_;
+        }
+
+        /// @brief Whether the last fit stopped because the exemplar set stabilized
+        inline bool hasConverged() const
+        {
+            return converged_;
+        }
+
+        /// @brief Number of message passing iterations the last fit used
+        inline unsigned int getIterations() const
+        {
+            return iterations_;
+        }
+
+        /// @brief Timers, counters and per-iteration statistics of the last fit, also where verbosity is configured
+        inline Instrumentation &getInstrumentation()
+        {
+            return instrumentation_;
+        }
+
+        inline std::vector<int> getUniqueClusters()
+        {
+            std::vector<int> lbls_(labels_);
+            std::sort(lbls_.begin(), lbls_.end());
+            auto last = std::unique(lbls_.begin(), lbls_.end());
+            lbls_.erase(last, lbls_.end());
+            return lbls_;
+        }
+
+    private:
+        inline void initialize()
+        {
+            size_t n = similarities_.rows();
+
+            responsibilities_ = workMatrix("responsibilities", n);
+            availabilities_ = workMatrix("availabilities", n);
+            responsibility_diagonal_.assign(n, 0.0);
+            availability_diagonal_.assign(n, 0.0);
+            sums_.assign(n, 0.0);
+            block_sums_.assign(n, 0.0);
+            exemplars_.assign(n, 0);
+            exemplar_count_ = 0;
+
+            instrumentation_.log(Verbosity::Summary, "Prepared work files of size ", n, "x", n, " in tiles of ", tile_rows_, " rows");
+        }
+
+        /// @brief Zero filled n x n matrix backed by a sparse file in the work directory.
+        ///        The file is unlinked as soon as it is mapped, so it disappears with the mapping even after a crash
+        inline Matrix workMatrix(const std::string &name, size_t n)
+        {
+            std::string path = (std::filesystem::path(work_directory_) /
+                                (name + "-" + std::to_string(::getpid()) + "-" + std::to_string(reinterpret_cast<uintptr_t>(this)) + ".work"))
+                                   .string();
+            size_t stride = Matrix::paddedStride(n);
+            auto file = std::make_shared<MappedFile>(MappedFile::create(path, n * stride * sizeof(double)));
+            std::filesystem::remove(path);
+
+            double *data = reinterpret_cast<double *>(file->mutableData());
+            return Matrix(data, n, n, stride, std::move(file));
+        }
+
+        /// @brief Call fn(tile_begin, tile_end) for every row tile in order.
+        ///        Before a tile is processed the next one is prefetched, afterwards the tile is written back and released
+        template <typename F>
+        inline void forEachTile(std::initializer_list<const Matrix *> matrices, F &&fn)
+        {
+            size_t n = similarities_.rows();
+            for (size_t tile_begin = 0; tile_begin < n; tile_begin += tile_rows_)
+            {
+                size_t tile_end = std::min(n, tile_begin + tile_rows_);
+                size_t next_end = std::min(n, tile_end + tile_rows_);
+
+                for (const Matrix *m : matrices)
+                {
+                    MappedFile::advise(m->data() + tile_end * m->stride(), (next_end - tile_end) * m->stride() * sizeof(double), MADV_WILLNEED);
+                }
+
+                fn(tile_begin, tile_end);
+
+                for (const Matrix *m : matrices)
+                {
+                    const double *tile = m->row(tile_begin).data();
+                    size_t tile_bytes = (tile_end - tile_begin) * m->stride() * sizeof(double);
+                    if (m != &similarities_)
+                    {
+                        MappedFile::flushAsync(tile, tile_bytes);
+                    }
+                    MappedFile::advise(tile, tile_bytes, MADV_DONTNEED);
+                }
+            }
+        }
+
+        /// @return largest change of a responsibility when deltas are tracked, NaN otherwise
+        inline double updateResponsibility()
+        {
+            size_t n = similarities_.rows();
+            bool track = instrumentation_.trackDeltas();
+            std::atomic<double> delta{0.0};
+
+            // Same top-2 scan as AffinityPropagation, one row tile at a time.
+            // The new diagonal is kept in memory for the availability and exemplar updates
+            forEachTile({&similarities_, &availabilities_, &responsibilities_},
+                [&, n](size_t tile_begin, size_t tile_end)
+                {
+                    thread_pool_.parallel_for(tile_begin, tile_end, Threading::grainSize(thread_pool_, tile_end - tile_begin),
+                        [&, n](size_t begin, size_t end)
+                        {
+                            std::vector<double> old;
+                            double task_delta = 0.0;
+                            for (size_t i = begin; i < end; ++i)
+                            {
+                                const double *s = similarities_.row(i).data();
+                                const double *a = availabilities_.row(i).data();
+                                double *r = responsibilities_.row(i).data();
+                                if (track)
+                                    old.assign(r, r + n);
+
+                                double first, second;
+                                simd_.rowTop2(a, s, n, first, second);
+                                simd_.responsibilityRow(s, a, r, n, first, second, damping_);
+                                responsibility_diagonal_[i] = r[i];
+
+                                if (track)
+                                    task_delta = std::max(task_delta, maxAbsDifference(old.data(), r, n));
+                            }
+                            if (track)
+                                atomicMax(delta, task_delta);
+                        });
+                });
+
+            return track ? delta.load() : std::numeric_limits<double>::quiet_NaN();
+        }
+
+        /// @return largest change of an availability when deltas are tracked, NaN otherwise
+        inline double updateAvailability()
+        {
+            size_t n = similarities_.rows();
+            bool track = instrumentation_.trackDeltas();
+            std::atomic<double> delta{0.0};
+            constexpr size_t per_line = MATRIX_ALIGNMENT / sizeof(double);
+            size_t strips = (n + per_line - 1) / per_line;
+
+            // First pass: column sums of positive responsibilities, accumulated tile by tile in the order AffinityPropagation
+            // uses, so both produce the same bits: rows are summed per row block, see rowBlocks(), and the block sums are added
+            // in block order. A block may span tiles, its sum is carried over in block_sums_.
+            // Columns are split into cache line strips so tasks never write to the same line of sums
+            size_t blocks = rowBlocks(n);
+            forEachTile({&responsibilities_},
+                [&, n, blocks](size_t tile_begin, size_t tile_end)
+                {
+                    size_t first_block = tile_begin * blocks / n;
+                    while (rowBlock(n, first_block).second <= tile_begin)
+                        ++first_block;
+
+                    thread_pool_.parallel_for(0, strips, Threading::grainSize(thread_pool_, strips),
+                        [&, n, blocks](size_t first_strip, size_t last_strip)
+                        {
+                            size_t begin = first_strip * per_line;
+                            size_t width = std::min(n, last_strip * per_line) - begin;
+                            double *partial = block_sums_.data() + begin;
+                            double *total = sums_.data() + begin;
+                            for (size_t b = first_block; b < blocks && rowBlock(n, b).first < tile_end; ++b)
+                            {
+                                auto [block_begin, block_end] = rowBlock(n, b);
+                                if (block_begin >= tile_begin)
+                                    std::fill_n(partial, width, 0.0);
+                                for (size_t i = std::max(block_begin, tile_begin); i < std::min(block_end, tile_end); ++i)
+                                {
+                                    simd_.accumulatePositive(responsibilities_.row(i).data() + begin, partial, width);
+                                }
+                                if (block_end > tile_end)
+                                    break;
+                                for (size_t j = 0; j < width; ++j)
+                                {
+                                    total[j] = b == 0 ? partial[j] : total[j] + partial[j];
+                                }
+                            }
+                        });
+                });
+
+            for (size_t k = 0; k < n; ++k)
+            {
+                sums_[k] -= std::max(0.0, responsibility_diagonal_[k]);
+            }
+
+            // Second pass: rows are independent once the column sums are known
+            forEachTile({&responsibilities_, &availabilities_},
+                [&, n](size_t tile_begin, size_t tile_end)
+                {
+                    thread_pool_.parallel_for(tile_begin, tile_end, Threading::grainSize(thread_pool_, tile_end - tile_begin),
+                        [&, n](size_t begin, size_t end)
+                        {
+                            std::vector<double> old;
+                            double task_delta = 0.0;
+                            for (size_t i = begin; i < end; ++i)
+                            {
+                                double *a = availabilities_.row(i).data();
+                                double old_diagonal = a[i];
+                                if (track)
+                                    old.assign(a, a + n);
+
+                                simd_.availabilityRow(responsibilities_.row(i).data(), responsibility_diagonal_.data(), sums_.data(), a, n, damping_);
+
+                                a[i] = damping_ * old_diagonal + (1.0 - damping_) * sums_[i];
+                                availability_diagonal_[i] = a[i];
+
+                                if (track)
+                                    task_delta = std::max(task_delta, maxAbsDifference(old.data(), a, n));
+                            }
+                            if (track)
+                                atomicMax(delta, task_delta);
+                        });
+                });
+
+            return track ? delta.load() : std::numeric_limits<double>::quiet_NaN();
+        }
+
+        /// @brief Recompute the exemplar set from the in-memory diagonals, point k is an exemplar when r(k,k) + a(k,k) > 0
+        /// @return number of points that joined or left the exemplar set
+        inline unsigned int updateExemplars()
+        {
+            size_t n = similarities_.rows();
+            unsigned int changed = 0;
+            exemplar_count_ = 0;
+
+            for (size_t k = 0; k < n; ++k)
+            {
+                char is_exemplar = responsibility_diagonal_[k] + availability_diagonal_[k] > 0.0;
+                changed += is_exemplar != exemplars_[k];
+                exemplars_[k] = is_exemplar;
+                exemplar_count_ += is_exemplar;
+            }
+
+            return changed;
+        }
+
+        inline void identifyClusters()
+        {
+            size_t n = similarities_.rows();
+
+            labels_.assign(n, -1);
+            forEachTile({&responsibilities_, &availabilities_},
+                [&, n](size_t tile_begin, size_t tile_end)
+                {
+                    thread_pool_.parallel_for(tile_begin, tile_end, Threading::grainSize(thread_pool_, tile_end - tile_begin),
+                        [&, n](size_t begin, size_t end)
+                        {
+                            for (size_t i = begin; i < end; ++i)
+                            {
+                                labels_[i] = simd_.argmaxSum(responsibilities_.row(i).data(), availabilities_.row(i).data(), n);
+                            }
+                        });
+                });
+        }
+
+    private:
+        Threading::ThreadPool thread_pool_{};
+        const Simd::Kernels &simd_ = Simd::best();
+        std::string work_directory_;
+        size_t tile_rows_ = 1;
+        unsigned int max_iter_;
+        double damping_;
+        unsigned int convergence_iter_;
+        bool converged_ = false;
+        unsigned int iterations_ = 0;
+        Instrumentation instrumentation_;
+
+        Matrix similarities_;
+        Matrix responsibilities_;
+        Matrix availabilities_;
+        std::vector<double> responsibility_diagonal_;
+        std::vector<double> availability_diagonal_;
+        std::vector<double> sums_;
+        /// @brief Sum of the row block in progress, see updateAvailability()
+        std::vector<double> block_sums_;
+        std::vector<int> labels_;
+        std::vector<char> exemplars_;
+        unsigned int exemplar_count_ = 0;
+    };
+}
@@ -0,0 +1,162 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+#include "matrix.h"
+
+namespace AP
+{
+    /// @brief Symmetric n x n matrix of which only the blocks on and above the diagonal are stored, with the diagonal kept apart.
+    ///        The matrix is cut into BLOCK x BLOCK blocks and block (rb, cb) with rb <= cb is stored contiguously and row-major,
+    ///        so an entry below the diagonal is the transposed entry of a stored block. Blocks on the last block row and column
+    ///        are stored clipped to the matrix, so it takes about half the memory of BasicMatrix at every size,
+    ///        rows are assembled a tile at a time by copyRows()
+    template <typename T>
+    class BasicPackedSymmetricMatrix
+    {
+    public:
+        /// @brief Rows and columns of a block, a double block fills 32 KiB
+        static constexpr size_t BLOCK = 64;
+
+        BasicPackedSymmetricMatrix() = default;
+
+        /// @brief Matrix whose blocks have not been written yet, the diagonal is zero
+        static inline BasicPackedSymmetricMatrix uninitialized(size_t n)
+        {
+            BasicPackedSymmetricMatrix m;
+            m.n_ = n;
+            m.blocks_per_side_ = (n + BLOCK - 1) / BLOCK;
+            m.offsets_.reserve(m.blockCount());
+            size_t total = 0;
+            for (size_t rb = 0; rb < m.blocks_per_side_; ++rb)
+            {
+                for (size_t cb = rb; cb < m.blocks_per_side_; ++cb)
+                {
+                    m.offsets_.push_back(total);
+                    total += m.extent(rb) * m.blockStride(cb);
+                }
+            }
+            // A single row holding every block back to back, for the aligned allocation of BasicMatrix
+            m.storage_ = BasicMatrix<T>::uninitialized(total > 0 ? 1 : 0, total);
+            m.diagonal_.assign(n, T(0));
+            return m;
+        }
+
+        inline size_t size() const { return n_; }
+        inline size_t rows() const { return n_; }
+        inline size_t cols() const { return n_; }
+        inline size_t blocksPerSide() const { return blocks_per_side_; }
+
+        /// @brief Number of stored blocks, those on and above the diagonal
+        inline size_t blockCount() const
+        {
+            return blocks_per_side_ * (blocks_per_side_ + 1) / 2;
+        }
+
+        /// @brief Bytes of the blocks and the diagonal
+        inline size_t bytes() const
+        {
+            return (storage_.rows() * storage_.stride() + diagonal_.size()) * sizeof(T);
+        }
+
+        /// @brief Block (rb, cb) with rb <= cb, clipped to the matrix. Entry (a, b) is (rb * BLOCK + a, cb * BLOCK + b),
+        ///        a diagonal block is stored whole and its own entries on the diagonal are not used
+        inline BasicMatrixView<T> block(size_t rb, size_t cb)
+        {
+            return BasicMatrixView<T>(storage_.data() + offsets_[blockIndex(rb, cb)], extent(rb), extent(cb), blockStride(cb));
+        }
+
+        inline BasicMatrixView<const T> block(size_t rb, size_t cb) const
+        {
+            return BasicMatrixView<const T>(storage_.data() + offsets_[blockIndex(rb, cb)], extent(rb), extent(cb), blockStride(cb));
+        }
+
+        /// @brief Values on the diagonal, the preferences of a similarity matrix
+        inline std::vector<T> &diagonal() { return diagonal_; }
+        inline const std::vector<T> &diagonal() const { return diagonal_; }
+
+        inline T operator()(size_t i, size_t j) const
+        {
+            if (i == j)
+                return diagonal_[i];
+            if (i > j)
+                std::swap(i, j);
+            return block(i / BLOCK, j / BLOCK)(i % BLOCK, j % BLOCK);
+        }
+
+        /// @brief Copy rows [begin, end) into the first end - begin rows of out, which needs size() columns.
+        ///        Blocks above the diagonal are copied row by row, every block below it is read once through its stored
+        ///        transpose, one contiguous block row at a time, instead of a strided walk down its columns
+        inline void copyRows(size_t begin, size_t end, BasicMatrixView<T> out) const
+        {
+            if (end > n_ || out.rows() < end - begin || out.cols() != n_)
+            {
+                throw std::invalid_argument("Rows " + std::to_string(begin) + " to " + std::to_string(end) + " do not fit the output");
+            }
+
+            for (size_t rb = begin / BLOCK; rb * BLOCK < end; ++rb)
+            {
+                size_t first = std::max(begin, rb * BLOCK);
+                size_t last = std::min(end, (rb + 1) * BLOCK);
+
+                for (size_t cb = 0; cb < rb; ++cb)
+                {
+                    // Row b of stored block (cb, rb) is column cb * BLOCK + b of the rows we assemble
+                    BasicMatrixView<const T> stored = block(cb, rb);
+                    for (size_t b = 0; b < stored.rows(); ++b)
+                    {
+                        const T *src = stored.row(b).data();
+                        size_t col = cb * BLOCK + b;
+                        for (size_t i = first; i < last; ++i)
+                        {
+                            out(i - begin, col) = src[i - rb * BLOCK];
+                        }
+                    }
+                }
+
+                for (size_t cb = rb; cb < blocks_per_side_; ++cb)
+                {
+                    BasicMatrixView<const T> stored = block(rb, cb);
+                    for (size_t i = first; i < last; ++i)
+                    {
+                        std::copy_n(stored.row(i - rb * BLOCK).data(), stored.cols(), &out(i - begin, cb * BLOCK));
+                    }
+                }
+
+                for (size_t i = first; i < last; ++i)
+                {
+                    out(i - begin, i) = diagonal_[i];
+                }
+            }
+        }
+
+    private:
+        /// @brief Position of block (rb, cb) among the stored blocks, which go block row by block row
+        inline size_t blockIndex(size_t rb, size_t cb) const
+        {
+            return rb * blocks_per_side_ - rb * (rb - 1) / 2 + (cb - rb);
+        }
+
+        /// @brief Rows of block row b, BLOCK except for the last one
+        inline size_t extent(size_t b) const
+        {
+            return std::min(BLOCK, n_ - b * BLOCK);
+        }
+
+        /// @brief Row stride of the blocks of block column b, padded so every block row starts aligned
+        inline size_t blockStride(size_t b) const
+        {
+            return BasicMatrix<T>::paddedStride(extent(b));
+        }
+
+        size_t n_ = 0;
+        size_t blocks_per_side_ = 0;
+        /// @brief Start of every stored block within storage_, in blockIndex() order
+        std::vector<size_t> offsets_;
+        BasicMatrix<T> storage_;
+        std::vector<T> diagonal_;
+    };
+
+    using PackedSymmetricMatrix = BasicPackedSymmetricMatrix<double>;
+}
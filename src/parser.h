@@ -1,205 +1,1258 @@
 #pragma once
 #include <iostream>
-#include <fstream>
-#include <sstream>
 #include <vector>
+#include <span>
+#include <charconv>
+#include <cstring>
+#include <stdexcept>
+#include <optional>
 #include <cmath>
 #include <string>
 #include <limits>
 #include <algorithm>
 #include <chrono>
+#include <functional>
+#include <mutex>
 #include "matrix.h"
+#include "sparse_matrix.h"
 #include "threadpool.h"
+#include "simd.h"
+#include "mapped_file.h"
+#include "binary_format.h"
+#include "cache.h"
+#include "similarity.h"
+#include "packed_matrix.h"
+#include "similarity_provider.h"
+#include "metrics.h"
+#include "statistics.h"
+#include "instrumentation.h"
 
 namespace AP
 {
+    /// @brief Malformed input, the message starts with file:line
+    class ParseError : public std::runtime_error
+    {
+    public:
+        ParseError(const std::string &filename, size_t line, const std::string &message)
+            : std::runtime_error(filename + ":" + std::to_string(line) + ": " + message), line_(line) {}
+
+        /// @brief 1-based line number of the offending line
+        inline size_t line() const
+        {
+            return line_;
+        }
+
+    private:
+        size_t line_;
+    };
+
     class Parser
     {
     public:
+        /// @brief Parse whitespace separated values, one point per line
+        /// @param filename path to the file
+        /// @param limit_rows maximum number of points to read, 0 reads the whole file
         inline void parseTXT(std::string filename, uint32_t limit_rows = 0)
         {
-            std::ifstream file(filename);
+            parseFile(filename, limit_rows, Format::TXT);
+        }
+
+        /// @brief Parse comma separated values with a header row, the first column of every row is a label and is skipped
+        /// @param filename path to the file
+        /// @param limit_rows maximum number of points to read, 0 reads the whole file
+        inline void parseCSV(std::string filename, uint32_t limit_rows = 0)
+        {
+            parseFile(filename, limit_rows, Format::CSV);
+        }
+
+        /// @brief Parsed points, one row per point
+        inline const Matrix &getPoints() const
+        {
+            return points_;
+        }
+
+        /// @brief Timers and counters of everything the parser did, also where verbosity is configured
+        inline Instrumentation &getInstrumentation()
+        {
+            return instrumentation_;
+        }
+
+        /// @brief Use a directory of binary matrices to skip parsing and similarity computation
+        ///        for inputs that were already processed. Entries are keyed on the file contents and the metric
+        inline void setCache(const std::string &directory)
+        {
+            cache_.emplace(directory);
+        }
+
+        /// @brief Run every stage on a pool the caller has started and stops, instead of starting one per stage, see Pipeline
+        inline void setThreadPool(Threading::ThreadPool &pool)
+        {
+            pool_ = &pool;
+        }
+
+        /// @brief Dense negative squared Euclidean similarity matrix with the preference on the diagonal.
+        ///        Statistics for the preference are taken over the off-diagonal entries only
+        /// @tparam T storage type, similarities are computed in double and rounded once when stored.
+        ///         The cache only holds double matrices and is bypassed for other types
+        /// @param diagonal preference policy for the diagonal
+        /// @param percentile percentile in [0, 100] used by the Percentile policy, lower values give fewer clusters
+        template <typename T = double>
+        inline BasicMatrix<T> getSimilarity(Diagonal diagonal = Median, double percentile = 50.0)
+        {
+            return computeSimilarity<T>(Binary::Metric::NegSquaredEuclidean, true, diagonal, percentile,
+                [this]()
+                {
+                    return [this, operands = Similarity::prepare(points_, simd_)](BasicMatrixView<T> block, size_t row_begin, size_t col_begin)
+                    {
+                        Similarity::computeBlock(operands, block, row_begin, col_begin, simd_);
+                    };
+                });
+        }
+
+        /// @brief Dense similarity matrix of any metric policy, see Metrics, with the preference on the diagonal.
+        ///        The metric is inlined into the kernel, which is compiled for the exact dimension of up to Metrics::FIXED_DIMENSIONS.
+        ///        Only metrics with an id go through the cache
+        /// @tparam T storage type, similarities are computed in double and rounded once when stored
+        /// @param metric policy instance, user functors may carry state
+        /// @param diagonal preference policy for the diagonal
+        /// @param percentile percentile in [0, 100] used by the Percentile policy
+        template <typename T = double, Metrics::Metric M>
+        inline BasicMatrix<T> getSimilarity(const M &metric, Diagonal diagonal = Median, double percentile = 50.0)
+        {
+            std::optional<Binary::Metric> id;
+            if constexpr (Metrics::hasId<M>())
+                id = M::id;
+            return computeSimilarity<T>(id, Metrics::isSymmetric<M>(), diagonal, percentile,
+                [this, &metric]()
+                {
+                    return [&metric, operands = Metrics::Operands<M>(points_, metric)](BasicMatrixView<T> block, size_t row_begin, size_t col_begin)
+                    {
+                        Metrics::computeBlock(metric, operands, block, row_begin, col_begin);
+                    };
+                });
+        }
+
+        /// @brief Negative squared Euclidean similarities in packed symmetric storage, see BasicPackedSymmetricMatrix.
+        ///        Only the blocks on and above the diagonal are computed and written, the preference goes to the separate diagonal.
+        ///        The values and the exact statistics are the same as getSimilarity() gives. The cache only holds dense matrices and is not used
+        /// @tparam T storage type, similarities are computed in double and rounded once when stored
+        /// @param diagonal preference policy for the diagonal
+        /// @param percentile percentile in [0, 100] used by the Percentile policy
+        template <typename T = double>
+        inline BasicPackedSymmetricMatrix<T> getPackedSimilarity(Diagonal diagonal = Median, double percentile = 50.0)
+        {
+            return computePackedSimilarity<T>(diagonal, percentile,
+                [this]()
+                {
+                    return [this, operands = Similarity::prepare(points_, simd_)](BasicMatrixView<T> block, size_t row_begin, size_t col_begin)
+                    {
+                        Similarity::computeBlock(operands, block, row_begin, col_begin, simd_);
+                    };
+                });
+        }
+
+        /// @brief getPackedSimilarity() for a symmetric metric policy, see Metrics
+        /// @param metric policy instance, user functors may carry state
+        template <typename T = double, Metrics::Metric M>
+        inline BasicPackedSymmetricMatrix<T> getPackedSimilarity(const M &metric, Diagonal diagonal = Median, double percentile = 50.0)
+        {
+            static_assert(Metrics::isSymmetric<M>(), "Packed storage needs a symmetric metric");
+            return computePackedSimilarity<T>(diagonal, percentile,
+                [this, &metric]()
+                {
+                    return [&metric, operands = Metrics::Operands<M>(points_, metric)](BasicMatrixView<T> block, size_t row_begin, size_t col_begin)
+                    {
+                        Metrics::computeBlock(metric, operands, block, row_begin, col_begin);
+                    };
+                });
+        }
+
+        /// @brief Parse whitespace separated values and compute their dense similarity matrix as one task graph, see Pipeline.
+        ///        Every chunk of the file prepares its points for the metric right after parsing them, and each block of the
+        ///        upper triangle is computed as soon as the chunks holding its rows and columns are parsed. The preference statistics
+        ///        are gathered from every block as it completes: Min and Max are exact, Median and Percentile come from a
+        ///        deterministic sample like writeSimilarity() takes, which is every pair up to about a million of them
+        /// @param similarities receives the matrix, it has its final size before any block is computed
+        /// @param on_size called once on the pool as soon as similarities has its size and runs concurrently with the blocks,
+        ///        such as BasicAffinityPropagation::prepare() of a fit over similarities
+        /// @param diagonal preference policy for the diagonal
+        /// @param percentile percentile in [0, 100] used by the Percentile policy
+        /// @param metric symmetric policy, see Metrics
+        template <typename T = double, Metrics::Metric M = Metrics::NegSquaredEuclidean, typename F>
+        inline void streamTXT(const std::string &filename, BasicMatrix<T> &similarities, F &&on_size, Diagonal diagonal = Median, double percentile = 50.0, const M &metric = M{})
+        {
+            streamFile(filename, Format::TXT, similarities, on_size, diagonal, percentile, metric);
+        }
 
-            if (!file.is_open())
+        /// @brief streamTXT() for comma separated values with a header line
+        template <typename T = double, Metrics::Metric M = Metrics::NegSquaredEuclidean, typename F>
+        inline void streamCSV(const std::string &filename, BasicMatrix<T> &similarities, F &&on_size, Diagonal diagonal = Median, double percentile = 50.0, const M &metric = M{})
+        {
+            streamFile(filename, Format::CSV, similarities, on_size, diagonal, percentile, metric);
+        }
+
+        /// @brief Compute the dense similarity matrix straight into a binary matrix file one row tile at a time,
+        ///        so the matrix never has to fit in memory, see OutOfCoreAffinityPropagation.
+        ///        Min and Max are exact, Median and Percentile are estimated from a deterministic sample of about a million off-diagonal values
+        /// @param filename destination in the Binary format
+        /// @param diagonal preference policy for the diagonal
+        /// @param memory_budget bytes of the output kept resident at a time
+        /// @param percentile percentile in [0, 100] used by the Percentile policy
+        inline void writeSimilarity(const std::string &filename, Diagonal diagonal = Median, size_t memory_budget = size_t(1) << 30, double percentile = 50.0)
+        {
+            checkPercentile(percentile);
+            size_t n = points_.rows();
+            Binary::Header header = Binary::makeHeader(Binary::Kind::Similarity, n, n);
+            size_t stride = header.stride;
+            size_t tile_rows = std::max<size_t>(1, memory_budget / (stride * sizeof(double)));
+            SampledStatistics statistics(n);
+
+            auto timer = instrumentation_.time(Phase::Similarity);
+
+            std::string temporary = filename + ".tmp";
+            MappedFile file = MappedFile::create(temporary, header.data_offset + n * stride * sizeof(double));
+            MatrixView similarityMatrix(reinterpret_cast<double *>(file.mutableData() + header.data_offset), n, n, stride);
+
+            startPool();
+
+            Similarity::Operands operands = Similarity::prepare(points_, simd_);
+            size_t block = Similarity::blockRows(points_.cols());
+
+            for (size_t tile_begin = 0; tile_begin < n; tile_begin += tile_rows)
+            {
+                size_t tile_end = std::min(n, tile_begin + tile_rows);
+
+                pool_->parallel_for(tile_begin, tile_end, 4,
+                    [&](size_t begin, size_t end)
+                    {
+                        for (size_t col_begin = 0; col_begin < n; col_begin += block)
+                        {
+                            size_t cols = std::min(block, n - col_begin);
+                            Similarity::computeBlock(operands, similarityMatrix.block(begin, col_begin, end - begin, cols), begin, col_begin, simd_);
+                        }
+
+                        for (size_t i = begin; i < end; ++i)
+                        {
+                            statistics.addRow(i, similarityMatrix.row(i));
+                        }
+                    });
+
+                // hand the finished tile to the page cache so resident memory stays within the budget
+                const double *tile = similarityMatrix.row(tile_begin).data();
+                size_t tile_bytes = (tile_end - tile_begin) * stride * sizeof(double);
+                MappedFile::flushAsync(tile, tile_bytes);
+                MappedFile::advise(tile, tile_bytes, MADV_DONTNEED);
+            }
+
+            stopPool();
+
+            double min = statistics.min();
+            double max = statistics.max();
+            double median = sampleQuantile(statistics.samples, 0.5);
+            double at_percentile = diagonal == Percentile ? sampleQuantile(statistics.samples, percentile / 100.0) : 0.0;
+
+            double preference = diagonalValue(diagonal, min, max, median, at_percentile);
+            for (size_t i = 0; i < n; ++i)
+            {
+                similarityMatrix(i, i) = preference;
+            }
+
+            header.metric = Binary::Metric::NegSquaredEuclidean;
+            header.diagonal = diagonal;
+            header.source_hash = Binary::hash(points_);
+            header.stat_min = min;
+            header.stat_max = max;
+            header.stat_median = median;
+            std::memcpy(file.mutableData(), &header, sizeof(header));
+
+            file = MappedFile();
+            if (std::rename(temporary.c_str(), filename.c_str()) != 0)
+            {
+                std::remove(temporary.c_str());
+                throw std::runtime_error("Error renaming " + temporary + " to " + filename);
+            }
+
+            instrumentation_.count(Counter::SimilarityEntries, n * n);
+            instrumentation_.log(Verbosity::Summary, "Wrote similarity matrix to ", filename, " in ", timer.elapsed(), " milliseconds");
+        }
+
+        /// @brief Negative squared Euclidean similarities that are computed from the points whenever a fit needs a tile of rows,
+        ///        so the n x n matrix is never stored, see PointSimilarities. Pays off for points of few dimensions.
+        ///        The preference comes from one parallel pass over the computed rows, nothing of which is kept:
+        ///        Min and Max are exact, Median and Percentile are estimated from the same sample writeSimilarity() takes
+        /// @tparam T value type of the rows handed to the fit
+        /// @param diagonal preference policy for the diagonal
+        /// @param percentile percentile in [0, 100] used by the Percentile policy
+        template <typename T = double>
+        inline PointSimilarities<T> getPointSimilarities(Diagonal diagonal = Median, double percentile = 50.0)
+        {
+            checkPercentile(percentile);
+            size_t n = points_.rows();
+            auto timer = instrumentation_.time(Phase::Similarity);
+
+            double preference = diagonalValue(diagonal, 0.0, 0.0, 0.0, 0.0);
+            if (needsStatistics(diagonal))
+            {
+                preference = streamedPreference(PointSimilarities<double>(points_, 0.0), diagonal, percentile);
+            }
+
+            instrumentation_.log(Verbosity::Summary, "Prepared similarities of ", n, " points for computation on the fly in ", timer.elapsed(), " milliseconds");
+            return PointSimilarities<T>(points_, preference);
+        }
+
+        /// @brief getPointSimilarities() for any metric policy, see Metrics and MetricSimilarities
+        /// @param metric policy instance, copied into the provider
+        template <typename T = double, Metrics::Metric M>
+        inline MetricSimilarities<T, M> getPointSimilarities(const M &metric, Diagonal diagonal = Median, double percentile = 50.0)
+        {
+            checkPercentile(percentile);
+            size_t n = points_.rows();
+            auto timer = instrumentation_.time(Phase::Similarity);
+
+            double preference = diagonalValue(diagonal, 0.0, 0.0, 0.0, 0.0);
+            if (needsStatistics(diagonal))
             {
-                std::cerr << "Error opening file: " << filename << std::endl;
-                exit(EXIT_FAILURE);
+                preference = streamedPreference(MetricSimilarities<double, M>(points_, 0.0, metric), diagonal, percentile);
             }
 
-            uint32_t rows_read = 0;
-            auto start = std::chrono::high_resolution_clock::now();
+            instrumentation_.log(Verbosity::Summary, "Prepared similarities of ", n, " points for computation on the fly in ", timer.elapsed(), " milliseconds");
+            return MetricSimilarities<T, M>(points_, preference, metric);
+        }
+
+        /// @brief Build a sparse similarity graph that keeps only the k nearest neighbours of every point
+        ///        plus the diagonal, so memory is O(n * k) instead of O(n^2).
+        ///        Min, Max, Median and Percentile preferences are taken over the stored neighbour similarities
+        /// @param neighbours number of nearest neighbours kept per point, clamped to n - 1
+        /// @param diagonal preference policy for the diagonal
+        /// @param percentile percentile in [0, 100] used by the Percentile policy
+        inline SparseMatrix getSparseSimilarity(unsigned int neighbours, Diagonal diagonal = Median, double percentile = 50.0)
+        {
+            checkPercentile(percentile);
+            size_t n = points_.rows();
+            if (neighbours == 0)
+            {
+                throw std::invalid_argument("At least one neighbour is required");
+            }
+            size_t k = std::min<size_t>(neighbours, n > 0 ? n - 1 : 0);
+            size_t per_row = k + 1;
 
-            // Read the file line by line
-            std::string line;
-            while (std::getline(file, line))
+            std::vector<size_t> row_offsets(n + 1);
+            for (size_t i = 0; i <= n; ++i)
             {
-                std::istringstream iss(line);
-                double value;
-                std::vector<double> row;
+                row_offsets[i] = i * per_row;
+            }
+            std::vector<unsigned int> columns(n * per_row);
+            std::vector<double> values(n * per_row);
+
+            auto timer = instrumentation_.time(Phase::Similarity);
 
-                // Read each value in the line
-                while (iss >> value)
+            startPool();
+
+            Similarity::Operands operands = Similarity::prepare(points_, simd_);
+            pool_->parallel_for(0, n, 1,
+                [&](size_t begin, size_t end)
                 {
-                    row.push_back(value);
-                }
+                    std::vector<std::pair<double, unsigned int>> candidates;
+                    candidates.reserve(n);
+                    Matrix row(1, n);
+
+                    for (size_t i = begin; i < end; ++i)
+                    {
+                        Similarity::computeBlock(operands, row.view(), i, 0, simd_);
+
+                        candidates.clear();
+                        for (size_t j = 0; j < n; ++j)
+                        {
+                            if (i != j)
+                            {
+                                candidates.emplace_back(row(0, j), j);
+                            }
+                        }
+
+                        // most similar first, ties broken by index so the graph is deterministic
+                        auto more_similar = [](const auto &lhs, const auto &rhs)
+                        {
+                            return lhs.first > rhs.first || (lhs.first == rhs.first && lhs.second < rhs.second);
+                        };
+                        std::nth_element(candidates.begin(), candidates.begin() + k, candidates.end(), more_similar);
+                        candidates.resize(k);
+                        candidates.emplace_back(0.0, i);
+                        std::sort(candidates.begin(), candidates.end(), [](const auto &lhs, const auto &rhs)
+                                  { return lhs.second < rhs.second; });
+
+                        for (size_t e = 0; e < per_row; ++e)
+                        {
+                            columns[i * per_row + e] = candidates[e].second;
+                            values[i * per_row + e] = candidates[e].first;
+                        }
+                    }
+                });
+
+            stopPool();
+
+            std::vector<double> off_diagonal;
+            off_diagonal.reserve(n * k);
+            for (size_t e = 0; e < values.size(); ++e)
+            {
+                if (columns[e] != e / per_row)
+                    off_diagonal.push_back(values[e]);
+            }
+
+            double preference = 0.0;
+            if (!off_diagonal.empty())
+            {
+                auto [min, max] = std::minmax_element(off_diagonal.begin(), off_diagonal.end());
+                double lowest = *min;
+                double highest = *max;
+                double median = sampleQuantile(off_diagonal, 0.5);
+                double at_percentile = diagonal == Percentile ? sampleQuantile(off_diagonal, percentile / 100.0) : 0.0;
+                preference = diagonalValue(diagonal, lowest, highest, median, at_percentile);
+            }
+
+            SparseMatrix similarityGraph(n, std::move(row_offsets), std::move(columns), std::move(values));
+            for (size_t i = 0; i < n; ++i)
+            {
+                similarityGraph.values()[similarityGraph.diagonalIndex(i)] = preference;
+            }
+
+            instrumentation_.count(Counter::SimilarityEntries, similarityGraph.nonZeros());
+            instrumentation_.log(Verbosity::Summary, "Computed ", k, "-nearest-neighbour similarity graph in ", timer.elapsed(), " milliseconds");
+
+            return similarityGraph;
+        }
+
+    private:
+        enum class Format
+        {
+            TXT,
+            CSV
+        };
+
+        /// @brief Newline aligned piece of the input parsed by a single task
+        struct Chunk
+        {
+            const char *begin = nullptr;
+            const char *end = nullptr;
+            size_t first_line = 0;
+            size_t first_row = 0;
+            size_t lines = 0;
+            size_t rows = 0;
+            size_t error_line = 0;
+            std::string error;
+        };
+
+        /// @brief Mapped input and where its points are, see openInput() and splitInput()
+        struct Input
+        {
+            std::string filename;
+            Format format = Format::TXT;
+            MappedFile file;
+            /// @brief First line of the points, after the header of a CSV file
+            const char *body = nullptr;
+            /// @brief End of the points, before the lines past the row limit
+            const char *end = nullptr;
+            size_t first_line = 1;
+            size_t cols = 0;
+            size_t rows = 0;
+            std::vector<Chunk> chunks;
+            /// @brief Cache key of the points, 0 without a cache
+            uint64_t key = 0;
+        };
 
-                // Store the row in the vector
-                points_.push_back(row);
-                rows_read++;
+        /// @brief Memory map the file, split it into newline aligned chunks and parse them in parallel
+        ///        straight into the row-major point matrix. Errors are reported with their line number
+        inline void parseFile(const std::string &filename, uint32_t limit_rows, Format format)
+        {
+            auto timer = instrumentation_.time(Phase::Parse);
+
+            Input input;
+            if (!openInput(filename, limit_rows, format, input))
+            {
+                instrumentation_.log(Verbosity::Summary, "File ", filename, " loaded from cache and ", points_.rows(), " rows were retrieved in ", timer.elapsed(), " milliseconds");
+                return;
             }
 
-            auto end = std::chrono::high_resolution_clock::now();
-            auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+            startPool();
+            splitInput(input);
+            points_ = Matrix(input.rows, input.cols);
+            pool_->parallel_for(0, input.chunks.size(), 1,
+                [&](size_t chunk_begin, size_t chunk_end)
+                {
+                    for (size_t c = chunk_begin; c < chunk_end; ++c)
+                    {
+                        parseChunk(input.chunks[c], input.cols, format);
+                    }
+                });
+            stopPool();
 
-            std::cout << "File " << filename << " parsed and " << rows_read << " rows were retrieved in " << duration.count() << " milliseconds" << std::endl;
+            finishInput(input);
+            instrumentation_.log(Verbosity::Summary, "File ", filename, " parsed and ", input.rows, " rows were retrieved in ", timer.elapsed(), " milliseconds");
         }
-    
-        inline void parseCSV(std::string filename, uint32_t limit_rows = 0)
+
+        /// @brief Map the file and find the region of the points and their number of values
+        /// @return false when the points were loaded from the cache instead, there is nothing to parse then
+        inline bool openInput(const std::string &filename, uint32_t limit_rows, Format format, Input &input)
         {
-            std::ifstream file(filename);
+            input.filename = filename;
+            input.format = format;
+            input.file = MappedFile(filename);
+
+            if (cache_)
+            {
+                uint64_t options[2] = {static_cast<uint64_t>(format), limit_rows};
+                input.key = Binary::hash(input.file.data(), input.file.size(), Binary::hash(options, sizeof(options)));
+
+                Binary::Header header;
+                if (cache_->load(Binary::Kind::Points, input.key, header, points_))
+                {
+                    instrumentation_.count(Counter::CacheHits);
+                    instrumentation_.count(Counter::ParsedRows, points_.rows());
+                    return false;
+                }
+                instrumentation_.count(Counter::CacheMisses);
+            }
+
+            const char *body = input.file.begin();
+            const char *end = input.file.end();
+            size_t first_line = 1;
+
+            if (format == Format::CSV && body != end)
+            {
+                body = lineEnd(body, end);
+                body = body == end ? end : body + 1;
+                first_line = 2;
+            }
 
-            if (!file.is_open())
+            if (limit_rows != 0)
             {
-                std::cerr << "Error opening file: " << filename << std::endl;
-                exit(EXIT_FAILURE);
+                end = afterRows(body, end, limit_rows);
             }
-            bool skipFirstColumn = true;
-            uint32_t rows_read = 0;
-            std::string line;
-            auto start = std::chrono::high_resolution_clock::now();
 
-            std::getline(file, line); // skip first row
-            while (std::getline(file, line))
+            size_t cols = 0;
             {
-                if (rows_read >= limit_rows && limit_rows != 0)
-                    break;
+                const char *line = body;
+                size_t line_number = first_line;
+                while (line < end)
+                {
+                    const char *next = lineEnd(line, end);
+                    if (!isBlank(line, next))
+                    {
+                        cols = countValues(line, next, format);
+                        if (cols == 0)
+                        {
+                            throw ParseError(filename, line_number, "no values found");
+                        }
+                        break;
+                    }
+                    line = next + 1;
+                    ++line_number;
+                }
+            }
+
+            input.body = body;
+            input.end = end;
+            input.first_line = first_line;
+            input.cols = cols;
+            return true;
+        }
 
-                std::stringstream ss(line);
-                std::string cell;
-                std::vector<double> row;
+        /// @brief Split the points into chunks and count the lines and rows of every chunk in parallel,
+        ///        so every chunk knows where its rows go before any of them is parsed
+        inline void splitInput(Input &input)
+        {
+            input.chunks = splitChunks(input.body, input.end);
 
-                while (std::getline(ss, cell, ','))
+            pool_->parallel_for(0, input.chunks.size(), 1,
+                [&](size_t chunk_begin, size_t chunk_end)
                 {
-                    if (!skipFirstColumn)
+                    for (size_t c = chunk_begin; c < chunk_end; ++c)
                     {
-                        row.push_back(std::stod(cell));
-                        skipFirstColumn = false;
+                        Chunk &chunk = input.chunks[c];
+                        for (const char *line = chunk.begin; line < chunk.end;)
+                        {
+                            const char *next = lineEnd(line, chunk.end);
+                            chunk.lines++;
+                            chunk.rows += !isBlank(line, next);
+                            line = next + 1;
+                        }
                     }
-                    else
+                });
+
+            size_t first_line = input.first_line;
+            size_t rows = 0;
+            for (Chunk &chunk : input.chunks)
+            {
+                chunk.first_line = first_line;
+                chunk.first_row = rows;
+                first_line += chunk.lines;
+                rows += chunk.rows;
+            }
+            input.rows = rows;
+        }
+
+        /// @brief Parse the rows of a chunk into points_, which has to have their size. An error stops the chunk and is kept in it
+        /// @return true when every row of the chunk was parsed
+        inline bool parseChunk(Chunk &chunk, size_t cols, Format format)
+        {
+            size_t row = chunk.first_row;
+            size_t line_number = chunk.first_line;
+            for (const char *line = chunk.begin; line < chunk.end; ++line_number)
+            {
+                const char *next = lineEnd(line, chunk.end);
+                if (!isBlank(line, next))
+                {
+                    const char *message = parseLine(line, next, points_.row(row).data(), cols, format);
+                    if (message != nullptr)
                     {
-                        skipFirstColumn = false;
+                        chunk.error_line = line_number;
+                        chunk.error = message;
+                        return false;
                     }
+                    ++row;
+                }
+                line = next + 1;
+            }
+            return true;
+        }
+
+        /// @brief Throw the error of the first chunk that failed, otherwise store the points in the cache
+        inline void finishInput(const Input &input)
+        {
+            for (const Chunk &chunk : input.chunks)
+            {
+                if (chunk.error_line != 0)
+                {
+                    points_ = Matrix();
+                    throw ParseError(input.filename, chunk.error_line, chunk.error);
                 }
-                points_.push_back(row);
-                skipFirstColumn = true;
-                rows_read++;
             }
-            auto end = std::chrono::high_resolution_clock::now();
-            auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
 
-            std::cout << "File " << filename << " parsed and " << rows_read << " rows were retrieved in " << duration.count() << " milliseconds" << std::endl;
+            if (cache_)
+            {
+                cache_->store(Binary::Kind::Points, input.key, Binary::makeHeader(Binary::Kind::Points, points_), points_);
+            }
+
+            instrumentation_.count(Counter::ParsedRows, input.rows);
         }
 
-        inline Matrix getSimilarity(Diagonal diagonal = Median)
+        /// @brief Parsing, operand preparation and the blocks of the similarity matrix as tasks of one group, see streamTXT()
+        template <typename T, Metrics::Metric M, typename F>
+        inline void streamFile(const std::string &filename, Format format, BasicMatrix<T> &similarities, F &on_size, Diagonal diagonal, double percentile, const M &metric)
         {
-            auto width = MatrixHeight(points_);
-            auto height = MatrixHeight(points_);
-            Matrix similarityMatrix = CreateMatrix(width, height, 0.0);
+            static_assert(Metrics::isSymmetric<M>(), "Streaming computes the upper triangle only and needs a symmetric metric");
+            checkPercentile(percentile);
 
-            auto start = std::chrono::high_resolution_clock::now();
+            Input input;
+            bool cached = false;
+            {
+                auto timer = instrumentation_.time(Phase::Parse);
+                cached = !openInput(filename, 0, format, input);
+                startPool();
+                if (cached)
+                {
+                    input.rows = points_.rows();
+                    input.cols = points_.cols();
+                }
+                else
+                {
+                    splitInput(input);
+                    points_ = Matrix(input.rows, input.cols);
+                }
+            }
 
-            thread_pool_.start();
+            auto timer = instrumentation_.time(Phase::Similarity);
+            size_t n = input.rows;
+            similarities = BasicMatrix<T>::uninitialized(n, n);
+            Metrics::Operands<M> operands(n, input.cols);
 
-            for (size_t i = 0; i < height; ++i)
+            size_t block = Similarity::blockRows(input.cols);
+            size_t blocks = (n + block - 1) / block;
+            BlockStatistics statistics(n, blocks * blocks);
+            BasicMatrixView<T> view = similarities.view();
+
+            // Column cb of upper blocks covers rows and columns up to the end of block cb, once those points are parsed it is released
+            std::vector<std::function<void(size_t, size_t)>> columns(blocks);
+            for (size_t cb = 0; cb < blocks; ++cb)
             {
-                thread_pool_.queue_job(
-                    [&, i]()
+                columns[cb] = [&, cb](size_t first_block, size_t last_block)
+                {
+                    size_t col_begin = cb * block;
+                    size_t cols = std::min(block, n - col_begin);
+                    for (size_t rb = first_block; rb < last_block; ++rb)
                     {
-                        for (size_t j = 0; j < width; ++j)
+                        size_t row_begin = rb * block;
+                        size_t rows = std::min(block, n - row_begin);
+                        BasicMatrixView<T> out = view.block(row_begin, col_begin, rows, cols);
+                        Metrics::computeBlock(metric, operands, out, row_begin, col_begin);
+                        Similarity::mirror(view, row_begin, rows, col_begin, cols);
+                        statistics.addBlock(rb * blocks + cb, BasicMatrixView<const T>(out.data(), rows, cols, out.rowStride()), rb == cb);
+                    }
+                };
+            }
+
+            Threading::TaskGroup group;
+            std::mutex mutex;
+            std::vector<char> parsed(input.chunks.size(), 0);
+            size_t parsed_chunks = 0;
+            size_t released = 0;
+            bool failed = false;
+            // Called with the mutex held once the first ready_rows points are prepared
+            auto release = [&](size_t ready_rows)
+            {
+                for (; released < blocks && std::min(n, (released + 1) * block) <= ready_rows; ++released)
+                {
+                    pool_->spawn(group, 0, released + 1, 1, columns[released]);
+                }
+            };
+
+            auto size_known = [&]()
+            {
+                on_size();
+            };
+            pool_->run(group, size_known);
+
+            auto parse = [&](size_t chunk_begin, size_t chunk_end)
+            {
+                for (size_t c = chunk_begin; c < chunk_end; ++c)
+                {
+                    Chunk &chunk = input.chunks[c];
+                    bool ok = parseChunk(chunk, input.cols, format);
+                    if (ok)
+                        operands.load(points_, chunk.first_row, chunk.first_row + chunk.rows, metric);
+
+                    std::lock_guard<std::mutex> lock(mutex);
+                    failed |= !ok;
+                    parsed[c] = 1;
+                    while (parsed_chunks < parsed.size() && parsed[parsed_chunks])
+                        ++parsed_chunks;
+                    if (!failed)
+                        release(parsed_chunks < parsed.size() ? input.chunks[parsed_chunks].first_row : n);
+                }
+            };
+
+            if (cached)
+            {
+                operands.load(points_, 0, n, metric);
+                std::lock_guard<std::mutex> lock(mutex);
+                release(n);
+            }
+            else
+            {
+                pool_->spawn(group, 0, input.chunks.size(), 1, parse);
+            }
+            pool_->wait(group);
+            stopPool();
+
+            if (!cached)
+            {
+                finishInput(input);
+            }
+
+            std::vector<double> samples = statistics.samples();
+            double median = diagonal == Median ? sampleQuantile(samples, 0.5) : 0.0;
+            double at_percentile = diagonal == Percentile ? sampleQuantile(samples, percentile / 100.0) : 0.0;
+            double preference = diagonalValue(diagonal, statistics.min(), statistics.max(), median, at_percentile);
+            for (size_t i = 0; i < n; ++i)
+            {
+                similarities(i, i) = static_cast<T>(preference);
+            }
+
+            instrumentation_.count(Counter::SimilarityEntries, n * n);
+            instrumentation_.log(Verbosity::Summary, "Parsed ", filename, " and computed the similarity matrix of its ", n, " rows in ", timer.elapsed(), " milliseconds");
+        }
+
+        /// @brief Split [begin, end) into roughly equal chunks that each start at the beginning of a line
+        inline std::vector<Chunk> splitChunks(const char *begin, const char *end)
+        {
+            constexpr size_t min_chunk = 1 << 16;
+            size_t target = std::max<size_t>(1, 4 * pool_->size());
+            size_t chunk_size = std::max(min_chunk, static_cast<size_t>(end - begin) / target + 1);
+
+            std::vector<Chunk> chunks;
+            const char *chunk_begin = begin;
+            while (chunk_begin < end)
+            {
+                const char *chunk_end = chunk_begin + std::min<size_t>(chunk_size, end - chunk_begin);
+                if (chunk_end < end)
+                {
+                    chunk_end = lineEnd(chunk_end, end);
+                    chunk_end = chunk_end == end ? end : chunk_end + 1;
+                }
+                Chunk chunk;
+                chunk.begin = chunk_begin;
+                chunk.end = chunk_end;
+                chunks.push_back(chunk);
+                chunk_begin = chunk_end;
+            }
+            return chunks;
+        }
+
+        /// @brief Position of the newline terminating the line that contains pos, or end
+        static inline const char *lineEnd(const char *pos, const char *end)
+        {
+            const void *newline = std::memchr(pos, '\n', end - pos);
+            return newline == nullptr ? end : static_cast<const char *>(newline);
+        }
+
+        /// @brief End of the region holding the first limit non-blank lines
+        static inline const char *afterRows(const char *begin, const char *end, size_t limit)
+        {
+            size_t rows = 0;
+            const char *line = begin;
+            while (line < end && rows < limit)
+            {
+                const char *next = lineEnd(line, end);
+                rows += !isBlank(line, next);
+                line = next == end ? end : next + 1;
+            }
+            return line;
+        }
+
+        static inline bool isSpace(char c)
+        {
+            return c == ' ' || c == '\t' || c == '\r';
+        }
+
+        static inline const char *skipSpaces(const char *pos, const char *end)
+        {
+            while (pos < end && isSpace(*pos))
+                ++pos;
+            return pos;
+        }
+
+        static inline bool isBlank(const char *begin, const char *end)
+        {
+            return skipSpaces(begin, end) == end;
+        }
+
+        /// @brief Number of values on a line, the label column of a CSV line is not counted
+        static inline size_t countValues(const char *begin, const char *end, Format format)
+        {
+            if (format == Format::CSV)
+            {
+                return std::count(begin, end, ',');
+            }
+
+            size_t count = 0;
+            const char *pos = skipSpaces(begin, end);
+            while (pos < end)
+            {
+                ++count;
+                while (pos < end && !isSpace(*pos))
+                    ++pos;
+                pos = skipSpaces(pos, end);
+            }
+            return count;
+        }
+
+        /// @brief Parse exactly cols values of one line into row
+        /// @return nullptr on success, otherwise a description of the problem
+        static inline const char *parseLine(const char *begin, const char *end, double *row, size_t cols, Format format)
+        {
+            const char *pos = begin;
+            if (format == Format::CSV)
+            {
+                pos = static_cast<const char *>(std::memchr(pos, ',', end - pos));
+                if (pos == nullptr)
+                    return "missing values after the label column";
+            }
+
+            for (size_t c = 0; c < cols; ++c)
+            {
+                if (format == Format::CSV)
+                {
+                    if (pos == end || *pos != ',')
+                        return "fewer values than on the first row";
+                    ++pos;
+                }
+
+                pos = skipSpaces(pos, end);
+                if (pos < end && *pos == '+')
+                    ++pos;
+                if (pos == end)
+                    return "fewer values than on the first row";
+
+                auto [next, ec] = std::from_chars(pos, end, row[c]);
+                if (ec != std::errc() || (next < end && !isSpace(*next) && *next != ','))
+                    return "invalid number";
+                pos = skipSpaces(next, end);
+            }
+
+            if (pos != end)
+                return "more values than on the first row";
+            return nullptr;
+        }
+
+        /// @brief Dense similarity matrix with the preference on the diagonal, looked up in and stored to the cache when there is a metric id
+        /// @param metric identifies the metric in the cache, empty for metrics that cannot be cached
+        /// @param symmetric compute only the blocks on or above the diagonal and mirror them
+        /// @param prepare called on a cache miss, returns the kernel filling a block of the matrix as kernel(block, row_begin, col_begin)
+        template <typename T, typename Prepare>
+        inline BasicMatrix<T> computeSimilarity(std::optional<Binary::Metric> metric, bool symmetric, Diagonal diagonal, double percentile, Prepare &&prepare)
+        {
+            constexpr bool cacheable = std::is_same_v<T, double>;
+            checkPercentile(percentile);
+            auto width = points_.rows();
+            auto height = points_.rows();
+
+            auto timer = instrumentation_.time(Phase::Similarity);
+
+            uint64_t key = 0;
+            if constexpr (cacheable)
+            {
+                if (cache_ && metric)
+                {
+                    key = Binary::hash(&*metric, sizeof(*metric), Binary::hash(points_));
+
+                    Binary::Header header;
+                    Matrix cached;
+                    if (cache_->load(Binary::Kind::Similarity, key, header, cached))
+                    {
+                        instrumentation_.count(Counter::CacheHits);
+                        double at_percentile = 0.0;
+                        if (diagonal == Percentile)
                         {
-                            if (i != j)
-                            {
-                                double nsqred = negSquaredEuclideanDistance(points_[i], points_[j]);
-                                similarityMatrix[i][j] = nsqred;
-                            }
+                            startPool();
+                            at_percentile = Math::quantile(cached.view(), percentile / 100.0, *pool_);
+                            stopPool();
                         }
-                    });
+                        double preference = diagonalValue(diagonal, header.stat_min, header.stat_max, header.stat_median, at_percentile);
+                        for (size_t i = 0; i < height; ++i)
+                        {
+                            cached(i, i) = preference;
+                        }
+
+                        instrumentation_.log(Verbosity::Summary, "Loaded similarity matrix from cache in ", timer.elapsed(), " milliseconds");
+                        return cached;
+                    }
+                    instrumentation_.count(Counter::CacheMisses);
+                }
+            }
+
+            BasicMatrix<T> similarityMatrix = BasicMatrix<T>::uninitialized(height, width);
+
+            startPool();
+            // Placed like the rows of the messages, so a fit on a pool of the same size and affinity reads local rows
+            firstTouch(similarityMatrix, *pool_);
+
+            // For a symmetric metric only blocks on or above the diagonal are computed, each is mirrored into the lower triangle
+            auto kernel = prepare();
+            size_t block = Similarity::blockRows(points_.cols());
+            std::vector<std::pair<size_t, size_t>> blocks;
+            for (size_t row_begin = 0; row_begin < height; row_begin += block)
+            {
+                for (size_t col_begin = symmetric ? row_begin : 0; col_begin < width; col_begin += block)
+                {
+                    blocks.emplace_back(row_begin, col_begin);
+                }
             }
 
-            thread_pool_.wait();
+            BasicMatrixView<T> similarities = similarityMatrix.view();
+            pool_->parallel_for(0, blocks.size(), 1,
+                [&](size_t begin, size_t end)
+                {
+                    for (size_t b = begin; b < end; ++b)
+                    {
+                        auto [row_begin, col_begin] = blocks[b];
+                        size_t rows = std::min(block, height - row_begin);
+                        size_t cols = std::min(block, width - col_begin);
+                        kernel(similarities.block(row_begin, col_begin, rows, cols), row_begin, col_begin);
+                        if (symmetric)
+                            Similarity::mirror(similarities, row_begin, rows, col_begin, cols);
+                    }
+                });
 
-            double median = Math::median(similarityMatrix);
-            double min = Math::min(similarityMatrix);
-            double max = Math::max(similarityMatrix);
-            double inf = std::numeric_limits<double>::infinity();
-            double negInf = -std::numeric_limits<double>::infinity();
+            // A cache entry keeps every statistic for loads with another policy, otherwise only the one the policy reads is computed
+            bool storing = false;
+            if constexpr (cacheable)
+                storing = cache_ && metric;
+            double min = 0.0, max = 0.0, median = 0.0;
+            if (storing || diagonal == Min || diagonal == Max)
+            {
+                Math::Summary summary = Math::summarize(similarities, *pool_);
+                min = summary.min;
+                max = summary.max;
+            }
+            if (storing || diagonal == Median)
+                median = Math::median(similarities, *pool_);
+            double at_percentile = diagonal == Percentile ? Math::quantile(similarities, percentile / 100.0, *pool_) : 0.0;
+            double preference = diagonalValue(diagonal, min, max, median, at_percentile);
 
             for (size_t i = 0; i < height; ++i)
             {
-                thread_pool_.queue_job(
-                    [&, i]()
+                similarityMatrix(i, i) = static_cast<T>(preference);
+            }
+
+            stopPool();
+
+            if constexpr (cacheable)
+            {
+                if (storing)
+                {
+                    Binary::Header header = Binary::makeHeader(Binary::Kind::Similarity, similarityMatrix);
+                    header.metric = *metric;
+                    header.diagonal = diagonal;
+                    header.stat_min = min;
+                    header.stat_max = max;
+                    header.stat_median = median;
+                    cache_->store(Binary::Kind::Similarity, key, header, similarityMatrix);
+                }
+            }
+
+            instrumentation_.count(Counter::SimilarityEntries, width * height);
+            instrumentation_.log(Verbosity::Summary, "Computed similarity matrix in ", timer.elapsed(), " milliseconds");
+
+            return similarityMatrix;
+        }
+
+        /// @brief Packed similarity matrix filled block by block by the kernel prepare() returns, see getPackedSimilarity()
+        template <typename T, typename Prepare>
+        inline BasicPackedSymmetricMatrix<T> computePackedSimilarity(Diagonal diagonal, double percentile, Prepare &&prepare)
+        {
+            constexpr size_t BLOCK = BasicPackedSymmetricMatrix<T>::BLOCK;
+            checkPercentile(percentile);
+            size_t n = points_.rows();
+
+            auto timer = instrumentation_.time(Phase::Similarity);
+
+            BasicPackedSymmetricMatrix<T> similarities = BasicPackedSymmetricMatrix<T>::uninitialized(n);
+            std::vector<std::pair<size_t, size_t>> blocks;
+            for (size_t rb = 0; rb < similarities.blocksPerSide(); ++rb)
+            {
+                for (size_t cb = rb; cb < similarities.blocksPerSide(); ++cb)
+                {
+                    blocks.emplace_back(rb, cb);
+                }
+            }
+
+            startPool();
+
+            // Each stored block is written once, a diagonal block is made exactly symmetric like the dense matrix
+            auto kernel = prepare();
+            pool_->parallel_for(0, blocks.size(), 1,
+                [&](size_t begin, size_t end)
+                {
+                    for (size_t b = begin; b < end; ++b)
                     {
-                        for (size_t j = 0; j < width; ++j)
+                        auto [rb, cb] = blocks[b];
+                        BasicMatrixView<T> block = similarities.block(rb, cb);
+                        kernel(block, rb * BLOCK, cb * BLOCK);
+                        if (rb == cb)
+                            Similarity::mirror(block, 0, block.rows(), 0, block.cols());
+                    }
+                });
+
+            double preference = Math::preference(similarities, diagonal, percentile, *pool_);
+            std::fill(similarities.diagonal().begin(), similarities.diagonal().end(), static_cast<T>(preference));
+
+            stopPool();
+
+            instrumentation_.count(Counter::SimilarityEntries, n * (n + 1) / 2);
+            instrumentation_.log(Verbosity::Summary, "Computed packed similarity matrix in ", timer.elapsed(), " milliseconds");
+
+            return similarities;
+        }
+
+        static inline bool needsStatistics(Diagonal diagonal)
+        {
+            return diagonal == Min || diagonal == Max || diagonal == Median || diagonal == Percentile;
+        }
+
+        /// @brief Preference from one parallel pass over all rows of a provider, see getPointSimilarities()
+        inline double streamedPreference(const SimilarityProvider &similarities, Diagonal diagonal, double percentile)
+        {
+            size_t n = similarities.size();
+            SampledStatistics statistics(n);
+            size_t tile_rows = similarities.tileRows();
+
+            startPool();
+            pool_->parallel_for(0, n, tile_rows,
+                [&](size_t begin, size_t end)
+                {
+                    Matrix scratch;
+                    for (size_t tile_begin = begin; tile_begin < end; tile_begin += tile_rows)
+                    {
+                        size_t tile_end = std::min(end, tile_begin + tile_rows);
+                        BasicMatrixView<const double> tile = similarities.rows(tile_begin, tile_end, scratch);
+                        for (size_t i = tile_begin; i < tile_end; ++i)
                         {
-                            if (i == j)
-                            {
-                                switch (diagonal)
-                                {
-                                case Min:
-                                    similarityMatrix[i][j] = min;
-                                    break;
-                                case Max:
-                                    similarityMatrix[i][j] = max;
-                                    break;
-                                case Median:
-                                    similarityMatrix[i][j] = median;
-                                    break;
-                                case Inf:
-                                    similarityMatrix[i][j] = inf;
-                                    break;
-                                case NegInf:
-                                    similarityMatrix[i][j] = negInf;
-                                    break;
-                                case Zero:
-                                    similarityMatrix[i][j] = 0.0;
-                                    break;
-                                default:
-                                    break;
-                                }
-                            }
+                            statistics.addRow(i, tile.row(i - tile_begin));
                         }
-                    });
+                    }
+                });
+            stopPool();
+            instrumentation_.count(Counter::SimilarityEntries, n * n);
+
+            double median = diagonal == Median ? sampleQuantile(statistics.samples, 0.5) : 0.0;
+            double at_percentile = diagonal == Percentile ? sampleQuantile(statistics.samples, percentile / 100.0) : 0.0;
+            return diagonalValue(diagonal, statistics.min(), statistics.max(), median, at_percentile);
+        }
+
+        /// @brief Exact minimum and maximum and a deterministic sample of about a million of the off-diagonal similarities,
+        ///        gathered one row at a time. Rows may be added from several threads, each row once
+        struct SampledStatistics
+        {
+            explicit SampledStatistics(size_t n)
+                : n(n), samples_per_row(n > 1 ? std::clamp<size_t>(SAMPLE_SIZE / n, 1, n - 1) : 0),
+                  sample_step(samples_per_row > 0 ? std::max<size_t>(1, (n - 1) / samples_per_row) : 1),
+                  row_min(n, std::numeric_limits<double>::infinity()), row_max(n, -std::numeric_limits<double>::infinity()),
+                  samples(n * samples_per_row)
+            {
             }
 
-            thread_pool_.wait();
-            thread_pool_.stop();
+            inline void addRow(size_t i, std::span<const double> row)
+            {
+                for (size_t j = 0; j < n; ++j)
+                {
+                    if (i != j)
+                    {
+                        row_min[i] = std::min(row_min[i], row[j]);
+                        row_max[i] = std::max(row_max[i], row[j]);
+                    }
+                }
+                for (size_t t = 0; t < samples_per_row; ++t)
+                {
+                    samples[i * samples_per_row + t] = row[(i + 1 + t * sample_step) % n];
+                }
+            }
 
-            auto end = std::chrono::high_resolution_clock::now();
-            auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
-            std::cout << "Computed similarity matrix in " << duration.count() << " millisecond" << std::endl;
+            inline double min() const
+            {
+                return n > 1 ? *std::min_element(row_min.begin(), row_min.end()) : 0.0;
+            }
 
-            return similarityMatrix;
-        }
+            inline double max() const
+            {
+                return n > 1 ? *std::max_element(row_max.begin(), row_max.end()) : 0.0;
+            }
 
-    private:
-        inline double negSquaredEuclideanDistance(const std::vector<double> &point1, const std::vector<double> &point2)
+            static constexpr size_t SAMPLE_SIZE = 1 << 20;
+            size_t n;
+            size_t samples_per_row;
+            size_t sample_step;
+            std::vector<double> row_min;
+            std::vector<double> row_max;
+            std::vector<double> samples;
+        };
+
+        /// @brief Exact minimum and maximum and a deterministic sample of about a million of the similarities above the diagonal,
+        ///        gathered one block at a time in any order. Every block has its own slot, so blocks may be added from several threads
+        struct BlockStatistics
         {
-            if (point1.size() != point2.size())
+            BlockStatistics(size_t n, size_t slots)
+                : pairs(n > 1 ? n * (n - 1) / 2 : 0), sample_step(std::max<size_t>(1, pairs / SampledStatistics::SAMPLE_SIZE)),
+                  block_min(slots, std::numeric_limits<double>::infinity()), block_max(slots, -std::numeric_limits<double>::infinity()),
+                  block_samples(slots)
+            {
+            }
+
+            /// @param diagonal the block lies on the diagonal, only its entries above the diagonal count
+            template <typename T>
+            inline void addBlock(size_t slot, BasicMatrixView<const T> block, bool diagonal)
+            {
+                size_t position = 0;
+                for (size_t a = 0; a < block.rows(); ++a)
+                {
+                    for (size_t b = diagonal ? a + 1 : 0; b < block.cols(); ++b, ++position)
+                    {
+                        double value = block(a, b);
+                        block_min[slot] = std::min(block_min[slot], value);
+                        block_max[slot] = std::max(block_max[slot], value);
+                        if (position % sample_step == 0)
+                            block_samples[slot].push_back(value);
+                    }
+                }
+            }
+
+            inline double min() const
+            {
+                return pairs > 0 ? *std::min_element(block_min.begin(), block_min.end()) : 0.0;
+            }
+
+            inline double max() const
+            {
+                return pairs > 0 ? *std::max_element(block_max.begin(), block_max.end()) : 0.0;
+            }
+
+            /// @brief Samples of all blocks in slot order
+            inline std::vector<double> samples() const
             {
-                throw std::invalid_argument("Point dimensions do not match");
+                std::vector<double> result;
+                for (const std::vector<double> &slot : block_samples)
+                    result.insert(result.end(), slot.begin(), slot.end());
+                return result;
             }
 
-            double distance = 0.0;
-            for (size_t i = 0; i < point1.size(); ++i)
+            size_t pairs;
+            size_t sample_step;
+            std::vector<double> block_min;
+            std::vector<double> block_max;
+            std::vector<std::vector<double>> block_samples;
+        };
+
+        /// @brief Start the pool of the parser, a shared pool is already running, see setThreadPool()
+        inline void startPool()
+        {
+            if (pool_ == &thread_pool_)
+                thread_pool_.start();
+        }
+
+        /// @brief Stop the pool of the parser and add what it did to the instrumentation, a shared pool is left running
+        inline void stopPool()
+        {
+            if (pool_ != &thread_pool_)
+                return;
+            thread_pool_.stop();
+            instrumentation_.threadPool(thread_pool_.stats());
+        }
+
+        inline void checkPercentile(double percentile) const
+        {
+            if (!(percentile >= 0.0 && percentile <= 100.0))
             {
-                double diff = point1[i] - point2[i];
-                distance -= diff * diff;
+                throw std::invalid_argument("Percentile has to be in range [0, 100]");
             }
+        }
 
-            return distance;
+        /// @brief q-quantile of values that are already a copy, reorders them
+        inline double sampleQuantile(std::vector<double> &values, double q) const
+        {
+            if (values.empty())
+                return 0.0;
+            auto nth = values.begin() + Math::quantileRank(values.size(), q);
+            std::nth_element(values.begin(), nth, values.end());
+            return *nth;
+        }
+
+        /// @brief Value placed on the diagonal for the given preference policy
+        inline double diagonalValue(Diagonal diagonal, double min, double max, double median, double at_percentile) const
+        {
+            switch (diagonal)
+            {
+            case Min:
+                return min;
+            case Max:
+                return max;
+            case Median:
+                return median;
+            case Percentile:
+                return at_percentile;
+            case Inf:
+                return std::numeric_limits<double>::infinity();
+            case NegInf:
+                return -std::numeric_limits<double>::infinity();
+            case Zero:
+            default:
+                return 0.0;
+            }
         }
 
         Matrix points_;
+        std::optional<MatrixCache> cache_;
         Threading::ThreadPool thread_pool_{};
+        /// @brief Pool every stage runs on, thread_pool_ unless a shared one was set
+        Threading::ThreadPool *pool_ = &thread_pool_;
+        const Simd::Kernels &simd_ = Simd::best();
+        Instrumentation instrumentation_;
     };
 }
\ No newline at end of file
@@ -0,0 +1,116 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <optional>
+#include <stdexcept>
+#include "matrix.h"
+#include "threadpool.h"
+#include "parser.h"
+#include "affinity_propagation.h"
+
+namespace AP
+{
+    /// @brief Front end that parses a file, computes its similarity matrix and prepares a fit over it on one pool shared by every stage.
+    ///        Parsed chunks feed the similarity blocks right away, the preference statistics are gathered as blocks complete and
+    ///        the message matrices of the fit are allocated and placed by first touch meanwhile, see Parser::streamTXT().
+    ///        The pool is started by the first load and runs until the pipeline is destroyed, so no stage starts or stops threads
+    class Pipeline
+    {
+    public:
+        /// @param max_iter upper bound on the number of message passing iterations
+        /// @param damping weight of the previous message when blending with the new one, in [0, 1)
+        /// @param convergence_iter number of iterations the exemplar set has to stay unchanged to stop early, 0 disables early termination
+        Pipeline(unsigned int max_iter = 200, double damping = 0.5, unsigned int convergence_iter = 15)
+            : max_iter_(max_iter), damping_(damping), convergence_iter_(convergence_iter)
+        {
+            // The fit is constructed on a worker, so its arguments are checked here where an exception reaches the caller
+            if (damping < 0.0 || damping >= 1.0)
+            {
+                throw std::invalid_argument("Damping has to be in range [0, 1)");
+            }
+        }
+
+        /// @brief Workers of the shared pool, has to be set before the first load. Defaults to ThreadPool::defaultThreadCount()
+        inline void setThreadCount(uint32_t count)
+        {
+            thread_count_ = count;
+        }
+
+        /// @brief Parse whitespace separated values, one point per line, and prepare a fit over their similarities
+        /// @param diagonal preference policy for the diagonal
+        /// @param percentile percentile in [0, 100] used by the Percentile policy
+        inline void loadTXT(const std::string &filename, Diagonal diagonal = Median, double percentile = 50.0)
+        {
+            start();
+            fit_.reset();
+            parser_.streamTXT(filename, similarities_, [this]()
+                              { prepareFit(); }, diagonal, percentile);
+        }
+
+        /// @brief loadTXT() for comma separated values with a header line
+        inline void loadCSV(const std::string &filename, Diagonal diagonal = Median, double percentile = 50.0)
+        {
+            start();
+            fit_.reset();
+            parser_.streamCSV(filename, similarities_, [this]()
+                              { prepareFit(); }, diagonal, percentile);
+        }
+
+        /// @brief Fit over the similarities of the last load on the shared pool
+        inline void fit()
+        {
+            affinityPropagation().fit();
+        }
+
+        /// @brief Fit over the similarities of the last load, its messages are already allocated
+        inline AffinityPropagation &affinityPropagation()
+        {
+            if (!fit_)
+            {
+                throw std::logic_error("Nothing was loaded");
+            }
+            return *fit_;
+        }
+
+        inline const Matrix &getSimilarity() const
+        {
+            return similarities_;
+        }
+
+        /// @brief Parser of the pipeline, also where its verbosity is configured
+        inline Parser &getParser()
+        {
+            return parser_;
+        }
+
+    private:
+        inline void start()
+        {
+            if (pool_.size() > 0)
+                return;
+            if (thread_count_)
+                pool_.start(*thread_count_);
+            else
+                pool_.start();
+            parser_.setThreadPool(pool_);
+        }
+
+        /// @brief Runs on the pool as soon as the similarity matrix has its size, while its blocks are computed
+        inline void prepareFit()
+        {
+            fit_ = std::make_unique<AffinityPropagation>(similarities_, max_iter_, damping_, convergence_iter_);
+            fit_->setThreadPool(pool_);
+            fit_->prepare();
+        }
+
+        // Declared first so the pool outlives the parser and the fit that run on it
+        Threading::ThreadPool pool_{};
+        std::optional<uint32_t> thread_count_;
+        Parser parser_;
+        Matrix similarities_;
+        std::unique_ptr<AffinityPropagation> fit_;
+        unsigned int max_iter_;
+        double damping_;
+        unsigned int convergence_iter_;
+    };
+}
@@ -0,0 +1,191 @@
+#pragma once
+#include <vector>
+#include <limits>
+#include <numeric>
+#include <algorithm>
+#include <stdexcept>
+#include "matrix.h"
+#include "threadpool.h"
+#include "statistics.h"
+#include "affinity_propagation.h"
+
+namespace AP
+{
+    /// @brief Outcome of one fit of a sweep
+    struct SweepResult
+    {
+        /// @brief The scalar preference, or the mean of the per-point ones
+        double preference = 0.0;
+        std::vector<int> labels;
+        size_t exemplars = 0;
+        /// @brief Sum of s(i, label(i)) over all points, with each exemplar contributing its preference
+        double net_similarity = 0.0;
+        unsigned int iterations = 0;
+        bool converged = false;
+    };
+
+    /// @brief Runs affinity propagation once per preference over a single similarity matrix,
+    ///        whose diagonal is ignored, to pick a cluster count without rebuilding the matrix for every run
+    class PreferenceSweep
+    {
+    public:
+        enum class Mode
+        {
+            /// Independent fits from zero messages, several at once when there are enough of them to keep every worker busy
+            Concurrent,
+            /// One fit after another in ascending order of preference, each starting from the messages of the previous one.
+            /// Needs far fewer iterations, but a fit may settle on a fixed point near the previous one rather than the one a cold start finds
+            WarmStart
+        };
+
+        /// @param similarities n x n similarity matrix, shared by every fit, its diagonal is never read
+        /// @param max_iter upper bound on the number of message passing iterations of each fit
+        /// @param damping weight of the previous message when blending with the new one, in [0, 1)
+        /// @param convergence_iter number of iterations the exemplar set has to stay unchanged to stop a fit early
+        PreferenceSweep(const Matrix &similarities, unsigned int max_iter = 200, double damping = 0.5, unsigned int convergence_iter = 15)
+            : similarities_(similarities), max_iter_(max_iter), damping_(damping), convergence_iter_(convergence_iter)
+        {
+            if (damping < 0.0 || damping >= 1.0)
+            {
+                throw std::invalid_argument("Damping has to be in range [0, 1)");
+            }
+        }
+
+        /// @brief Preference a diagonal policy gives for this matrix, from its off-diagonal entries like Parser::getSimilarity
+        /// @param percentile percentile in [0, 100] used by the Percentile policy
+        inline double preference(Diagonal diagonal, double percentile = 50.0)
+        {
+            if (!(percentile >= 0.0 && percentile <= 100.0))
+            {
+                throw std::invalid_argument("Percentile has to be in range [0, 100]");
+            }
+
+            MatrixView view(const_cast<double *>(similarities_.data()), similarities_.rows(), similarities_.cols(), similarities_.stride());
+            thread_pool_.start();
+            double value = Math::preference(view, diagonal, percentile, thread_pool_);
+            thread_pool_.stop();
+            return value;
+        }
+
+        /// @brief One fit per scalar preference, shared by every point
+        /// @return one result per preference, in the given order
+        inline std::vector<SweepResult> run(const std::vector<double> &preferences, Mode mode = Mode::WarmStart)
+        {
+            std::vector<std::vector<double>> expanded;
+            expanded.reserve(preferences.size());
+            for (double preference : preferences)
+            {
+                expanded.emplace_back(similarities_.rows(), preference);
+            }
+            return run(expanded, mode);
+        }
+
+        /// @brief One fit per vector of per-point preferences
+        /// @return one result per vector, in the given order
+        inline std::vector<SweepResult> run(const std::vector<std::vector<double>> &preferences, Mode mode = Mode::WarmStart)
+        {
+            size_t n = similarities_.rows();
+            for (const std::vector<double> &p : preferences)
+            {
+                if (p.size() != n)
+                {
+                    throw std::invalid_argument("Expected " + std::to_string(n) + " preferences, got " + std::to_string(p.size()));
+                }
+            }
+
+            std::vector<SweepResult> results(preferences.size());
+            std::vector<size_t> order(preferences.size());
+            std::iota(order.begin(), order.end(), 0);
+
+            if (mode == Mode::WarmStart)
+            {
+                // Neighbouring preferences give neighbouring fixed points, so each fit starts close to its own
+                std::vector<double> means(preferences.size());
+                for (size_t p = 0; p < preferences.size(); ++p)
+                {
+                    means[p] = mean(preferences[p]);
+                }
+                std::stable_sort(order.begin(), order.end(), [&](size_t x, size_t y)
+                                 { return means[x] < means[y]; });
+
+                AffinityPropagation ap(similarities_, max_iter_, damping_, convergence_iter_);
+                ap.setWarmStart(true);
+                for (size_t p : order)
+                {
+                    ap.setPreferences(preferences[p]);
+                    ap.fit();
+                    results[p] = result(ap, preferences[p]);
+                }
+                return results;
+            }
+
+            thread_pool_.start();
+            if (preferences.size() >= thread_pool_.size())
+            {
+                // Enough fits to give every worker its own, each runs on a single thread with its own messages
+                thread_pool_.parallel_for(0, preferences.size(), 1,
+                    [&](size_t begin, size_t end)
+                    {
+                        for (size_t p = begin; p < end; ++p)
+                        {
+                            AffinityPropagation ap(similarities_, max_iter_, damping_, convergence_iter_);
+                            ap.setThreadCount(0);
+                            ap.setPreferences(preferences[p]);
+                            ap.fit();
+                            results[p] = result(ap, preferences[p]);
+                        }
+                    });
+                thread_pool_.stop();
+            }
+            else
+            {
+                thread_pool_.stop();
+                for (size_t p : order)
+                {
+                    AffinityPropagation ap(similarities_, max_iter_, damping_, convergence_iter_);
+                    ap.setPreferences(preferences[p]);
+                    ap.fit();
+                    results[p] = result(ap, preferences[p]);
+                }
+            }
+            return results;
+        }
+
+        /// @brief Sum of s(i, label(i)) over all points, the preference stands in for s(i, i)
+        inline double netSimilarity(const std::vector<int> &labels, const std::vector<double> &preferences) const
+        {
+            double sum = 0.0;
+            for (size_t i = 0; i < labels.size(); ++i)
+            {
+                size_t k = static_cast<size_t>(labels[i]);
+                sum += k == i ? preferences[i] : similarities_(i, k);
+            }
+            return sum;
+        }
+
+    private:
+        inline SweepResult result(AffinityPropagation &ap, const std::vector<double> &preferences) const
+        {
+            SweepResult result;
+            result.preference = mean(preferences);
+            result.labels = ap.getLabels();
+            result.exemplars = ap.getUniqueClusters().size();
+            result.net_similarity = netSimilarity(result.labels, preferences);
+            result.iterations = ap.getIterations();
+            result.converged = ap.hasConverged();
+            return result;
+        }
+
+        static inline double mean(const std::vector<double> &values)
+        {
+            return values.empty() ? 0.0 : std::accumulate(values.begin(), values.end(), 0.0) / values.size();
+        }
+
+    private:
+        Threading::ThreadPool thread_pool_{};
+        const Matrix &similarities_;
+        unsigned int max_iter_;
+        double damping_;
+        unsigned int convergence_iter_;
+    };
+}
@@ -0,0 +1,1156 @@
+#pragma once
+#include <cstddef>
+#include <algorithm>
+#include <limits>
+#include <vector>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define AP_SIMD_X86 1
+#else
+#define AP_SIMD_X86 0
+#endif
+
+// Contracting a * b + c into an FMA would make results depend on the variant picked at runtime,
+// so contraction is disabled and every variant produces bit-identical messages.
+// GCC 12 also reports false uninitialized warnings from inside its own AVX-512 headers
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+namespace AP
+{
+    /// Vectorized versions of the hot inner loops.
+    /// Every variant is compiled into the binary through per-function target attributes
+    /// and the best one the CPU supports is picked once at startup, see Simd::best()
+    namespace Simd
+    {
+        enum class Isa
+        {
+            Scalar,
+            SSE2,
+            AVX2,
+            AVX512
+        };
+
+        /// @brief Message passing kernels over single precision storage, each computes what its double counterpart in Kernels does
+        struct FloatKernels
+        {
+            void (*rowTop2)(const float *a, const float *s, size_t n, float &first, float &second);
+            void (*responsibilityRow)(const float *s, const float *a, float *r, size_t n, float first, float second, float damping);
+            void (*accumulatePositive)(const float *r, float *sums, size_t n);
+            /// @brief sums[j] += max(0, r[j]) with the sums kept in double precision
+            void (*accumulatePositiveWide)(const float *r, double *sums, size_t n);
+            void (*availabilityRow)(const float *r, const float *diagonal, const float *sums, float *a, size_t n, float damping);
+            size_t (*argmaxSum)(const float *r, const float *a, size_t n);
+        };
+
+        /// @brief Table of kernel implementations for one instruction set
+        struct Kernels
+        {
+            Isa isa;
+            const char *name;
+
+            /// @brief -||x - y||^2 over d dimensions
+            double (*negSquaredEuclidean)(const double *x, const double *y, size_t d);
+
+            /// @brief x . y over d dimensions
+            double (*dot)(const double *x, const double *y, size_t d);
+
+            /// @brief out[i * out_stride + j] = x_i . y_j for the 4 rows x_i starting at x and the 4 rows y_j starting at y.
+            ///        Every loaded element is used four times, which makes blocked similarity construction compute bound
+            void (*dotTile)(const double *x, size_t x_stride, const double *y, size_t y_stride, size_t d, double *out, size_t out_stride);
+
+            /// @brief Largest and second largest value of a[k] + s[k]
+            void (*rowTop2)(const double *a, const double *s, size_t n, double &first, double &second);
+
+            /// @brief r[k] = damping * r[k] + (1 - damping) * (s[k] - max_{k' != k}(a[k'] + s[k'])),
+            ///        given the top-2 of the row from rowTop2
+            void (*responsibilityRow)(const double *s, const double *a, double *r, size_t n, double first, double second, double damping);
+
+            /// @brief sums[j] += max(0, r[j])
+            void (*accumulatePositive)(const double *r, double *sums, size_t n);
+
+            /// @brief a[j] = damping * a[j] + (1 - damping) * min(0, diagonal[j] + sums[j] - max(0, r[j]))
+            void (*availabilityRow)(const double *r, const double *diagonal, const double *sums, double *a, size_t n, double damping);
+
+            /// @brief Index of the first maximum of r[k] + a[k]
+            size_t (*argmaxSum)(const double *r, const double *a, size_t n);
+
+            FloatKernels single;
+        };
+
+        namespace Scalar
+        {
+            inline double negSquaredEuclidean(const double *x, const double *y, size_t d)
+            {
+                double distance = 0.0;
+                for (size_t i = 0; i < d; ++i)
+                {
+                    double diff = x[i] - y[i];
+                    distance -= diff * diff;
+                }
+                return distance;
+            }
+
+            inline double dot(const double *x, const double *y, size_t d)
+            {
+                double sum = 0.0;
+                for (size_t i = 0; i < d; ++i)
+                {
+                    sum += x[i] * y[i];
+                }
+                return sum;
+            }
+
+            inline void dotTile(const double *x, size_t x_stride, const double *y, size_t y_stride, size_t d, double *out, size_t out_stride)
+            {
+                double acc[4][4] = {};
+                for (size_t k = 0; k < d; ++k)
+                {
+                    for (size_t i = 0; i < 4; ++i)
+                    {
+                        for (size_t j = 0; j < 4; ++j)
+                        {
+                            acc[i][j] += x[i * x_stride + k] * y[j * y_stride + k];
+                        }
+                    }
+                }
+                for (size_t i = 0; i < 4; ++i)
+                {
+                    for (size_t j = 0; j < 4; ++j)
+                    {
+                        out[i * out_stride + j] = acc[i][j];
+                    }
+                }
+            }
+
+            template <typename T>
+            inline void insertTop2(T val, T &first, T &second)
+            {
+                if (val > first)
+                {
+                    second = first;
+                    first = val;
+                }
+                else if (val > second)
+                {
+                    second = val;
+                }
+            }
+
+            // The message kernels are templates over the storage type, so the vector variants of every width
+            // can finish their tails with the same code for double and float
+
+            template <typename T>
+            inline void rowTop2(const T *a, const T *s, size_t n, T &first, T &second)
+            {
+                first = -std::numeric_limits<T>::infinity();
+                second = -std::numeric_limits<T>::infinity();
+                for (size_t k = 0; k < n; ++k)
+                {
+                    insertTop2<T>(a[k] + s[k], first, second);
+                }
+            }
+
+            // When the top value occurs twice first == second, so comparing against the value
+            // instead of tracking the argmax gives the same result as excluding exactly one index
+            template <typename T>
+            inline void responsibilityRow(const T *s, const T *a, T *r, size_t n, T first, T second, T damping)
+            {
+                for (size_t k = 0; k < n; ++k)
+                {
+                    T max_other = (a[k] + s[k] == first) ? second : first;
+                    r[k] = damping * r[k] + (T(1) - damping) * (s[k] - max_other);
+                }
+            }
+
+            template <typename T, typename Sum>
+            inline void accumulatePositive(const T *r, Sum *sums, size_t n)
+            {
+                for (size_t j = 0; j < n; ++j)
+                {
+                    sums[j] += std::max(Sum(0), static_cast<Sum>(r[j]));
+                }
+            }
+
+            template <typename T>
+            inline void availabilityRow(const T *r, const T *diagonal, const T *sums, T *a, size_t n, T damping)
+            {
+                for (size_t j = 0; j < n; ++j)
+                {
+                    T value = std::min(T(0), diagonal[j] + sums[j] - std::max(T(0), r[j]));
+                    a[j] = damping * a[j] + (T(1) - damping) * value;
+                }
+            }
+
+            template <typename T>
+            inline size_t argmaxSum(const T *r, const T *a, size_t n)
+            {
+                T max_val = -std::numeric_limits<T>::infinity();
+                size_t index = 0;
+                for (size_t k = 0; k < n; ++k)
+                {
+                    T val = r[k] + a[k];
+                    if (val > max_val)
+                    {
+                        max_val = val;
+                        index = k;
+                    }
+                }
+                return index;
+            }
+        }
+
+#if AP_SIMD_X86
+        namespace SSE2
+        {
+            __attribute__((target("sse2"))) inline double negSquaredEuclidean(const double *x, const double *y, size_t d)
+            {
+                __m128d acc = _mm_setzero_pd();
+                size_t i = 0;
+                for (; i + 2 <= d; i += 2)
+                {
+                    __m128d diff = _mm_sub_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i));
+                    acc = _mm_add_pd(acc, _mm_mul_pd(diff, diff));
+                }
+                double lanes[2];
+                _mm_storeu_pd(lanes, acc);
+                double distance = -(lanes[0] + lanes[1]);
+                return distance + Scalar::negSquaredEuclidean(x + i, y + i, d - i);
+            }
+
+            __attribute__((target("sse2"))) inline double dot(const double *x, const double *y, size_t d)
+            {
+                __m128d acc = _mm_setzero_pd();
+                size_t i = 0;
+                for (; i + 2 <= d; i += 2)
+                {
+                    acc = _mm_add_pd(acc, _mm_mul_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i)));
+                }
+                double lanes[2];
+                _mm_storeu_pd(lanes, acc);
+                return (lanes[0] + lanes[1]) + Scalar::dot(x + i, y + i, d - i);
+            }
+
+            // 4 x 2 sub-tiles keep the accumulators and operands within the 16 xmm registers
+            __attribute__((target("sse2"))) inline void dotTile(const double *x, size_t x_stride, const double *y, size_t y_stride, size_t d, double *out, size_t out_stride)
+            {
+                for (size_t j = 0; j < 4; j += 2)
+                {
+                    __m128d acc[4][2];
+                    for (size_t i = 0; i < 4; ++i)
+                    {
+                        acc[i][0] = _mm_setzero_pd();
+                        acc[i][1] = _mm_setzero_pd();
+                    }
+                    const double *y0 = y + j * y_stride;
+                    const double *y1 = y0 + y_stride;
+                    size_t k = 0;
+                    for (; k + 2 <= d; k += 2)
+                    {
+                        __m128d b0 = _mm_loadu_pd(y0 + k);
+                        __m128d b1 = _mm_loadu_pd(y1 + k);
+                        for (size_t i = 0; i < 4; ++i)
+                        {
+                            __m128d a = _mm_loadu_pd(x + i * x_stride + k);
+                            acc[i][0] = _mm_add_pd(acc[i][0], _mm_mul_pd(a, b0));
+                            acc[i][1] = _mm_add_pd(acc[i][1], _mm_mul_pd(a, b1));
+                        }
+                    }
+                    for (size_t i = 0; i < 4; ++i)
+                    {
+                        const double *xi = x + i * x_stride;
+                        double lanes[2];
+                        _mm_storeu_pd(lanes, acc[i][0]);
+                        out[i * out_stride + j] = (lanes[0] + lanes[1]) + Scalar::dot(xi + k, y0 + k, d - k);
+                        _mm_storeu_pd(lanes, acc[i][1]);
+                        out[i * out_stride + j + 1] = (lanes[0] + lanes[1]) + Scalar::dot(xi + k, y1 + k, d - k);
+                    }
+                }
+            }
+
+            __attribute__((target("sse2"))) inline void rowTop2(const double *a, const double *s, size_t n, double &first, double &second)
+            {
+                __m128d m1 = _mm_set1_pd(-std::numeric_limits<double>::infinity());
+                __m128d m2 = m1;
+                size_t k = 0;
+                for (; k + 2 <= n; k += 2)
+                {
+                    __m128d v = _mm_add_pd(_mm_loadu_pd(a + k), _mm_loadu_pd(s + k));
+                    m2 = _mm_max_pd(m2, _mm_min_pd(m1, v));
+                    m1 = _mm_max_pd(m1, v);
+                }
+                double l1[2], l2[2];
+                _mm_storeu_pd(l1, m1);
+                _mm_storeu_pd(l2, m2);
+                first = -std::numeric_limits<double>::infinity();
+                second = -std::numeric_limits<double>::infinity();
+                for (int l = 0; l < 2; ++l)
+                {
+                    Scalar::insertTop2(l1[l], first, second);
+                    Scalar::insertTop2(l2[l], first, second);
+                }
+                for (; k < n; ++k)
+                {
+                    Scalar::insertTop2(a[k] + s[k], first, second);
+                }
+            }
+
+            __attribute__((target("sse2"))) inline void responsibilityRow(const double *s, const double *a, double *r, size_t n, double first, double second, double damping)
+            {
+                __m128d vfirst = _mm_set1_pd(first);
+                __m128d vsecond = _mm_set1_pd(second);
+                __m128d vdamping = _mm_set1_pd(damping);
+                __m128d vkeep = _mm_set1_pd(1.0 - damping);
+                size_t k = 0;
+                for (; k + 2 <= n; k += 2)
+                {
+                    __m128d vs = _mm_loadu_pd(s + k);
+                    __m128d eq = _mm_cmpeq_pd(_mm_add_pd(_mm_loadu_pd(a + k), vs), vfirst);
+                    __m128d other = _mm_or_pd(_mm_and_pd(eq, vsecond), _mm_andnot_pd(eq, vfirst));
+                    __m128d updated = _mm_add_pd(_mm_mul_pd(vdamping, _mm_loadu_pd(r + k)), _mm_mul_pd(vkeep, _mm_sub_pd(vs, other)));
+                    _mm_storeu_pd(r + k, updated);
+                }
+                Scalar::responsibilityRow(s + k, a + k, r + k, n - k, first, second, damping);
+            }
+
+            __attribute__((target("sse2"))) inline void accumulatePositive(const double *r, double *sums, size_t n)
+            {
+                __m128d zero = _mm_setzero_pd();
+                size_t j = 0;
+                for (; j + 2 <= n; j += 2)
+                {
+                    _mm_storeu_pd(sums + j, _mm_add_pd(_mm_loadu_pd(sums + j), _mm_max_pd(zero, _mm_loadu_pd(r + j))));
+                }
+                Scalar::accumulatePositive(r + j, sums + j, n - j);
+            }
+
+            __attribute__((target("sse2"))) inline void availabilityRow(const double *r, const double *diagonal, const double *sums, double *a, size_t n, double damping)
+            {
+                __m128d zero = _mm_setzero_pd();
+                __m128d vdamping = _mm_set1_pd(damping);
+                __m128d vkeep = _mm_set1_pd(1.0 - damping);
+                size_t j = 0;
+                for (; j + 2 <= n; j += 2)
+                {
+                    __m128d total = _mm_add_pd(_mm_loadu_pd(diagonal + j), _mm_loadu_pd(sums + j));
+                    __m128d value = _mm_min_pd(zero, _mm_sub_pd(total, _mm_max_pd(zero, _mm_loadu_pd(r + j))));
+                    _mm_storeu_pd(a + j, _mm_add_pd(_mm_mul_pd(vdamping, _mm_loadu_pd(a + j)), _mm_mul_pd(vkeep, value)));
+                }
+                Scalar::availabilityRow(r + j, diagonal + j, sums + j, a + j, n - j, damping);
+            }
+
+            __attribute__((target("sse2"))) inline size_t argmaxSum(const double *r, const double *a, size_t n)
+            {
+                __m128d m = _mm_set1_pd(-std::numeric_limits<double>::infinity());
+                size_t k = 0;
+                for (; k + 2 <= n; k += 2)
+                {
+                    m = _mm_max_pd(m, _mm_add_pd(_mm_loadu_pd(r + k), _mm_loadu_pd(a + k)));
+                }
+                double lanes[2];
+                _mm_storeu_pd(lanes, m);
+                double max_val = std::max(lanes[0], lanes[1]);
+                for (; k < n; ++k)
+                {
+                    max_val = std::max(max_val, r[k] + a[k]);
+                }
+
+                __m128d target = _mm_set1_pd(max_val);
+                for (k = 0; k + 2 <= n; k += 2)
+                {
+                    int mask = _mm_movemask_pd(_mm_cmpeq_pd(_mm_add_pd(_mm_loadu_pd(r + k), _mm_loadu_pd(a + k)), target));
+                    if (mask)
+                        return k + __builtin_ctz(mask);
+                }
+                for (; k < n; ++k)
+                {
+                    if (r[k] + a[k] == max_val)
+                        return k;
+                }
+                return 0;
+            }
+
+            // Single precision message kernels, four lanes
+
+            __attribute__((target("sse2"))) inline void rowTop2(const float *a, const float *s, size_t n, float &first, float &second)
+            {
+                __m128 m1 = _mm_set1_ps(-std::numeric_limits<float>::infinity());
+                __m128 m2 = m1;
+                size_t k = 0;
+                for (; k + 4 <= n; k += 4)
+                {
+                    __m128 v = _mm_add_ps(_mm_loadu_ps(a + k), _mm_loadu_ps(s + k));
+                    m2 = _mm_max_ps(m2, _mm_min_ps(m1, v));
+                    m1 = _mm_max_ps(m1, v);
+                }
+                float l1[4], l2[4];
+                _mm_storeu_ps(l1, m1);
+                _mm_storeu_ps(l2, m2);
+                first = -std::numeric_limits<float>::infinity();
+                second = -std::numeric_limits<float>::infinity();
+                for (int l = 0; l < 4; ++l)
+                {
+                    Scalar::insertTop2(l1[l], first, second);
+                    Scalar::insertTop2(l2[l], first, second);
+                }
+                for (; k < n; ++k)
+                {
+                    Scalar::insertTop2(a[k] + s[k], first, second);
+                }
+            }
+
+            __attribute__((target("sse2"))) inline void responsibilityRow(const float *s, const float *a, float *r, size_t n, float first, float second, float damping)
+            {
+                __m128 vfirst = _mm_set1_ps(first);
+                __m128 vsecond = _mm_set1_ps(second);
+                __m128 vdamping = _mm_set1_ps(damping);
+                __m128 vkeep = _mm_set1_ps(1.0f - damping);
+                size_t k = 0;
+                for (; k + 4 <= n; k += 4)
+                {
+                    __m128 vs = _mm_loadu_ps(s + k);
+                    __m128 eq = _mm_cmpeq_ps(_mm_add_ps(_mm_loadu_ps(a + k), vs), vfirst);
+                    __m128 other = _mm_or_ps(_mm_and_ps(eq, vsecond), _mm_andnot_ps(eq, vfirst));
+                    __m128 updated = _mm_add_ps(_mm_mul_ps(vdamping, _mm_loadu_ps(r + k)), _mm_mul_ps(vkeep, _mm_sub_ps(vs, other)));
+                    _mm_storeu_ps(r + k, updated);
+                }
+                Scalar::responsibilityRow(s + k, a + k, r + k, n - k, first, second, damping);
+            }
+
+            __attribute__((target("sse2"))) inline void accumulatePositive(const float *r, float *sums, size_t n)
+            {
+                __m128 zero = _mm_setzero_ps();
+                size_t j = 0;
+                for (; j + 4 <= n; j += 4)
+                {
+                    _mm_storeu_ps(sums + j, _mm_add_ps(_mm_loadu_ps(sums + j), _mm_max_ps(zero, _mm_loadu_ps(r + j))));
+                }
+                Scalar::accumulatePositive(r + j, sums + j, n - j);
+            }
+
+            __attribute__((target("sse2"))) inline void accumulatePositive(const float *r, double *sums, size_t n)
+            {
+                __m128 zero = _mm_setzero_ps();
+                size_t j = 0;
+                for (; j + 4 <= n; j += 4)
+                {
+                    __m128 positive = _mm_max_ps(zero, _mm_loadu_ps(r + j));
+                    _mm_storeu_pd(sums + j, _mm_add_pd(_mm_loadu_pd(sums + j), _mm_cvtps_pd(positive)));
+                    _mm_storeu_pd(sums + j + 2, _mm_add_pd(_mm_loadu_pd(sums + j + 2), _mm_cvtps_pd(_mm_movehl_ps(positive, positive))));
+                }
+                Scalar::accumulatePositive(r + j, sums + j, n - j);
+            }
+
+            __attribute__((target("sse2"))) inline void availabilityRow(const float *r, const float *diagonal, const float *sums, float *a, size_t n, float damping)
+            {
+                __m128 zero = _mm_setzero_ps();
+                __m128 vdamping = _mm_set1_ps(damping);
+                __m128 vkeep = _mm_set1_ps(1.0f - damping);
+                size_t j = 0;
+                for (; j + 4 <= n; j += 4)
+                {
+                    __m128 total = _mm_add_ps(_mm_loadu_ps(diagonal + j), _mm_loadu_ps(sums + j));
+                    __m128 value = _mm_min_ps(zero, _mm_sub_ps(total, _mm_max_ps(zero, _mm_loadu_ps(r + j))));
+                    _mm_storeu_ps(a + j, _mm_add_ps(_mm_mul_ps(vdamping, _mm_loadu_ps(a + j)), _mm_mul_ps(vkeep, value)));
+                }
+                Scalar::availabilityRow(r + j, diagonal + j, sums + j, a + j, n - j, damping);
+            }
+
+            __attribute__((target("sse2"))) inline size_t argmaxSum(const float *r, const float *a, size_t n)
+            {
+                __m128 m = _mm_set1_ps(-std::numeric_limits<float>::infinity());
+                size_t k = 0;
+                for (; k + 4 <= n; k += 4)
+                {
+                    m = _mm_max_ps(m, _mm_add_ps(_mm_loadu_ps(r + k), _mm_loadu_ps(a + k)));
+                }
+                float lanes[4];
+                _mm_storeu_ps(lanes, m);
+                float max_val = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+                for (; k < n; ++k)
+                {
+                    max_val = std::max(max_val, r[k] + a[k]);
+                }
+
+                __m128 target = _mm_set1_ps(max_val);
+                for (k = 0; k + 4 <= n; k += 4)
+                {
+                    int mask = _mm_movemask_ps(_mm_cmpeq_ps(_mm_add_ps(_mm_loadu_ps(r + k), _mm_loadu_ps(a + k)), target));
+                    if (mask)
+                        return k + __builtin_ctz(mask);
+                }
+                for (; k < n; ++k)
+                {
+                    if (r[k] + a[k] == max_val)
+                        return k;
+                }
+                return 0;
+            }
+        }
+
+        namespace AVX2
+        {
+            __attribute__((target("avx2"))) inline double negSquaredEuclidean(const double *x, const double *y, size_t d)
+            {
+                __m256d acc = _mm256_setzero_pd();
+                size_t i = 0;
+                for (; i + 4 <= d; i += 4)
+                {
+                    __m256d diff = _mm256_sub_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i));
+                    acc = _mm256_add_pd(acc, _mm256_mul_pd(diff, diff));
+                }
+                double lanes[4];
+                _mm256_storeu_pd(lanes, acc);
+                double distance = -((lanes[0] + lanes[1]) + (lanes[2] + lanes[3]));
+                return distance + Scalar::negSquaredEuclidean(x + i, y + i, d - i);
+            }
+
+            __attribute__((target("avx2"))) inline double dot(const double *x, const double *y, size_t d)
+            {
+                __m256d acc = _mm256_setzero_pd();
+                size_t i = 0;
+                for (; i + 4 <= d; i += 4)
+                {
+                    acc = _mm256_add_pd(acc, _mm256_mul_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+                }
+                double lanes[4];
+                _mm256_storeu_pd(lanes, acc);
+                return ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + Scalar::dot(x + i, y + i, d - i);
+            }
+
+            // 4 x 2 sub-tiles keep the accumulators and operands within the 16 ymm registers
+            __attribute__((target("avx2"))) inline void dotTile(const double *x, size_t x_stride, const double *y, size_t y_stride, size_t d, double *out, size_t out_stride)
+            {
+                for (size_t j = 0; j < 4; j += 2)
+                {
+                    __m256d acc[4][2];
+                    for (size_t i = 0; i < 4; ++i)
+                    {
+                        acc[i][0] = _mm256_setzero_pd();
+                        acc[i][1] = _mm256_setzero_pd();
+                    }
+                    const double *y0 = y + j * y_stride;
+                    const double *y1 = y0 + y_stride;
+                    size_t k = 0;
+                    for (; k + 4 <= d; k += 4)
+                    {
+                        __m256d b0 = _mm256_loadu_pd(y0 + k);
+                        __m256d b1 = _mm256_loadu_pd(y1 + k);
+                        for (size_t i = 0; i < 4; ++i)
+                        {
+                            __m256d a = _mm256_loadu_pd(x + i * x_stride + k);
+                            acc[i][0] = _mm256_add_pd(acc[i][0], _mm256_mul_pd(a, b0));
+                            acc[i][1] = _mm256_add_pd(acc[i][1], _mm256_mul_pd(a, b1));
+                        }
+                    }
+                    for (size_t i = 0; i < 4; ++i)
+                    {
+                        const double *xi = x + i * x_stride;
+                        double lanes[4];
+                        _mm256_storeu_pd(lanes, acc[i][0]);
+                        out[i * out_stride + j] = ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + Scalar::dot(xi + k, y0 + k, d - k);
+                        _mm256_storeu_pd(lanes, acc[i][1]);
+                        out[i * out_stride + j + 1] = ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + Scalar::dot(xi + k, y1 + k, d - k);
+                    }
+                }
+            }
+
+            __attribute__((target("avx2"))) inline void rowTop2(const double *a, const double *s, size_t n, double &first, double &second)
+            {
+                __m256d m1 = _mm256_set1_pd(-std::numeric_limits<double>::infinity());
+                __m256d m2 = m1;
+                size_t k = 0;
+                for (; k + 4 <= n; k += 4)
+                {
+                    __m256d v = _mm256_add_pd(_mm256_loadu_pd(a + k), _mm256_loadu_pd(s + k));
+                    m2 = _mm256_max_pd(m2, _mm256_min_pd(m1, v));
+                    m1 = _mm256_max_pd(m1, v);
+                }
+                double l1[4], l2[4];
+                _mm256_storeu_pd(l1, m1);
+                _mm256_storeu_pd(l2, m2);
+                first = -std::numeric_limits<double>::infinity();
+                second = -std::numeric_limits<double>::infinity();
+                for (int l = 0; l < 4; ++l)
+                {
+                    Scalar::insertTop2(l1[l], first, second);
+                    Scalar::insertTop2(l2[l], first, second);
+                }
+                for (; k < n; ++k)
+                {
+                    Scalar::insertTop2(a[k] + s[k], first, second);
+                }
+            }
+
+            __attribute__((target("avx2"))) inline void responsibilityRow(const double *s, const double *a, double *r, size_t n, double first, double second, double damping)
+            {
+                __m256d vfirst = _mm256_set1_pd(first);
+                __m256d vsecond = _mm256_set1_pd(second);
+                __m256d vdamping = _mm256_set1_pd(damping);
+                __m256d vkeep = _mm256_set1_pd(1.0 - damping);
+                size_t k = 0;
+                for (; k + 4 <= n; k += 4)
+                {
+                    __m256d vs = _mm256_loadu_pd(s + k);
+                    __m256d eq = _mm256_cmp_pd(_mm256_add_pd(_mm256_loadu_pd(a + k), vs), vfirst, _CMP_EQ_OQ);
+                    __m256d other = _mm256_blendv_pd(vfirst, vsecond, eq);
+                    __m256d updated = _mm256_add_pd(_mm256_mul_pd(vdamping, _mm256_loadu_pd(r + k)), _mm256_mul_pd(vkeep, _mm256_sub_pd(vs, other)));
+                    _mm256_storeu_pd(r + k, updated);
+                }
+                Scalar::responsibilityRow(s + k, a + k, r + k, n - k, first, second, damping);
+            }
+
+            __attribute__((target("avx2"))) inline void accumulatePositive(const double *r, double *sums, size_t n)
+            {
+                __m256d zero = _mm256_setzero_pd();
+                size_t j = 0;
+                for (; j + 4 <= n; j += 4)
+                {
+                    _mm256_storeu_pd(sums + j, _mm256_add_pd(_mm256_loadu_pd(sums + j), _mm256_max_pd(zero, _mm256_loadu_pd(r + j))));
+                }
+                Scalar::accumulatePositive(r + j, sums + j, n - j);
+            }
+
+            __attribute__((target("avx2"))) inline void availabilityRow(const double *r, const double *diagonal, const double *sums, double *a, size_t n, double damping)
+            {
+                __m256d zero = _mm256_setzero_pd();
+                __m256d vdamping = _mm256_set1_pd(damping);
+                __m256d vkeep = _mm256_set1_pd(1.0 - damping);
+                size_t j = 0;
+                for (; j + 4 <= n; j += 4)
+                {
+                    __m256d total = _mm256_add_pd(_mm256_loadu_pd(diagonal + j), _mm256_loadu_pd(sums + j));
+                    __m256d value = _mm256_min_pd(zero, _mm256_sub_pd(total, _mm256_max_pd(zero, _mm256_loadu_pd(r + j))));
+                    _mm256_storeu_pd(a + j, _mm256_add_pd(_mm256_mul_pd(vdamping, _mm256_loadu_pd(a + j)), _mm256_mul_pd(vkeep, value)));
+                }
+                Scalar::availabilityRow(r + j, diagonal + j, sums + j, a + j, n - j, damping);
+            }
+
+            __attribute__((target("avx2"))) inline size_t argmaxSum(const double *r, const double *a, size_t n)
+            {
+                __m256d m = _mm256_set1_pd(-std::numeric_limits<double>::infinity());
+                size_t k = 0;
+                for (; k + 4 <= n; k += 4)
+                {
+                    m = _mm256_max_pd(m, _mm256_add_pd(_mm256_loadu_pd(r + k), _mm256_loadu_pd(a + k)));
+                }
+                double lanes[4];
+                _mm256_storeu_pd(lanes, m);
+                double max_val = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+                for (; k < n; ++k)
+                {
+                    max_val = std::max(max_val, r[k] + a[k]);
+                }
+
+                __m256d target = _mm256_set1_pd(max_val);
+                for (k = 0; k + 4 <= n; k += 4)
+                {
+                    int mask = _mm256_movemask_pd(_mm256_cmp_pd(_mm256_add_pd(_mm256_loadu_pd(r + k), _mm256_loadu_pd(a + k)), target, _CMP_EQ_OQ));
+                    if (mask)
+                        return k + __builtin_ctz(mask);
+                }
+                for (; k < n; ++k)
+                {
+                    if (r[k] + a[k] == max_val)
+                        return k;
+                }
+                return 0;
+            }
+
+            // Single precision message kernels, eight lanes
+
+            __attribute__((target("avx2"))) inline void rowTop2(const float *a, const float *s, size_t n, float &first, float &second)
+            {
+                __m256 m1 = _mm256_set1_ps(-std::numeric_limits<float>::infinity());
+                __m256 m2 = m1;
+                size_t k = 0;
+                for (; k + 8 <= n; k += 8)
+                {
+                    __m256 v = _mm256_add_ps(_mm256_loadu_ps(a + k), _mm256_loadu_ps(s + k));
+                    m2 = _mm256_max_ps(m2, _mm256_min_ps(m1, v));
+                    m1 = _mm256_max_ps(m1, v);
+                }
+                float l1[8], l2[8];
+                _mm256_storeu_ps(l1, m1);
+                _mm256_storeu_ps(l2, m2);
+                first = -std::numeric_limits<float>::infinity();
+                second = -std::numeric_limits<float>::infinity();
+                for (int l = 0; l < 8; ++l)
+                {
+                    Scalar::insertTop2(l1[l], first, second);
+                    Scalar::insertTop2(l2[l], first, second);
+                }
+                for (; k < n; ++k)
+                {
+                    Scalar::insertTop2(a[k] + s[k], first, second);
+                }
+            }
+
+            __attribute__((target("avx2"))) inline void responsibilityRow(const float *s, const float *a, float *r, size_t n, float first, float second, float damping)
+            {
+                __m256 vfirst = _mm256_set1_ps(first);
+                __m256 vsecond = _mm256_set1_ps(second);
+                __m256 vdamping = _mm256_set1_ps(damping);
+                __m256 vkeep = _mm256_set1_ps(1.0f - damping);
+                size_t k = 0;
+                for (; k + 8 <= n; k += 8)
+                {
+                    __m256 vs = _mm256_loadu_ps(s + k);
+                    __m256 eq = _mm256_cmp_ps(_mm256_add_ps(_mm256_loadu_ps(a + k), vs), vfirst, _CMP_EQ_OQ);
+                    __m256 other = _mm256_blendv_ps(vfirst, vsecond, eq);
+                    __m256 updated = _mm256_add_ps(_mm256_mul_ps(vdamping, _mm256_loadu_ps(r + k)), _mm256_mul_ps(vkeep, _mm256_sub_ps(vs, other)));
+                    _mm256_storeu_ps(r + k, updated);
+                }
+                Scalar::responsibilityRow(s + k, a + k, r + k, n - k, first, second, damping);
+            }
+
+            __attribute__((target("avx2"))) inline void accumulatePositive(const float *r, float *sums, size_t n)
+            {
+                __m256 zero = _mm256_setzero_ps();
+                size_t j = 0;
+                for (; j + 8 <= n; j += 8)
+                {
+                    _mm256_storeu_ps(sums + j, _mm256_add_ps(_mm256_loadu_ps(sums + j), _mm256_max_ps(zero, _mm256_loadu_ps(r + j))));
+                }
+                Scalar::accumulatePositive(r + j, sums + j, n - j);
+            }
+
+            __attribute__((target("avx2"))) inline void accumulatePositive(const float *r, double *sums, size_t n)
+            {
+                __m128 zero = _mm_setzero_ps();
+                size_t j = 0;
+                for (; j + 4 <= n; j += 4)
+                {
+                    __m256d positive = _mm256_cvtps_pd(_mm_max_ps(zero, _mm_loadu_ps(r + j)));
+                    _mm256_storeu_pd(sums + j, _mm256_add_pd(_mm256_loadu_pd(sums + j), positive));
+                }
+                Scalar::accumulatePositive(r + j, sums + j, n - j);
+            }
+
+            __attribute__((target("avx2"))) inline void availabilityRow(const float *r, const float *diagonal, const float *sums, float *a, size_t n, float damping)
+            {
+                __m256 zero = _mm256_setzero_ps();
+                __m256 vdamping = _mm256_set1_ps(damping);
+                __m256 vkeep = _mm256_set1_ps(1.0f - damping);
+                size_t j = 0;
+                for (; j + 8 <= n; j += 8)
+                {
+                    __m256 total = _mm256_add_ps(_mm256_loadu_ps(diagonal + j), _mm256_loadu_ps(sums + j));
+                    __m256 value = _mm256_min_ps(zero, _mm256_sub_ps(total, _mm256_max_ps(zero, _mm256_loadu_ps(r + j))));
+                    _mm256_storeu_ps(a + j, _mm256_add_ps(_mm256_mul_ps(vdamping, _mm256_loadu_ps(a + j)), _mm256_mul_ps(vkeep, value)));
+                }
+                Scalar::availabilityRow(r + j, diagonal + j, sums + j, a + j, n - j, damping);
+            }
+
+            __attribute__((target("avx2"))) inline size_t argmaxSum(const float *r, const float *a, size_t n)
+            {
+                __m256 m = _mm256_set1_ps(-std::numeric_limits<float>::infinity());
+                size_t k = 0;
+                for (; k + 8 <= n; k += 8)
+                {
+                    m = _mm256_max_ps(m, _mm256_add_ps(_mm256_loadu_ps(r + k), _mm256_loadu_ps(a + k)));
+                }
+                float lanes[8];
+                _mm256_storeu_ps(lanes, m);
+                float max_val = *std::max_element(lanes, lanes + 8);
+                for (; k < n; ++k)
+                {
+                    max_val = std::max(max_val, r[k] + a[k]);
+                }
+
+                __m256 target = _mm256_set1_ps(max_val);
+                for (k = 0; k + 8 <= n; k += 8)
+                {
+                    int mask = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_add_ps(_mm256_loadu_ps(r + k), _mm256_loadu_ps(a + k)), target, _CMP_EQ_OQ));
+                    if (mask)
+                        return k + __builtin_ctz(mask);
+                }
+                for (; k < n; ++k)
+                {
+                    if (r[k] + a[k] == max_val)
+                        return k;
+                }
+                return 0;
+            }
+        }
+
+        namespace AVX512
+        {
+            __attribute__((target("avx512f"))) inline double negSquaredEuclidean(const double *x, const double *y, size_t d)
+            {
+                __m512d acc = _mm512_setzero_pd();
+                size_t i = 0;
+                for (; i + 8 <= d; i += 8)
+                {
+                    __m512d diff = _mm512_sub_pd(_mm512_loadu_pd(x + i), _mm512_loadu_pd(y + i));
+                    acc = _mm512_add_pd(acc, _mm512_mul_pd(diff, diff));
+                }
+                double distance = -_mm512_reduce_add_pd(acc);
+                return distance + Scalar::negSquaredEuclidean(x + i, y + i, d - i);
+            }
+
+            __attribute__((target("avx512f"))) inline double dot(const double *x, const double *y, size_t d)
+            {
+                __m512d acc = _mm512_setzero_pd();
+                size_t i = 0;
+                for (; i + 8 <= d; i += 8)
+                {
+                    acc = _mm512_add_pd(acc, _mm512_mul_pd(_mm512_loadu_pd(x + i), _mm512_loadu_pd(y + i)));
+                }
+                return _mm512_reduce_add_pd(acc) + Scalar::dot(x + i, y + i, d - i);
+            }
+
+            __attribute__((target("avx512f"))) inline void dotTile(const double *x, size_t x_stride, const double *y, size_t y_stride, size_t d, double *out, size_t out_stride)
+            {
+                __m512d acc[4][4];
+                for (size_t i = 0; i < 4; ++i)
+                {
+                    for (size_t j = 0; j < 4; ++j)
+                    {
+                        acc[i][j] = _mm512_setzero_pd();
+                    }
+                }
+                size_t k = 0;
+                for (; k + 8 <= d; k += 8)
+                {
+                    __m512d b[4];
+                    for (size_t j = 0; j < 4; ++j)
+                    {
+                        b[j] = _mm512_loadu_pd(y + j * y_stride + k);
+                    }
+                    for (size_t i = 0; i < 4; ++i)
+                    {
+                        __m512d a = _mm512_loadu_pd(x + i * x_stride + k);
+                        for (size_t j = 0; j < 4; ++j)
+                        {
+                            acc[i][j] = _mm512_add_pd(acc[i][j], _mm512_mul_pd(a, b[j]));
+                        }
+                    }
+                }
+                for (size_t i = 0; i < 4; ++i)
+                {
+                    for (size_t j = 0; j < 4; ++j)
+                    {
+                        out[i * out_stride + j] = _mm512_reduce_add_pd(acc[i][j]) + Scalar::dot(x + i * x_stride + k, y + j * y_stride + k, d - k);
+                    }
+                }
+            }
+
+            __attribute__((target("avx512f"))) inline void rowTop2(const double *a, const double *s, size_t n, double &first, double &second)
+            {
+                __m512d m1 = _mm512_set1_pd(-std::numeric_limits<double>::infinity());
+                __m512d m2 = m1;
+                size_t k = 0;
+                for (; k + 8 <= n; k += 8)
+                {
+                    __m512d v = _mm512_add_pd(_mm512_loadu_pd(a + k), _mm512_loadu_pd(s + k));
+                    m2 = _mm512_max_pd(m2, _mm512_min_pd(m1, v));
+                    m1 = _mm512_max_pd(m1, v);
+                }
+                double l1[8], l2[8];
+                _mm512_storeu_pd(l1, m1);
+                _mm512_storeu_pd(l2, m2);
+                first = -std::numeric_limits<double>::infinity();
+                second = -std::numeric_limits<double>::infinity();
+                for (int l = 0; l < 8; ++l)
+                {
+                    Scalar::insertTop2(l1[l], first, second);
+                    Scalar::insertTop2(l2[l], first, second);
+                }
+                for (; k < n; ++k)
+                {
+                    Scalar::insertTop2(a[k] + s[k], first, second);
+                }
+            }
+
+            __attribute__((target("avx512f"))) inline void responsibilityRow(const double *s, const double *a, double *r, size_t n, double first, double second, double damping)
+            {
+                __m512d vfirst = _mm512_set1_pd(first);
+                __m512d vsecond = _mm512_set1_pd(second);
+                __m512d vdamping = _mm512_set1_pd(damping);
+                __m512d vkeep = _mm512_set1_pd(1.0 - damping);
+                size_t k = 0;
+                for (; k + 8 <= n; k += 8)
+                {
+                    __m512d vs = _mm512_loadu_pd(s + k);
+                    __mmask8 eq = _mm512_cmp_pd_mask(_mm512_add_pd(_mm512_loadu_pd(a + k), vs), vfirst, _CMP_EQ_OQ);
+                    __m512d other = _mm512_mask_blend_pd(eq, vfirst, vsecond);
+                    __m512d updated = _mm512_add_pd(_mm512_mul_pd(vdamping, _mm512_loadu_pd(r + k)), _mm512_mul_pd(vkeep, _mm512_sub_pd(vs, other)));
+                    _mm512_storeu_pd(r + k, updated);
+                }
+                Scalar::responsibilityRow(s + k, a + k, r + k, n - k, first, second, damping);
+            }
+
+            __attribute__((target("avx512f"))) inline void accumulatePositive(const double *r, double *sums, size_t n)
+            {
+                __m512d zero = _mm512_setzero_pd();
+                size_t j = 0;
+                for (; j + 8 <= n; j += 8)
+                {
+                    _mm512_storeu_pd(sums + j, _mm512_add_pd(_mm512_loadu_pd(sums + j), _mm512_max_pd(zero, _mm512_loadu_pd(r + j))));
+                }
+                Scalar::accumulatePositive(r + j, sums + j, n - j);
+            }
+
+            __attribute__((target("avx512f"))) inline void availabilityRow(const double *r, const double *diagonal, const double *sums, double *a, size_t n, double damping)
+            {
+                __m512d zero = _mm512_setzero_pd();
+                __m512d vdamping = _mm512_set1_pd(damping);
+                __m512d vkeep = _mm512_set1_pd(1.0 - damping);
+                size_t j = 0;
+                for (; j + 8 <= n; j += 8)
+                {
+                    __m512d total = _mm512_add_pd(_mm512_loadu_pd(diagonal + j), _mm512_loadu_pd(sums + j));
+                    __m512d value = _mm512_min_pd(zero, _mm512_sub_pd(total, _mm512_max_pd(zero, _mm512_loadu_pd(r + j))));
+                    _mm512_storeu_pd(a + j, _mm512_add_pd(_mm512_mul_pd(vdamping, _mm512_loadu_pd(a + j)), _mm512_mul_pd(vkeep, value)));
+                }
+                Scalar::availabilityRow(r + j, diagonal + j, sums + j, a + j, n - j, damping);
+            }
+
+            __attribute__((target("avx512f"))) inline size_t argmaxSum(const double *r, const double *a, size_t n)
+            {
+                __m512d m = _mm512_set1_pd(-std::numeric_limits<double>::infinity());
+                size_t k = 0;
+                for (; k + 8 <= n; k += 8)
+                {
+                    m = _mm512_max_pd(m, _mm512_add_pd(_mm512_loadu_pd(r + k), _mm512_loadu_pd(a + k)));
+                }
+                double max_val = _mm512_reduce_max_pd(m);
+                for (; k < n; ++k)
+                {
+                    max_val = std::max(max_val, r[k] + a[k]);
+                }
+
+                __m512d target = _mm512_set1_pd(max_val);
+                for (k = 0; k + 8 <= n; k += 8)
+                {
+                    __mmask8 mask = _mm512_cmp_pd_mask(_mm512_add_pd(_mm512_loadu_pd(r + k), _mm512_loadu_pd(a + k)), target, _CMP_EQ_OQ);
+                    if (mask)
+                        return k + __builtin_ctz(mask);
+                }
+                for (; k < n; ++k)
+                {
+                    if (r[k] + a[k] == max_val)
+                        return k;
+                }
+                return 0;
+            }
+
+            // Single precision message kernels, sixteen lanes
+
+            __attribute__((target("avx512f"))) inline void rowTop2(const float *a, const float *s, size_t n, float &first, float &second)
+            {
+                __m512 m1 = _mm512_set1_ps(-std::numeric_limits<float>::infinity());
+                __m512 m2 = m1;
+                size_t k = 0;
+                for (; k + 16 <= n; k += 16)
+                {
+                    __m512 v = _mm512_add_ps(_mm512_loadu_ps(a + k), _mm512_loadu_ps(s + k));
+                    m2 = _mm512_max_ps(m2, _mm512_min_ps(m1, v));
+                    m1 = _mm512_max_ps(m1, v);
+                }
+                float l1[16], l2[16];
+                _mm512_storeu_ps(l1, m1);
+                _mm512_storeu_ps(l2, m2);
+                first = -std::numeric_limits<float>::infinity();
+                second = -std::numeric_limits<float>::infinity();
+                for (int l = 0; l < 16; ++l)
+                {
+                    Scalar::insertTop2(l1[l], first, second);
+                    Scalar::insertTop2(l2[l], first, second);
+                }
+                for (; k < n; ++k)
+                {
+                    Scalar::insertTop2(a[k] + s[k], first, second);
+                }
+            }
+
+            __attribute__((target("avx512f"))) inline void responsibilityRow(const float *s, const float *a, float *r, size_t n, float first, float second, float damping)
+            {
+                __m512 vfirst = _mm512_set1_ps(first);
+                __m512 vsecond = _mm512_set1_ps(second);
+                __m512 vdamping = _mm512_set1_ps(damping);
+                __m512 vkeep = _mm512_set1_ps(1.0f - damping);
+                size_t k = 0;
+                for (; k + 16 <= n; k += 16)
+                {
+                    __m512 vs = _mm512_loadu_ps(s + k);
+                    __mmask16 eq = _mm512_cmp_ps_mask(_mm512_add_ps(_mm512_loadu_ps(a + k), vs), vfirst, _CMP_EQ_OQ);
+                    __m512 other = _mm512_mask_blend_ps(eq, vfirst, vsecond);
+                    __m512 updated = _mm512_add_ps(_mm512_mul_ps(vdamping, _mm512_loadu_ps(r + k)), _mm512_mul_ps(vkeep, _mm512_sub_ps(vs, other)));
+                    _mm512_storeu_ps(r + k, updated);
+                }
+                Scalar::responsibilityRow(s + k, a + k, r + k, n - k, first, second, damping);
+            }
+
+            __attribute__((target("avx512f"))) inline void accumulatePositive(const float *r, float *sums, size_t n)
+            {
+                __m512 zero = _mm512_setzero_ps();
+                size_t j = 0;
+                for (; j + 16 <= n; j += 16)
+                {
+                    _mm512_storeu_ps(sums + j, _mm512_add_ps(_mm512_loadu_ps(sums + j), _mm512_max_ps(zero, _mm512_loadu_ps(r + j))));
+                }
+                Scalar::accumulatePositive(r + j, sums + j, n - j);
+            }
+
+            __attribute__((target("avx512f"))) inline void accumulatePositive(const float *r, double *sums, size_t n)
+            {
+                __m256 zero = _mm256_setzero_ps();
+                size_t j = 0;
+                for (; j + 8 <= n; j += 8)
+                {
+                    __m512d positive = _mm512_cvtps_pd(_mm256_max_ps(zero, _mm256_loadu_ps(r + j)));
+                    _mm512_storeu_pd(sums + j, _mm512_add_pd(_mm512_loadu_pd(sums + j), positive));
+                }
+                Scalar::accumulatePositive(r + j, sums + j, n - j);
+            }
+
+            __attribute__((target("avx512f"))) inline void availabilityRow(const float *r, const float *diagonal, const float *sums, float *a, size_t n, float damping)
+            {
+                __m512 zero = _mm512_setzero_ps();
+                __m512 vdamping = _mm512_set1_ps(damping);
+                __m512 vkeep = _mm512_set1_ps(1.0f - damping);
+                size_t j = 0;
+                for (; j + 16 <= n; j += 16)
+                {
+                    __m512 total = _mm512_add_ps(_mm512_loadu_ps(diagonal + j), _mm512_loadu_ps(sums + j));
+                    __m512 value = _mm512_min_ps(zero, _mm512_sub_ps(total, _mm512_max_ps(zero, _mm512_loadu_ps(r + j))));
+                    _mm512_storeu_ps(a + j, _mm512_add_ps(_mm512_mul_ps(vdamping, _mm512_loadu_ps(a + j)), _mm512_mul_ps(vkeep, value)));
+                }
+                Scalar::availabilityRow(r + j, diagonal + j, sums + j, a + j, n - j, damping);
+            }
+
+            __attribute__((target("avx512f"))) inline size_t argmaxSum(const float *r, const float *a, size_t n)
+            {
+                __m512 m = _mm512_set1_ps(-std::numeric_limits<float>::infinity());
+                size_t k = 0;
+                for (; k + 16 <= n; k += 16)
+                {
+                    m = _mm512_max_ps(m, _mm512_add_ps(_mm512_loadu_ps(r + k), _mm512_loadu_ps(a + k)));
+                }
+                float max_val = _mm512_reduce_max_ps(m);
+                for (; k < n; ++k)
+                {
+                    max_val = std::max(max_val, r[k] + a[k]);
+                }
+
+                __m512 target = _mm512_set1_ps(max_val);
+                for (k = 0; k + 16 <= n; k += 16)
+                {
+                    __mmask16 mask = _mm512_cmp_ps_mask(_mm512_add_ps(_mm512_loadu_ps(r + k), _mm512_loadu_ps(a + k)), target, _CMP_EQ_OQ);
+                    if (mask)
+                        return k + __builtin_ctz(mask);
+                }
+                for (; k < n; ++k)
+                {
+                    if (r[k] + a[k] == max_val)
+                        return k;
+                }
+                return 0;
+            }
+        }
+#endif
+
+        /// @brief Whether the running CPU can execute the given variant
+        inline bool supported(Isa isa)
+        {
+            switch (isa)
+            {
+            case Isa::Scalar:
+                return true;
+#if AP_SIMD_X86
+            case Isa::SSE2:
+                return __builtin_cpu_supports("sse2");
+            case Isa::AVX2:
+                return __builtin_cpu_supports("avx2");
+            case Isa::AVX512:
+                return __builtin_cpu_supports("avx512f");
+#endif
+            default:
+                return false;
+            }
+        }
+
+        /// @brief Kernel table of a specific variant, the caller has to check supported() first
+        inline const Kernels &kernels(Isa isa)
+        {
+            static const Kernels scalar{Isa::Scalar, "scalar", &Scalar::negSquaredEuclidean, &Scalar::dot, &Scalar::dotTile, &Scalar::rowTop2, &Scalar::responsibilityRow,
+                                        &Scalar::accumulatePositive, &Scalar::availabilityRow, &Scalar::argmaxSum,
+                                        {&Scalar::rowTop2, &Scalar::responsibilityRow, &Scalar::accumulatePositive, &Scalar::accumulatePositive,
+                                         &Scalar::availabilityRow, &Scalar::argmaxSum}};
+#if AP_SIMD_X86
+            static const Kernels sse2{Isa::SSE2, "sse2", &SSE2::negSquaredEuclidean, &SSE2::dot, &SSE2::dotTile, &SSE2::rowTop2, &SSE2::responsibilityRow,
+                                      &SSE2::accumulatePositive, &SSE2::availabilityRow, &SSE2::argmaxSum,
+                                      {&SSE2::rowTop2, &SSE2::responsibilityRow, &SSE2::accumulatePositive, &SSE2::accumulatePositive,
+                                       &SSE2::availabilityRow, &SSE2::argmaxSum}};
+            static const Kernels avx2{Isa::AVX2, "avx2", &AVX2::negSquaredEuclidean, &AVX2::dot, &AVX2::dotTile, &AVX2::rowTop2, &AVX2::responsibilityRow,
+                                      &AVX2::accumulatePositive, &AVX2::availabilityRow, &AVX2::argmaxSum,
+                                      {&AVX2::rowTop2, &AVX2::responsibilityRow, &AVX2::accumulatePositive, &AVX2::accumulatePositive,
+                                       &AVX2::availabilityRow, &AVX2::argmaxSum}};
+            static const Kernels avx512{Isa::AVX512, "avx512", &AVX512::negSquaredEuclidean, &AVX512::dot, &AVX512::dotTile, &AVX512::rowTop2, &AVX512::responsibilityRow,
+                                        &AVX512::accumulatePositive, &AVX512::availabilityRow, &AVX512::argmaxSum,
+                                        {&AVX512::rowTop2, &AVX512::responsibilityRow, &AVX512::accumulatePositive, &AVX512::accumulatePositive,
+                                         &AVX512::availabilityRow, &AVX512::argmaxSum}};
+
+            switch (isa)
+            {
+            case Isa::SSE2:
+                return sse2;
+            case Isa::AVX2:
+                return avx2;
+            case Isa::AVX512:
+                return avx512;
+            default:
+                break;
+            }
+#endif
+            return scalar;
+        }
+
+        /// @brief Every variant the running CPU supports, scalar first
+        inline std::vector<Isa> available()
+        {
+            std::vector<Isa> result;
+            for (Isa isa : {Isa::Scalar, Isa::SSE2, Isa::AVX2, Isa::AVX512})
+            {
+                if (supported(isa))
+                    result.push_back(isa);
+            }
+            return result;
+        }
+
+        /// @brief Widest variant supported by the running CPU, selected on first use
+        inline const Kernels &best()
+        {
+            static const Kernels &selected = kernels(available().back());
+            return selected;
+        }
+
+        /// @brief The message passing kernels for values of type T, which are a whole Kernels table for double
+        template <typename T>
+        using MessageKernels = std::conditional_t<std::is_same_v<T, float>, FloatKernels, Kernels>;
+
+        template <typename T>
+        inline const MessageKernels<T> &messages(const Kernels &table)
+        {
+            static_assert(std::is_same_v<T, float> || std::is_same_v<T, double>, "Message kernels exist for float and double");
+            if constexpr (std::is_same_v<T, float>)
+                return table.single;
+            else
+                return table;
+        }
+    }
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#pragma GCC pop_options
+#endif
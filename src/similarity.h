@@ -0,0 +1,132 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include "matrix.h"
+#include "simd.h"
+
+namespace AP
+{
+    /// Blocked construction of negative squared Euclidean similarities.
+    /// -||x - y||^2 = 2 x.y - ||x||^2 - ||y||^2, so with the row norms precomputed the pairwise work
+    /// is the matrix product of the points with their own transpose. It is computed in cache sized blocks
+    /// of 4 x 4 register tiles, see Simd::Kernels::dotTile
+    namespace Similarity
+    {
+        /// @brief Centered points and their squared row norms.
+        ///        Centering leaves every distance unchanged but shrinks the norms,
+        ///        which keeps the cancellation in 2 x.y - ||x||^2 - ||y||^2 small
+        struct Operands
+        {
+            Matrix points;
+            std::vector<double> norms;
+        };
+
+        inline Operands prepare(const Matrix &points, const Simd::Kernels &simd)
+        {
+            size_t n = points.rows();
+            size_t d = points.cols();
+
+            std::vector<double> mean(d, 0.0);
+            for (size_t i = 0; i < n; ++i)
+            {
+                auto row = points.row(i);
+                for (size_t k = 0; k < d; ++k)
+                {
+                    mean[k] += row[k];
+                }
+            }
+            for (size_t k = 0; k < d; ++k)
+            {
+                mean[k] /= std::max<size_t>(1, n);
+            }
+
+            Operands operands{Matrix(n, d, 0.0), std::vector<double>(n)};
+            for (size_t i = 0; i < n; ++i)
+            {
+                auto src = points.row(i);
+                auto dst = operands.points.row(i);
+                for (size_t k = 0; k < d; ++k)
+                {
+                    dst[k] = src[k] - mean[k];
+                }
+                operands.norms[i] = simd.dot(dst.data(), dst.data(), d);
+            }
+            return operands;
+        }
+
+        /// @brief Number of points per block, chosen so the two blocks of points being multiplied fit in L2 together
+        inline size_t blockRows(size_t d)
+        {
+            constexpr size_t cache_bytes = 256 * 1024;
+            size_t rows = cache_bytes / (2 * std::max<size_t>(1, Matrix::paddedStride(d)) * sizeof(double));
+            return std::clamp<size_t>(rows / 4 * 4, 16, 512);
+        }
+
+        /// @brief Similarity from a dot product and the two squared norms, rounding can push it slightly above zero.
+        ///        The norms are added first so the result does not depend on the order of the pair
+        inline double fromDot(double dot, double norm_x, double norm_y)
+        {
+            return std::min(0.0, 2.0 * dot - (norm_x + norm_y));
+        }
+
+        /// @brief Fill out(a, b) with the similarity of points row_begin + a and col_begin + b.
+        ///        The similarity is computed in double and rounded once when stored into a narrower out
+        template <typename T>
+        inline void computeBlock(const Operands &operands, BasicMatrixView<T> out, size_t row_begin, size_t col_begin, const Simd::Kernels &simd)
+        {
+            const Matrix &points = operands.points;
+            const std::vector<double> &norms = operands.norms;
+            size_t d = points.cols();
+            size_t stride = points.stride();
+            double tile[16];
+
+            for (size_t a = 0; a < out.rows(); a += 4)
+            {
+                size_t i = row_begin + a;
+                size_t tile_rows = std::min<size_t>(4, out.rows() - a);
+
+                for (size_t b = 0; b < out.cols(); b += 4)
+                {
+                    size_t j = col_begin + b;
+                    size_t tile_cols = std::min<size_t>(4, out.cols() - b);
+
+                    if (tile_rows == 4 && tile_cols == 4)
+                    {
+                        simd.dotTile(points.row(i).data(), stride, points.row(j).data(), stride, d, tile, 4);
+                    }
+                    else
+                    {
+                        for (size_t ii = 0; ii < tile_rows; ++ii)
+                        {
+                            for (size_t jj = 0; jj < tile_cols; ++jj)
+                            {
+                                tile[ii * 4 + jj] = simd.dot(points.row(i + ii).data(), points.row(j + jj).data(), d);
+                            }
+                        }
+                    }
+
+                    for (size_t ii = 0; ii < tile_rows; ++ii)
+                    {
+                        for (size_t jj = 0; jj < tile_cols; ++jj)
+                        {
+                            out(a + ii, b + jj) = static_cast<T>(fromDot(tile[ii * 4 + jj], norms[i + ii], norms[j + jj]));
+                        }
+                    }
+                }
+            }
+        }
+
+        /// @brief Copy the entries of the block at (row_begin, col_begin) that lie above the diagonal to their transposed position
+        template <typename T>
+        inline void mirror(BasicMatrixView<T> out, size_t row_begin, size_t rows, size_t col_begin, size_t cols)
+        {
+            for (size_t i = row_begin; i < row_begin + rows; ++i)
+            {
+                for (size_t j = std::max(col_begin, i + 1); j < col_begin + cols; ++j)
+                {
+                    out(j, i) = out(i, j);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,301 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+#include "matrix.h"
+#include "packed_matrix.h"
+#include "simd.h"
+#include "similarity.h"
+#include "metrics.h"
+#include "binary_format.h"
+
+namespace AP
+{
+    /// @brief Source of the rows of an n x n similarity matrix with the preferences on the diagonal, see BasicAffinityPropagation.
+    ///        Rows are requested a tile at a time, so a provider can either hand out rows it stores
+    ///        or compute each tile on demand without the matrix ever existing in memory
+    template <typename T>
+    class BasicSimilarityProvider
+    {
+    public:
+        virtual ~BasicSimilarityProvider() = default;
+
+        /// @brief Number of points n
+        virtual size_t size() const = 0;
+
+        /// @brief Largest number of rows to request at once
+        virtual size_t tileRows() const = 0;
+
+        /// @brief Rows [begin, end) of the matrix, at most tileRows() of them.
+        ///        The view either points into storage of the provider or into scratch, which is reallocated when too small.
+        ///        Safe to call from several threads at once with different scratch matrices
+        virtual BasicMatrixView<const T> rows(size_t begin, size_t end, BasicMatrix<T> &scratch) const = 0;
+
+        /// @brief Identifies the matrix, see Binary::hash
+        virtual uint64_t hash() const = 0;
+    };
+
+    using SimilarityProvider = BasicSimilarityProvider<double>;
+
+    /// @brief Provider over a similarity matrix held in memory, the matrix has to outlive the provider
+    template <typename T>
+    class StoredSimilarities : public BasicSimilarityProvider<T>
+    {
+    public:
+        explicit StoredSimilarities(const BasicMatrix<T> &similarities)
+            : similarities_(similarities)
+        {
+            if (similarities.rows() != similarities.cols())
+            {
+                throw std::invalid_argument("Similarity matrix has to be square, got " + std::to_string(similarities.rows()) + "x" + std::to_string(similarities.cols()));
+            }
+        }
+
+        inline size_t size() const override
+        {
+            return similarities_.rows();
+        }
+
+        inline size_t tileRows() const override
+        {
+            return std::max<size_t>(1, similarities_.rows());
+        }
+
+        inline BasicMatrixView<const T> rows(size_t begin, size_t end, BasicMatrix<T> &) const override
+        {
+            return BasicMatrixView<const T>(similarities_.row(begin).data(), end - begin, similarities_.cols(), similarities_.stride());
+        }
+
+        /// @brief Equal to Binary::hash() of the matrix for double
+        inline uint64_t hash() const override
+        {
+            uint64_t h = Binary::hash(nullptr, 0, similarities_.rows() * 31 + similarities_.cols());
+            for (size_t i = 0; i < similarities_.rows(); ++i)
+            {
+                h = Binary::hash(similarities_.row(i).data(), similarities_.cols() * sizeof(T), h);
+            }
+            return h;
+        }
+
+        inline const BasicMatrix<T> &matrix() const
+        {
+            return similarities_;
+        }
+
+    private:
+        const BasicMatrix<T> &similarities_;
+    };
+
+    /// @brief Provider over a packed symmetric similarity matrix with the preferences on its diagonal, see Parser::getPackedSimilarity().
+    ///        Every tile is assembled in scratch from the stored blocks, the matrix has to outlive the provider
+    template <typename T>
+    class PackedSimilarities : public BasicSimilarityProvider<T>
+    {
+    public:
+        explicit PackedSimilarities(const BasicPackedSymmetricMatrix<T> &similarities)
+            : similarities_(similarities)
+        {
+        }
+
+        inline size_t size() const override
+        {
+            return similarities_.size();
+        }
+
+        /// @brief Rows whose similarities fit in L2 together, at least a cache line of them so that every line
+        ///        of a block read through its transpose is used whole
+        inline size_t tileRows() const override
+        {
+            constexpr size_t cache_bytes = 256 * 1024;
+            constexpr size_t per_line = MATRIX_ALIGNMENT / sizeof(T);
+            size_t rows = cache_bytes / (std::max<size_t>(1, BasicMatrix<T>::paddedStride(size())) * sizeof(T));
+            return std::clamp<size_t>(rows / per_line * per_line, per_line, BasicPackedSymmetricMatrix<T>::BLOCK);
+        }
+
+        inline BasicMatrixView<const T> rows(size_t begin, size_t end, BasicMatrix<T> &scratch) const override
+        {
+            size_t n = size();
+            size_t count = end - begin;
+            if (scratch.rows() < count || scratch.cols() != n)
+            {
+                scratch = BasicMatrix<T>::uninitialized(count, n);
+            }
+
+            BasicMatrixView<T> tile = scratch.view().block(0, 0, count, n);
+            similarities_.copyRows(begin, end, tile);
+            return BasicMatrixView<const T>(tile.data(), count, n, tile.rowStride());
+        }
+
+        /// @brief Hash of the stored blocks and the diagonal
+        inline uint64_t hash() const override
+        {
+            size_t n = similarities_.size();
+            uint64_t h = Binary::hash(similarities_.diagonal().data(), n * sizeof(T), Binary::hash(nullptr, 0, n * 31 + n));
+            for (size_t rb = 0; rb < similarities_.blocksPerSide(); ++rb)
+            {
+                for (size_t cb = rb; cb < similarities_.blocksPerSide(); ++cb)
+                {
+                    BasicMatrixView<const T> block = similarities_.block(rb, cb);
+                    for (size_t a = 0; a < block.rows(); ++a)
+                    {
+                        h = Binary::hash(block.row(a).data(), block.cols() * sizeof(T), h);
+                    }
+                }
+            }
+            return h;
+        }
+
+        inline const BasicPackedSymmetricMatrix<T> &matrix() const
+        {
+            return similarities_;
+        }
+
+    private:
+        const BasicPackedSymmetricMatrix<T> &similarities_;
+    };
+
+    /// @brief Negative squared Euclidean similarities computed from the points whenever a tile of rows is requested,
+    ///        with the same blocked kernels Parser::getSimilarity() uses, so the values agree with the stored matrix up to rounding.
+    ///        Only the points are kept, which for a few dimensions costs far less memory and bandwidth than the n x n matrix.
+    ///        See Parser::getPointSimilarities() for a preference taken from the data
+    template <typename T>
+    class PointSimilarities : public BasicSimilarityProvider<T>
+    {
+    public:
+        /// @param points one row per point, copied
+        /// @param preference value on the diagonal
+        PointSimilarities(const Matrix &points, double preference)
+            : operands_(Similarity::prepare(points, Simd::best())), preference_(preference), source_hash_(Binary::hash(points))
+        {
+        }
+
+        inline size_t size() const override
+        {
+            return operands_.points.rows();
+        }
+
+        /// @brief Rows in multiples of the 4 x 4 register tiles whose similarities fit in L2 together
+        inline size_t tileRows() const override
+        {
+            constexpr size_t cache_bytes = 256 * 1024;
+            size_t rows = cache_bytes / (std::max<size_t>(1, BasicMatrix<T>::paddedStride(size())) * sizeof(T));
+            return std::clamp<size_t>(rows / 4 * 4, 4, 64);
+        }
+
+        inline BasicMatrixView<const T> rows(size_t begin, size_t end, BasicMatrix<T> &scratch) const override
+        {
+            size_t n = size();
+            size_t count = end - begin;
+            if (scratch.rows() < count || scratch.cols() != n)
+            {
+                scratch = BasicMatrix<T>::uninitialized(count, n);
+            }
+
+            BasicMatrixView<T> tile = scratch.view().block(0, 0, count, n);
+            size_t block = Similarity::blockRows(operands_.points.cols());
+            for (size_t col_begin = 0; col_begin < n; col_begin += block)
+            {
+                size_t cols = std::min(block, n - col_begin);
+                Similarity::computeBlock(operands_, tile.block(0, col_begin, count, cols), begin, col_begin, simd_);
+            }
+            for (size_t i = begin; i < end; ++i)
+            {
+                tile(i - begin, i) = static_cast<T>(preference_);
+            }
+            return BasicMatrixView<const T>(tile.data(), count, n, tile.rowStride());
+        }
+
+        /// @brief Hash of the points, the metric and the preference
+        inline uint64_t hash() const override
+        {
+            Binary::Metric metric = Binary::Metric::NegSquaredEuclidean;
+            return Binary::hash(&preference_, sizeof(preference_), Binary::hash(&metric, sizeof(metric), source_hash_));
+        }
+
+        inline double preference() const
+        {
+            return preference_;
+        }
+
+    private:
+        const Simd::Kernels &simd_ = Simd::best();
+        Similarity::Operands operands_;
+        double preference_;
+        uint64_t source_hash_;
+    };
+
+    /// @brief Similarities of any metric policy computed from the points whenever a tile of rows is requested, see Metrics.
+    ///        See Parser::getPointSimilarities(const M &, Diagonal, double) for a preference taken from the data
+    template <typename T, Metrics::Metric M>
+    class MetricSimilarities : public BasicSimilarityProvider<T>
+    {
+    public:
+        /// @param points one row per point, copied
+        /// @param preference value on the diagonal
+        /// @param metric policy instance, copied
+        MetricSimilarities(const Matrix &points, double preference, const M &metric = M{})
+            : metric_(metric), operands_(points, metric_), preference_(preference), source_hash_(Binary::hash(points))
+        {
+        }
+
+        inline size_t size() const override
+        {
+            return operands_.size();
+        }
+
+        /// @brief Rows whose similarities fit in L2 together
+        inline size_t tileRows() const override
+        {
+            constexpr size_t cache_bytes = 256 * 1024;
+            size_t rows = cache_bytes / (std::max<size_t>(1, BasicMatrix<T>::paddedStride(size())) * sizeof(T));
+            return std::clamp<size_t>(rows, 1, 64);
+        }
+
+        inline BasicMatrixView<const T> rows(size_t begin, size_t end, BasicMatrix<T> &scratch) const override
+        {
+            size_t n = size();
+            size_t count = end - begin;
+            if (scratch.rows() < count || scratch.cols() != n)
+            {
+                scratch = BasicMatrix<T>::uninitialized(count, n);
+            }
+
+            // Column blocks keep the part of the dimension-major points every row of the tile reads in L1
+            BasicMatrixView<T> tile = scratch.view().block(0, 0, count, n);
+            constexpr size_t l1_bytes = 32 * 1024;
+            size_t block = std::max<size_t>(Metrics::Operands<M>::CHUNK, l1_bytes / (std::max<size_t>(1, operands_.dimensions()) * sizeof(double)));
+            for (size_t col_begin = 0; col_begin < n; col_begin += block)
+            {
+                size_t cols = std::min(block, n - col_begin);
+                Metrics::computeBlock(metric_, operands_, tile.block(0, col_begin, count, cols), begin, col_begin);
+            }
+            for (size_t i = begin; i < end; ++i)
+            {
+                tile(i - begin, i) = static_cast<T>(preference_);
+            }
+            return BasicMatrixView<const T>(tile.data(), count, n, tile.rowStride());
+        }
+
+        /// @brief Hash of the points, the metric id and the preference. Metrics without an id all hash as Binary::Metric::None
+        inline uint64_t hash() const override
+        {
+            Binary::Metric metric = Binary::Metric::None;
+            if constexpr (Metrics::hasId<M>())
+                metric = M::id;
+            return Binary::hash(&preference_, sizeof(preference_), Binary::hash(&metric, sizeof(metric), source_hash_));
+        }
+
+        inline double preference() const
+        {
+            return preference_;
+        }
+
+    private:
+        M metric_;
+        Metrics::Operands<M> operands_;
+        double preference_;
+        uint64_t source_hash_;
+    };
+}
@@ -0,0 +1,279 @@
+#pragma once
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+#include "sparse_matrix.h"
+#include "affinity_propagation.h"
+#include "threadpool.h"
+#include "simd.h"
+#include "instrumentation.h"
+
+namespace AP
+{
+    /// @brief Affinity propagation over a sparse similarity graph.
+    ///        Messages are only exchanged along stored edges, so memory and time per iteration are O(nnz).
+    ///        Every row has to store its diagonal entry, which holds the preference
+    class SparseAffinityPropagation
+    {
+    public:
+        /// @param similarities sparse similarity graph with the preferences on the diagonal
+        /// @param max_iter upper bound on the number of message passing iterations
+        /// @param damping weight of the previous message when blending with the new one, in [0, 1)
+        /// @param convergence_iter number of iterations the exemplar set has to stay unchanged to stop early,
+        ///        0 disables early termination
+        SparseAffinityPropagation(const SparseMatrix &similarities, unsigned int max_iter = 200, double damping = 0.5, unsigned int convergence_iter = 15)
+            : similarities_(similarities), max_iter_(max_iter), damping_(damping), convergence_iter_(convergence_iter)
+        {
+            if (damping < 0.0 || damping >= 1.0)
+            {
+                throw std::invalid_argument("Damping has to be in range [0, 1)");
+            }
+        }
+
+        inline void fit()
+        {
+            instrumentation_.reset();
+            thread_pool_.start();
+
+            {
+                auto timer = instrumentation_.time(Phase::Initialize);
+                initialize();
+            }
+
+            converged_ = false;
+            iterations_ = 0;
+            unsigned int stable_iterations = 0;
+
+            for (unsigned int iter = 0; iter < max_iter_; ++iter)
+            {
+                auto start = std::chrono::high_resolution_clock::now();
+                IterationStats stats;
+                stats.iteration = iter;
+                {
+                    auto timer = instrumentation_.time(Phase::Responsibility);
+                    stats.responsibility_delta = updateResponsibility();
+                }
+                {
+                    auto timer = instrumentation_.time(Phase::Availability);
+                    stats.availability_delta = updateAvailability();
+                }
+                {
+                    auto timer = instrumentation_.time(Phase::Exemplars);
+                    stats.exemplar_changes = updateExemplars();
+                }
+                stats.exemplars = exemplar_count_;
+                stats.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+                iterations_ = iter + 1;
+                instrumentation_.count(Counter::Iterations);
+                instrumentation_.iteration(stats);
+
+                stable_iterations = stats.exemplar_changes > 0 ? 0 : stable_iterations + 1;
+                if (convergence_iter_ > 0 && stable_iterations >= convergence_iter_ && exemplar_count_ > 0)
+                {
+                    converged_ = true;
+                    break;
+                }
+            }
+
+            {
+                auto timer = instrumentation_.time(Phase::Clusters);
+                identifyClusters();
+            }
+
+            thread_pool_.stop();
+            instrumentation_.threadPool(thread_pool_.stats());
+            instrumentation_.log(Verbosity::Summary, converged_ ? "Converged" : "Did not converge", " after ", iterations_, " iterations");
+            instrumentation_.logPhases();
+        }
+
+        inline const std::vector<int> &getLabels() const
+        {
+            return labels_;
+        }
+
+        /// @brief Whether the last fit stopped because the exemplar set stabilized
+        inline bool hasConverged() const
+        {
+            return converged_;
+        }
+
+        /// @brief Number of message passing iterations the last fit used
+        inline unsigned int getIterations() const
+        {
+            return iterations_;
+        }
+
+        /// @brief Timers, counters and per-iteration statistics of the last fit, also where verbosity is configured
+        inline Instrumentation &getInstrumentation()
+        {
+            return instrumentation_;
+        }
+
+        inline std::vector<int> getUniqueClusters()
+        {
+            std::vector<int> lbls_(labels_);
+            std::sort(lbls_.begin(), lbls_.end());
+            auto last = std::unique(lbls_.begin(), lbls_.end());
+            lbls_.erase(last, lbls_.end());
+            return lbls_;
+        }
+
+    private:
+        inline void initialize()
+        {
+            size_t n = similarities_.rows();
+            size_t nnz = similarities_.nonZeros();
+
+            diagonal_.resize(n);
+            for (size_t i = 0; i < n; ++i)
+            {
+                diagonal_[i] = similarities_.diagonalIndex(i);
+                if (diagonal_[i] == nnz)
+                {
+                    throw std::invalid_argument("Sparse similarity graph has to store every diagonal entry");
+                }
+            }
+
+            similarities_.columnIndex(col_offsets_, col_edges_);
+            responsibilities_.assign(nnz, 0.0);
+            availabilities_.assign(nnz, 0.0);
+            exemplars_.assign(n, 0);
+            exemplar_count_ = 0;
+
+            instrumentation_.log(Verbosity::Summary, "Prepared messages for ", nnz, " edges");
+        }
+
+        /// @return largest change of a responsibility when deltas are tracked, NaN otherwise
+        inline double updateResponsibility()
+        {
+            unsigned int n = similarities_.rows();
+            const std::vector<double> &s = similarities_.values();
+            bool track = instrumentation_.trackDeltas();
+            std::atomic<double> delta{0.0};
+
+            // Same top-2 trick as the dense kernel, restricted to the edges stored in row i
+            thread_pool_.parallel_for(0, n, Threading::grainSize(thread_pool_, n),
+                [&](size_t begin, size_t end)
+                {
+                    std::vector<double> old;
+                    double task_delta = 0.0;
+                    for (unsigned int i = begin; i < end; ++i)
+                    {
+                        size_t row_begin = similarities_.rowBegin(i);
+                        size_t row_size = similarities_.rowEnd(i) - row_begin;
+                        double *r = &responsibilities_[row_begin];
+                        if (track)
+                            old.assign(r, r + row_size);
+
+                        double first, second;
+                        simd_.rowTop2(&availabilities_[row_begin], &s[row_begin], row_size, first, second);
+                        simd_.responsibilityRow(&s[row_begin], &availabilities_[row_begin], r, row_size, first, second, damping_);
+
+                        if (track)
+                            task_delta = std::max(task_delta, maxAbsDifference(old.data(), r, row_size));
+                    }
+                    if (track)
+                        atomicMax(delta, task_delta);
+                });
+
+            return track ? delta.load() : std::numeric_limits<double>::quiet_NaN();
+        }
+
+        /// @return largest change of an availability when deltas are tracked, NaN otherwise
+        inline double updateAvailability()
+        {
+            unsigned int n = similarities_.rows();
+            bool track = instrumentation_.trackDeltas();
+            std::atomic<double> delta{0.0};
+
+            // Column sums of positive responsibilities over the edges stored in column k
+            thread_pool_.parallel_for(0, n, Threading::grainSize(thread_pool_, n),
+                [&](size_t begin, size_t end)
+                {
+                    double task_delta = 0.0;
+                    for (unsigned int k = begin; k < end; ++k)
+                    {
+                        size_t kk = diagonal_[k];
+                        double rkk = responsibilities_[kk];
+                        double sum = 0.0;
+
+                        for (size_t c = col_offsets_[k]; c < col_offsets_[k + 1]; ++c)
+                        {
+                            sum += std::max(0.0, responsibilities_[col_edges_[c]]);
+                        }
+                        sum -= std::max(0.0, rkk);
+
+                        for (size_t c = col_offsets_[k]; c < col_offsets_[k + 1]; ++c)
+                        {
+                            size_t e = col_edges_[c];
+                            double value = (e == kk) ? sum : std::min(0.0, rkk + sum - std::max(0.0, responsibilities_[e]));
+                            double updated = damping_ * availabilities_[e] + (1.0 - damping_) * value;
+                            task_delta = std::max(task_delta, std::abs(updated - availabilities_[e]));
+                            availabilities_[e] = updated;
+                        }
+                    }
+                    if (track)
+                        atomicMax(delta, task_delta);
+                });
+
+            return track ? delta.load() : std::numeric_limits<double>::quiet_NaN();
+        }
+
+        /// @brief Recompute the exemplar set from the diagonal, point k is an exemplar when r(k,k) + a(k,k) > 0
+        /// @return number of points that joined or left the exemplar set
+        inline unsigned int updateExemplars()
+        {
+            unsigned int n = similarities_.rows();
+            unsigned int changed = 0;
+            exemplar_count_ = 0;
+
+            for (unsigned int k = 0; k < n; ++k)
+            {
+                char is_exemplar = responsibilities_[diagonal_[k]] + availabilities_[diagonal_[k]] > 0.0;
+                changed += is_exemplar != exemplars_[k];
+                exemplars_[k] = is_exemplar;
+                exemplar_count_ += is_exemplar;
+            }
+
+            return changed;
+        }
+
+        inline void identifyClusters()
+        {
+            unsigned int n = similarities_.rows();
+            const std::vector<unsigned int> &columns = similarities_.columns();
+
+            labels_.assign(n, -1);
+            for (unsigned int i = 0; i < n; ++i)
+            {
+                size_t row_begin = similarities_.rowBegin(i);
+                size_t row_size = similarities_.rowEnd(i) - row_begin;
+                size_t e = row_begin + simd_.argmaxSum(&responsibilities_[row_begin], &availabilities_[row_begin], row_size);
+                labels_[i] = columns[e];
+            }
+        }
+
+    private:
+        Threading::ThreadPool thread_pool_{};
+        const Simd::Kernels &simd_ = Simd::best();
+        const SparseMatrix &similarities_;
+        unsigned int max_iter_;
+        double damping_;
+        unsigned int convergence_iter_;
+        bool converged_ = false;
+        unsigned int iterations_ = 0;
+        Instrumentation instrumentation_;
+
+        std::vector<size_t> diagonal_;
+        std::vector<size_t> col_offsets_;
+        std::vector<size_t> col_edges_;
+        std::vector<double> responsibilities_;
+        std::vector<double> availabilities_;
+        std::vector<int> labels_;
+        std::vector<char> exemplars_;
+        unsigned int exemplar_count_ = 0;
+    };
+}
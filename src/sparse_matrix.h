@@ -0,0 +1,84 @@
+#pragma once
+#include <vector>
+#include <span>
+#include <stdexcept>
+#include <algorithm>
+
+namespace AP
+{
+    /// @brief Square sparse matrix in compressed sparse row (CSR) format.
+    ///        Entries of row i are stored at [rowBegin(i), rowEnd(i)) with ascending column indices
+    class SparseMatrix
+    {
+    public:
+        SparseMatrix() = default;
+
+        SparseMatrix(size_t rows, std::vector<size_t> row_offsets, std::vector<unsigned int> columns, std::vector<double> values)
+            : rows_(rows), row_offsets_(std::move(row_offsets)), columns_(std::move(columns)), values_(std::move(values))
+        {
+            if (row_offsets_.size() != rows_ + 1 || columns_.size() != values_.size() || row_offsets_.back() != values_.size())
+            {
+                throw std::invalid_argument("Inconsistent CSR arrays");
+            }
+        }
+
+        inline size_t rows() const { return rows_; }
+        inline size_t nonZeros() const { return values_.size(); }
+
+        inline size_t rowBegin(size_t i) const { return row_offsets_[i]; }
+        inline size_t rowEnd(size_t i) const { return row_offsets_[i + 1]; }
+
+        inline const std::vector<size_t> &rowOffsets() const { return row_offsets_; }
+        inline const std::vector<unsigned int> &columns() const { return columns_; }
+        inline const std::vector<double> &values() const { return values_; }
+        inline std::vector<double> &values() { return values_; }
+
+        inline std::span<const unsigned int> rowColumns(size_t i) const
+        {
+            return std::span<const unsigned int>(columns_.data() + rowBegin(i), rowEnd(i) - rowBegin(i));
+        }
+
+        inline std::span<const double> rowValues(size_t i) const
+        {
+            return std::span<const double>(values_.data() + rowBegin(i), rowEnd(i) - rowBegin(i));
+        }
+
+        /// @brief Index of the stored entry (i, i), or nonZeros() if the diagonal is not stored
+        inline size_t diagonalIndex(size_t i) const
+        {
+            auto cols = rowColumns(i);
+            auto it = std::lower_bound(cols.begin(), cols.end(), static_cast<unsigned int>(i));
+            if (it == cols.end() || *it != i)
+                return nonZeros();
+            return rowBegin(i) + (it - cols.begin());
+        }
+
+        /// @brief Build a column index, entries of column k are edges[col_offsets[k] .. col_offsets[k + 1]),
+        ///        where each edge is a position into values()
+        inline void columnIndex(std::vector<size_t> &col_offsets, std::vector<size_t> &edges) const
+        {
+            col_offsets.assign(rows_ + 1, 0);
+            for (unsigned int col : columns_)
+            {
+                ++col_offsets[col + 1];
+            }
+            for (size_t k = 0; k < rows_; ++k)
+            {
+                col_offsets[k + 1] += col_offsets[k];
+            }
+
+            edges.resize(nonZeros());
+            std::vector<size_t> cursor(col_offsets.begin(), col_offsets.end() - 1);
+            for (size_t e = 0; e < nonZeros(); ++e)
+            {
+                edges[cursor[columns_[e]]++] = e;
+            }
+        }
+
+    private:
+        size_t rows_ = 0;
+        std::vector<size_t> row_offsets_{0};
+        std::vector<unsigned int> columns_;
+        std::vector<double> values_;
+    };
+}
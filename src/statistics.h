@@ -0,0 +1,283 @@
+#pragma once
+#include <vector>
+#include <mutex>
+#include <limits>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include "matrix.h"
+#include "packed_matrix.h"
+#include "threadpool.h"
+
+namespace AP
+{
+    namespace Math
+    {
+        /// @brief Result of a fused statistics pass, see summarize()
+        struct Summary
+        {
+            double min = std::numeric_limits<double>::infinity();
+            double max = -std::numeric_limits<double>::infinity();
+            double mean = 0.0;
+            size_t count = 0;
+        };
+
+        /// @brief Rows handed to a single task, leaving several tasks per worker to steal
+        inline size_t statisticsGrain(const Threading::ThreadPool &pool, size_t rows)
+        {
+            return std::max<size_t>(1, rows / (8 * std::max<size_t>(1, pool.size())));
+        }
+
+        /// @brief Call fn(value) for every element of row i, skipping (i, i) when requested.
+        ///        Values are passed as double whatever the storage type
+        template <typename T, typename F>
+        inline void forEachInRow(const BasicMatrixView<T> &m, size_t i, bool skip_diagonal, F &&fn)
+        {
+            const T *row = m.row(i).data();
+            size_t cols = m.cols();
+            if (skip_diagonal && i < cols)
+            {
+                for (size_t j = 0; j < i; ++j)
+                    fn(row[j]);
+                for (size_t j = i + 1; j < cols; ++j)
+                    fn(row[j]);
+            }
+            else
+            {
+                for (size_t j = 0; j < cols; ++j)
+                    fn(row[j]);
+            }
+        }
+
+        /// @brief Call fn(value) for every entry of row i on and above the diagonal, leaving out (i, i) when requested.
+        ///        Over all rows this visits every pair once, which gives the off-diagonal statistics of the full matrix:
+        ///        each value appears twice there, so min, max, mean and the quantile of rank floor(q * count) are the same
+        template <typename T, typename F>
+        inline void forEachInRow(const BasicPackedSymmetricMatrix<T> &m, size_t i, bool skip_diagonal, F &&fn)
+        {
+            constexpr size_t BLOCK = BasicPackedSymmetricMatrix<T>::BLOCK;
+            if (!skip_diagonal)
+                fn(m.diagonal()[i]);
+
+            size_t rb = i / BLOCK;
+            size_t a = i % BLOCK;
+            for (size_t cb = rb; cb < m.blocksPerSide(); ++cb)
+            {
+                auto row = m.block(rb, cb).row(a);
+                for (size_t b = cb == rb ? a + 1 : 0; b < row.size(); ++b)
+                    fn(row[b]);
+            }
+        }
+
+        /// @brief Number of values forEachInRow() visits in row i
+        template <typename T>
+        inline size_t valuesInRow(const BasicMatrixView<T> &m, size_t i, bool skip_diagonal)
+        {
+            return m.cols() - (skip_diagonal && i < m.cols() ? 1 : 0);
+        }
+
+        template <typename T>
+        inline size_t valuesInRow(const BasicPackedSymmetricMatrix<T> &m, size_t i, bool skip_diagonal)
+        {
+            return m.size() - i - (skip_diagonal ? 1 : 0);
+        }
+
+        /// @brief Min, max and mean of the matrix in one parallel pass without copying it
+        /// @tparam M BasicMatrixView or BasicPackedSymmetricMatrix, anything forEachInRow() accepts
+        /// @param skip_diagonal leave out the (i, i) entries, which hold the preferences of a similarity matrix
+        template <typename M>
+        inline Summary summarize(const M &m, Threading::ThreadPool &pool, bool skip_diagonal = true)
+        {
+            // Fixed row blocks with one partial result each, merged in order, so the mean does not depend on scheduling
+            size_t rows = m.rows();
+            size_t grain = statisticsGrain(pool, rows);
+            size_t blocks = (rows + grain - 1) / grain;
+            std::vector<Summary> partial(blocks);
+            std::vector<double> sums(blocks, 0.0);
+
+            pool.parallel_for(0, blocks, 1,
+                [&](size_t first_block, size_t last_block)
+                {
+                    for (size_t b = first_block; b < last_block; ++b)
+                    {
+                        Summary &s = partial[b];
+                        double sum = 0.0;
+                        for (size_t i = b * grain; i < std::min(rows, (b + 1) * grain); ++i)
+                        {
+                            forEachInRow(m, i, skip_diagonal,
+                                [&](double value)
+                                {
+                                    s.min = std::min(s.min, value);
+                                    s.max = std::max(s.max, value);
+                                    sum += value;
+                                    ++s.count;
+                                });
+                        }
+                        sums[b] = sum;
+                    }
+                });
+
+            Summary result;
+            double sum = 0.0;
+            for (size_t b = 0; b < blocks; ++b)
+            {
+                result.min = std::min(result.min, partial[b].min);
+                result.max = std::max(result.max, partial[b].max);
+                result.count += partial[b].count;
+                sum += sums[b];
+            }
+            result.mean = result.count > 0 ? sum / result.count : 0.0;
+            return result;
+        }
+
+        /// @brief Position of the q-quantile among count sorted values, floor(q * count) clamped to the last one
+        inline size_t quantileRank(size_t count, double q)
+        {
+            return count == 0 ? 0 : std::min(count - 1, static_cast<size_t>(std::clamp(q, 0.0, 1.0) * count));
+        }
+
+        /// @brief Map a double to an unsigned key with the same ordering
+        inline uint64_t orderedKey(double value)
+        {
+            uint64_t bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            constexpr uint64_t sign = uint64_t(1) << 63;
+            return (bits & sign) ? ~bits : bits | sign;
+        }
+
+        /// @brief Exact q-quantile, the element of rank floor(q * count) in ascending order, without copying the matrix.
+        ///        Radix selection on the ordered bit patterns: every pass histograms the next 11 bits of the elements
+        ///        that share the prefix found so far, in parallel, and once few enough candidates remain they are
+        ///        gathered and finished with nth_element. Usually two passes over the matrix suffice
+        /// @tparam M BasicMatrixView or BasicPackedSymmetricMatrix, anything forEachInRow() accepts
+        /// @param q quantile in [0, 1], 0.5 gives the upper median like Math::median
+        /// @param skip_diagonal leave out the (i, i) entries, which hold the preferences of a similarity matrix
+        template <typename M>
+        inline double quantile(const M &m, double q, Threading::ThreadPool &pool, bool skip_diagonal = true)
+        {
+            constexpr unsigned int digit_bits = 11;
+            constexpr size_t buckets = size_t(1) << digit_bits;
+            constexpr size_t gather_limit = size_t(1) << 20;
+
+            size_t rows = m.rows();
+            size_t count = 0;
+            for (size_t i = 0; i < rows; ++i)
+            {
+                count += valuesInRow(m, i, skip_diagonal);
+            }
+            if (count == 0)
+            {
+                return 0.0;
+            }
+
+            size_t rank = quantileRank(count, q);
+            size_t grain = statisticsGrain(pool, rows);
+            std::mutex mutex;
+
+            uint64_t prefix = 0;
+            unsigned int prefix_bits = 0;
+            size_t candidates = count;
+
+            while (candidates > gather_limit && prefix_bits < 64)
+            {
+                unsigned int shift = 64 - std::min(64u, prefix_bits + digit_bits);
+                unsigned int width = 64 - prefix_bits - shift;
+                uint64_t digit_mask = (uint64_t(1) << width) - 1;
+                std::vector<size_t> histogram(buckets, 0);
+
+                pool.parallel_for(0, rows, grain,
+                    [&](size_t begin, size_t end)
+                    {
+                        std::vector<size_t> local(buckets, 0);
+                        for (size_t i = begin; i < end; ++i)
+                        {
+                            forEachInRow(m, i, skip_diagonal,
+                                [&](double value)
+                                {
+                                    uint64_t key = orderedKey(value);
+                                    if (prefix_bits == 0 || (key >> (64 - prefix_bits)) == prefix)
+                                        ++local[(key >> shift) & digit_mask];
+                                });
+                        }
+                        std::lock_guard<std::mutex> lock(mutex);
+                        for (size_t b = 0; b < buckets; ++b)
+                            histogram[b] += local[b];
+                    });
+
+                size_t digit = 0;
+                while (rank >= histogram[digit])
+                {
+                    rank -= histogram[digit];
+                    ++digit;
+                }
+                prefix = (prefix << width) | digit;
+                prefix_bits += width;
+                candidates = histogram[digit];
+            }
+
+            if (prefix_bits == 64)
+            {
+                // every remaining candidate has the same bit pattern
+                uint64_t bits = (prefix & (uint64_t(1) << 63)) ? prefix & ~(uint64_t(1) << 63) : ~prefix;
+                double value;
+                std::memcpy(&value, &bits, sizeof(value));
+                return value;
+            }
+
+            std::vector<double> gathered;
+            gathered.reserve(candidates);
+            pool.parallel_for(0, rows, grain,
+                [&](size_t begin, size_t end)
+                {
+                    std::vector<double> local;
+                    for (size_t i = begin; i < end; ++i)
+                    {
+                        forEachInRow(m, i, skip_diagonal,
+                            [&](double value)
+                            {
+                                if (prefix_bits == 0 || (orderedKey(value) >> (64 - prefix_bits)) == prefix)
+                                    local.push_back(value);
+                            });
+                    }
+                    std::lock_guard<std::mutex> lock(mutex);
+                    gathered.insert(gathered.end(), local.begin(), local.end());
+                });
+
+            std::nth_element(gathered.begin(), gathered.begin() + rank, gathered.end());
+            return gathered[rank];
+        }
+
+        /// @brief Exact median, the upper one for an even count, see quantile()
+        template <typename M>
+        inline double median(const M &m, Threading::ThreadPool &pool, bool skip_diagonal = true)
+        {
+            return quantile(m, 0.5, pool, skip_diagonal);
+        }
+
+        /// @brief Preference a diagonal policy gives for a similarity matrix, from its off-diagonal entries
+        /// @param percentile percentile in [0, 100] used by the Percentile policy
+        template <typename M>
+        inline double preference(const M &m, Diagonal diagonal, double percentile, Threading::ThreadPool &pool)
+        {
+            switch (diagonal)
+            {
+            case Min:
+                return summarize(m, pool).min;
+            case Max:
+                return summarize(m, pool).max;
+            case Median:
+                return median(m, pool);
+            case Percentile:
+                return quantile(m, percentile / 100.0, pool);
+            case Inf:
+                return std::numeric_limits<double>::infinity();
+            case NegInf:
+                return -std::numeric_limits<double>::infinity();
+            case Zero:
+            default:
+                return 0.0;
+            }
+        }
+    }
+}
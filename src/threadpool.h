@@ -2,45 +2,146 @@
 #include <thread>
 #include <mutex>
 #include <vector>
-#include <condition_variable>
-#include <queue>
-#include <functional>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <cstdint>
+#include <chrono>
+#include <pthread.h>
+#include "topology.h"
 
 namespace Threading
 {
-    /// @brief Class representing a thread pool, allowing for job submition
+    /// @brief Completion counter for a set of tasks. Waiting on it blocks without spinning.
+    ///        Waiters sleep on a counter of the pool, so the last task never touches the group once it is complete
+    class TaskGroup
+    {
+    public:
+        TaskGroup() = default;
+        TaskGroup(const TaskGroup &) = delete;
+        TaskGroup &operator=(const TaskGroup &) = delete;
+
+        /// @brief true once every task added to the group has finished, from then on the group can be destroyed
+        inline bool done() const
+        {
+            return pending.load(std::memory_order_acquire) == 0;
+        }
+
+    private:
+        friend class ThreadPool;
+
+        inline void add(size_t count = 1)
+        {
+            pending.fetch_add(count, std::memory_order_relaxed);
+        }
+
+        /// @return true for the task that completed the group, a waiter may destroy it right after
+        inline bool finish()
+        {
+            return pending.fetch_sub(1, std::memory_order_acq_rel) == 1;
+        }
+
+        std::atomic<size_t> pending{0};
+    };
+
+    /// @brief Work stealing thread pool.
+    ///        Every worker owns a deque of range tasks. A worker pops from the back of its own deque
+    ///        and, when that is empty, steals from the front of another worker's deque.
+    ///        Tasks are plain structs pointing at a caller-owned functor, so submitting work never allocates
     class ThreadPool
     {
     public:
-        /// @brief Start a threadpool
+        /// @brief Activity since the pool was last started
+        struct Stats
+        {
+            size_t workers = 0;
+            /// @brief Tasks run, including those run by threads waiting on a group
+            uint64_t tasks = 0;
+            /// @brief Tasks a worker took from another worker's deque
+            uint64_t steals = 0;
+            /// @brief Deepest any single deque got
+            size_t max_queue_depth = 0;
+            /// @brief Time workers spent asleep waiting for work, summed over workers
+            double idle_ms = 0.0;
+            Affinity affinity = Affinity::None;
+            /// @brief CPU every worker is pinned to, empty when the workers are not pinned
+            std::vector<int> cpus;
+        };
+
+        ThreadPool() = default;
+        ThreadPool(const ThreadPool &) = delete;
+        ThreadPool &operator=(const ThreadPool &) = delete;
+
+        ~ThreadPool()
+        {
+            if (!threads.empty())
+                stop();
+        }
+
+        /// @brief Number of workers every pool starts with, 0 starts one per hardware thread
+        static inline void setDefaultThreadCount(uint32_t count)
+        {
+            default_thread_count.store(count);
+        }
+
+        /// @brief Placement of the workers of every pool started afterwards
+        static inline void setDefaultAffinity(Affinity affinity)
+        {
+            default_affinity.store(affinity);
+        }
+
+        static inline Affinity defaultAffinity()
+        {
+            return default_affinity.load();
+        }
+
+        static inline uint32_t defaultThreadCount()
+        {
+            uint32_t count = default_thread_count.load();
+            return count > 0 ? count : std::max(1u, std::thread::hardware_concurrency());
+        }
+
+        /// @brief Start a threadpool with defaultThreadCount() workers
         inline void start()
         {
-            const uint32_t num_threads = std::thread::hardware_concurrency();
+            start(defaultThreadCount());
+        }
+
+        /// @brief Start a threadpool with the given number of workers, with 0 every call runs on the calling thread
+        inline void start(uint32_t num_threads)
+        {
+            should_terminate.store(false);
+            external_tasks.store(0);
+            queues.clear();
             for (uint32_t ii = 0; ii < num_threads; ++ii)
             {
-                threads.emplace_back(std::thread(&thread_loop, this));
+                queues.emplace_back(std::make_unique<WorkQueue>());
+            }
+            for (uint32_t ii = 0; ii < num_threads; ++ii)
+            {
+                threads.emplace_back(&ThreadPool::thread_loop, this, ii);
             }
-        }
 
-        /// @brief Submit a job
-        /// @param job instance of a job
-        inline void queue_job(const std::function<void()> &job)
-        {
+            affinity = defaultAffinity();
+            cpus.clear();
+            std::vector<int> order = Topology::current().order(affinity);
+            for (uint32_t ii = 0; ii < num_threads && !order.empty(); ++ii)
             {
-                std::unique_lock<std::mutex> lock(queue_mutex);
-                jobs.push(job);
+                // More workers than CPUs wrap around, so a node never gets more than its share
+                int cpu = order[ii % order.size()];
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(cpu, &set);
+                pthread_setaffinity_np(threads[ii].native_handle(), sizeof(set), &set);
+                cpus.push_back(cpu);
             }
-            mutex_condition.notify_one();
         }
 
-        /// @brief Stop the threadpool
+        /// @brief Stop the threadpool, all submitted work has to be waited for beforehand
         inline void stop()
         {
-            {
-                std::unique_lock<std::mutex> lock(queue_mutex);
-                should_terminate = true;
-            }
-            mutex_condition.notify_all();
+            should_terminate.store(true);
+            wake(true);
             for (std::thread &active_thread : threads)
             {
                 active_thread.join();
@@ -48,52 +149,370 @@ namespace Threading
             threads.clear();
         }
 
-        /// @brief  The busy function can be used in a while loop,
-        ///         such that the main thread can wait the threadpool
-        ///         to complete all the tasks before calling the threadpool destructor
-        /// @return true if busy else false
-        inline bool busy()
+        /// @brief Number of worker threads
+        inline size_t size() const
+        {
+            return threads.size();
+        }
+
+        /// @brief Counters of the current or, after stop(), the last run of the pool
+        inline Stats stats() const
         {
-            bool poolbusy;
+            Stats result;
+            result.workers = queues.size();
+            result.affinity = affinity;
+            result.cpus = cpus;
+            result.tasks = external_tasks.load(std::memory_order_relaxed);
+            for (const auto &queue : queues)
             {
-                std::unique_lock<std::mutex> lock(queue_mutex);
-                poolbusy = !jobs.empty();
+                result.tasks += queue->tasks.load(std::memory_order_relaxed);
+                result.steals += queue->steals.load(std::memory_order_relaxed);
+                result.idle_ms += queue->idle_ns.load(std::memory_order_relaxed) / 1e6;
+                std::lock_guard<std::mutex> lock(queue->mutex);
+                result.max_queue_depth = std::max(result.max_queue_depth, queue->max_count);
             }
-            return poolbusy;
+            return result;
         }
 
-        inline void wait()
+        /// @brief Run fn(chunk_begin, chunk_end) over disjoint chunks covering [begin, end) and block until all are done.
+        ///        The range is split in halves until chunks are no larger than grain, idle workers steal the larger halves
+        /// @param begin first index
+        /// @param end one past the last index
+        /// @param grain largest chunk handed to a single call of fn
+        /// @param fn callable taking (size_t chunk_begin, size_t chunk_end)
+        template <typename F>
+        inline void parallel_for(size_t begin, size_t end, size_t grain, F &&fn)
         {
-            while (busy())
-                continue;
+            if (begin >= end)
+                return;
+            grain = std::max<size_t>(1, grain);
+
+            if (threads.empty() || end - begin <= grain)
+            {
+                fn(begin, end);
+                return;
+            }
+
+            TaskGroup group;
+            submit(group, begin, end, grain, fn, &invoke_range<std::remove_reference_t<F>>);
+            wait(group);
         }
 
-    private:
-        inline void thread_loop()
+        /// @brief Run fn(chunk_begin, chunk_end) over one contiguous chunk of [begin, end) per worker and block until all are done.
+        ///        Chunk w always runs on worker w and is never stolen, so calls over the same range with the same number of workers
+        ///        give every worker the same indices. Memory a worker touches first this way is placed on its NUMA node and stays there
+        /// @param fn callable taking (size_t chunk_begin, size_t chunk_end)
+        template <typename F>
+        inline void parallel_for_static(size_t begin, size_t end, F &&fn)
+        {
+            if (begin >= end)
+                return;
+            if (threads.empty())
+            {
+                fn(begin, end);
+                return;
+            }
+
+            TaskGroup group;
+            size_t count = end - begin;
+            size_t workers = queues.size();
+            for (size_t w = 0; w < workers; ++w)
+            {
+                size_t chunk_begin = begin + count * w / workers;
+                size_t chunk_end = begin + count * (w + 1) / workers;
+                if (chunk_begin == chunk_end)
+                    continue;
+                group.add();
+                queues[w]->push_pinned(Task{&invoke_range<std::remove_reference_t<F>>, &fn, chunk_begin, chunk_end, chunk_end - chunk_begin, &group});
+            }
+            wake(true);
+            wait(group);
+        }
+
+        /// @brief Run fn() once on a worker and count it in group. fn must stay alive until wait(group) returns
+        template <typename F>
+        inline void run(TaskGroup &group, F &fn)
+        {
+            if (threads.empty())
+            {
+                fn();
+                return;
+            }
+            submit(group, 0, 1, 1, fn, &invoke_once<F>);
+        }
+
+        /// @brief parallel_for() without the wait: queue fn(chunk_begin, chunk_end) over [begin, end) counted in group and return.
+        ///        Tasks of the group may spawn more work into it, wait(group) returns once all of it has finished.
+        ///        fn must stay alive until then
+        template <typename F>
+        inline void spawn(TaskGroup &group, size_t begin, size_t end, size_t grain, F &fn)
+        {
+            if (begin >= end)
+                return;
+            grain = std::max<size_t>(1, grain);
+            if (threads.empty())
+            {
+                fn(begin, end);
+                return;
+            }
+            submit(group, begin, end, grain, fn, &invoke_range<F>);
+        }
+
+        /// @brief Block until every task of the group has finished.
+        ///        The waiting thread executes pending tasks itself while there are any
+        inline void wait(TaskGroup &group)
         {
             while (true)
             {
-                std::function<void()> job;
+                // Read before the group, a completion after it changes the value and the wait below returns
+                uint64_t completed = completions.load(std::memory_order_acquire);
+                if (group.done())
+                    break;
+
+                Task task;
+                size_t index = current_index();
+                if (try_acquire(index, task))
+                {
+                    if (index == NO_WORKER)
+                        external_tasks.fetch_add(1, std::memory_order_relaxed);
+                    else
+                        queues[index]->tasks.fetch_add(1, std::memory_order_relaxed);
+                    execute(task);
+                }
+                else
                 {
-                    std::unique_lock<std::mutex> lock(queue_mutex);
-                    mutex_condition.wait(lock, [this]
-                                         { return !jobs.empty() || should_terminate; });
-                    if (should_terminate)
+                    completions.wait(completed, std::memory_order_acquire);
+                }
+            }
+        }
+
+    private:
+        struct Task
+        {
+            void (*invoke)(const void *fn, size_t begin, size_t end) = nullptr;
+            const void *fn = nullptr;
+            size_t begin = 0;
+            size_t end = 0;
+            size_t grain = 1;
+            TaskGroup *group = nullptr;
+        };
+
+        /// @brief Ring buffer deque guarded by its own lock, it only allocates when it has to grow
+        struct WorkQueue
+        {
+            std::mutex mutex;
+            std::vector<Task> ring = std::vector<Task>(64);
+            size_t head = 0;
+            size_t count = 0;
+            size_t max_count = 0;
+            /// @brief Tasks only the owning worker may run, see parallel_for_static
+            std::vector<Task> pinned;
+
+            // statistics of the worker owning the deque
+            std::atomic<uint64_t> tasks{0};
+            std::atomic<uint64_t> steals{0};
+            std::atomic<uint64_t> idle_ns{0};
+
+            inline void push_back(const Task &task)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (count == ring.size())
+                {
+                    std::vector<Task> grown(ring.size() * 2);
+                    for (size_t ii = 0; ii < count; ++ii)
                     {
-                        return;
+                        grown[ii] = ring[(head + ii) % ring.size()];
                     }
-                    job = jobs.front();
-                    jobs.pop();
+                    ring.swap(grown);
+                    head = 0;
                 }
-                job();
+                ring[(head + count) % ring.size()] = task;
+                ++count;
+                max_count = std::max(max_count, count);
             }
+
+            inline void push_pinned(const Task &task)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                pinned.push_back(task);
+            }
+
+            inline bool pop_pinned(Task &task)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (pinned.empty())
+                    return false;
+                task = pinned.back();
+                pinned.pop_back();
+                return true;
+            }
+
+            inline bool pop_back(Task &task)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (count == 0)
+                    return false;
+                --count;
+                task = ring[(head + count) % ring.size()];
+                return true;
+            }
+
+            inline bool pop_front(Task &task)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (count == 0)
+                    return false;
+                task = ring[head];
+                head = (head + 1) % ring.size();
+                --count;
+                return true;
+            }
+        };
+
+        static constexpr size_t NO_WORKER = static_cast<size_t>(-1);
+
+        template <typename F>
+        static inline void invoke_range(const void *fn, size_t begin, size_t end)
+        {
+            (*static_cast<F *>(const_cast<void *>(fn)))(begin, end);
+        }
+
+        template <typename F>
+        static inline void invoke_once(const void *fn, size_t, size_t)
+        {
+            (*static_cast<F *>(const_cast<void *>(fn)))();
         }
 
-        bool should_terminate = false;
-        std::mutex queue_mutex;
-        std::condition_variable mutex_condition;
+        /// @brief Index of the calling worker in this pool, NO_WORKER for outside threads
+        inline size_t current_index() const
+        {
+            return current_pool == this ? current_worker : NO_WORKER;
+        }
+
+        template <typename F>
+        inline void submit(TaskGroup &group, size_t begin, size_t end, size_t grain, F &fn, void (*invoke)(const void *, size_t, size_t))
+        {
+            group.add();
+            push(Task{invoke, &fn, begin, end, grain, &group});
+        }
+
+        inline void push(const Task &task)
+        {
+            size_t index = current_index();
+            if (index == NO_WORKER)
+            {
+                index = next_queue.fetch_add(1, std::memory_order_relaxed) % queues.size();
+            }
+            queues[index]->push_back(task);
+            wake(false);
+        }
+
+        /// @brief Publish new work. Workers bump sleeping before blocking on epoch and we bump epoch
+        ///        before reading sleeping, so either the worker sees the new epoch or we see the sleeper
+        inline void wake(bool all)
+        {
+            epoch.fetch_add(1);
+            if (all)
+                epoch.notify_all();
+            else if (sleeping.load() > 0)
+                epoch.notify_one();
+        }
+
+        /// @brief Take a task pinned to us or pop from our own deque, otherwise steal from the others starting after us
+        inline bool try_acquire(size_t index, Task &task)
+        {
+            if (index != NO_WORKER && (queues[index]->pop_pinned(task) || queues[index]->pop_back(task)))
+                return true;
+
+            size_t start = index == NO_WORKER ? 0 : index + 1;
+            for (size_t ii = 0; ii < queues.size(); ++ii)
+            {
+                size_t victim = (start + ii) % queues.size();
+                if (victim != index && queues[victim]->pop_front(task))
+                {
+                    if (index != NO_WORKER)
+                        queues[index]->steals.fetch_add(1, std::memory_order_relaxed);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /// @brief Split the task down to its grain, publishing the upper halves for thieves, then run the rest
+        inline void execute(Task task)
+        {
+            while (task.end - task.begin > task.grain)
+            {
+                size_t mid = task.begin + (task.end - task.begin) / 2;
+                Task upper = task;
+                upper.begin = mid;
+                task.group->add();
+                push(upper);
+                task.end = mid;
+            }
+            task.invoke(task.fn, task.begin, task.end);
+            if (task.group->finish())
+            {
+                completions.fetch_add(1, std::memory_order_release);
+                completions.notify_all();
+            }
+        }
+
+        inline void thread_loop(size_t index)
+        {
+            current_pool = this;
+            current_worker = index;
+
+            while (true)
+            {
+                uint64_t observed = epoch.load();
+                Task task;
+                if (try_acquire(index, task))
+                {
+                    queues[index]->tasks.fetch_add(1, std::memory_order_relaxed);
+                    execute(task);
+                    continue;
+                }
+                if (should_terminate.load())
+                {
+                    break;
+                }
+                auto idle_start = std::chrono::steady_clock::now();
+                sleeping.fetch_add(1);
+                epoch.wait(observed);
+                sleeping.fetch_sub(1);
+                auto idle = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - idle_start);
+                queues[index]->idle_ns.fetch_add(idle.count(), std::memory_order_relaxed);
+            }
+
+            current_pool = nullptr;
+            current_worker = NO_WORKER;
+        }
+
+        static inline std::atomic<uint32_t> default_thread_count{0};
+        static inline std::atomic<Affinity> default_affinity{Affinity::None};
+        static inline thread_local const ThreadPool *current_pool = nullptr;
+        static inline thread_local size_t current_worker = NO_WORKER;
+
+        std::atomic<bool> should_terminate{false};
+        std::atomic<uint64_t> epoch{0};
+        std::atomic<uint32_t> sleeping{0};
+        std::atomic<size_t> next_queue{0};
+        std::atomic<uint64_t> external_tasks{0};
+        /// @brief Groups completed so far, waiters on any group sleep on it so no task touches a group after completing it
+        std::atomic<uint64_t> completions{0};
+        std::vector<std::unique_ptr<WorkQueue>> queues;
         std::vector<std::thread> threads;
-        std::queue<std::function<void()>> jobs;
+        Affinity affinity = Affinity::None;
+        std::vector<int> cpus;
     };
 
-} // namespace threading
\ No newline at end of file
+    /// @brief Grain for ThreadPool::parallel_for() over count rows, strips or columns,
+    ///        leaving several tasks per worker to steal
+    inline size_t grainSize(const ThreadPool &pool, size_t count)
+    {
+        size_t tasks = 8 * std::max<size_t>(1, pool.size());
+        return std::max<size_t>(1, count / tasks);
+    }
+
+} // namespace threading
@@ -0,0 +1,161 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <sched.h>
+
+namespace Threading
+{
+    /// @brief Where the workers of a thread pool are placed
+    enum class Affinity
+    {
+        /// Workers are left to the scheduler, the default
+        None,
+        /// Worker after worker fills the CPUs of one NUMA node before moving on to the next
+        Compact,
+        /// Consecutive workers go to different NUMA nodes in turn
+        Scatter
+    };
+
+    inline const char *name(Affinity affinity)
+    {
+        static const char *names[] = {"none", "compact", "scatter"};
+        return names[static_cast<size_t>(affinity)];
+    }
+
+    /// @brief NUMA nodes and the CPUs this process may run on in each of them, read from sysfs.
+    ///        Without NUMA information every allowed CPU counts as one node
+    class Topology
+    {
+    public:
+        /// @brief Topology of the machine, detected on first use
+        static inline const Topology &current()
+        {
+            static const Topology topology = detect();
+            return topology;
+        }
+
+        /// @brief Allowed CPUs of every node that has any, in ascending order
+        inline const std::vector<std::vector<int>> &nodes() const
+        {
+            return nodes_;
+        }
+
+        inline size_t cpus() const
+        {
+            size_t count = 0;
+            for (const auto &node : nodes_)
+                count += node.size();
+            return count;
+        }
+
+        /// @brief Index into nodes() of the node a CPU belongs to, -1 for a CPU this process may not use
+        inline int nodeOf(int cpu) const
+        {
+            for (size_t n = 0; n < nodes_.size(); ++n)
+            {
+                if (std::binary_search(nodes_[n].begin(), nodes_[n].end(), cpu))
+                    return static_cast<int>(n);
+            }
+            return -1;
+        }
+
+        /// @brief CPUs in the order workers are pinned to them, empty for Affinity::None
+        inline std::vector<int> order(Affinity affinity) const
+        {
+            std::vector<int> result;
+            if (affinity == Affinity::Compact)
+            {
+                for (const auto &node : nodes_)
+                    result.insert(result.end(), node.begin(), node.end());
+            }
+            else if (affinity == Affinity::Scatter)
+            {
+                for (size_t position = 0; result.size() < cpus(); ++position)
+                {
+                    for (const auto &node : nodes_)
+                    {
+                        if (position < node.size())
+                            result.push_back(node[position]);
+                    }
+                }
+            }
+            return result;
+        }
+
+    private:
+        static inline Topology detect()
+        {
+            cpu_set_t allowed;
+            CPU_ZERO(&allowed);
+            if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+            {
+                CPU_ZERO(&allowed);
+                CPU_SET(0, &allowed);
+            }
+
+            // Node ids can have gaps and node 0 may be missing, so the ids come from the list of nodes with CPUs
+            Topology topology;
+            std::vector<int> node_ids = readList("/sys/devices/system/node/has_cpu");
+            if (node_ids.empty())
+                node_ids = readList("/sys/devices/system/node/online");
+            for (int node : node_ids)
+            {
+                std::vector<int> cpus;
+                for (int cpu : readList("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist"))
+                {
+                    if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+                        cpus.push_back(cpu);
+                }
+                if (!cpus.empty())
+                    topology.nodes_.push_back(std::move(cpus));
+            }
+
+            if (topology.nodes_.empty())
+            {
+                std::vector<int> cpus;
+                for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+                {
+                    if (CPU_ISSET(cpu, &allowed))
+                        cpus.push_back(cpu);
+                }
+                topology.nodes_.push_back(std::move(cpus));
+            }
+            return topology;
+        }
+
+        /// @brief Ids in a sysfs list file, empty when it cannot be read
+        static inline std::vector<int> readList(const std::string &path)
+        {
+            std::ifstream in(path);
+            std::string list;
+            if (!in || !std::getline(in, list))
+                return {};
+            return parseList(list);
+        }
+
+        /// @brief CPUs or nodes of a sysfs list such as "0-3,8-11"
+        static inline std::vector<int> parseList(const std::string &list)
+        {
+            std::vector<int> cpus;
+            std::stringstream in(list);
+            std::string range;
+            while (std::getline(in, range, ','))
+            {
+                if (range.empty() || range == "\n")
+                    continue;
+                size_t dash = range.find('-');
+                int first = std::stoi(range.substr(0, dash));
+                int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+                for (int cpu = first; cpu <= last; ++cpu)
+                    cpus.push_back(cpu);
+            }
+            std::sort(cpus.begin(), cpus.end());
+            return cpus;
+        }
+
+        std::vector<std::vector<int>> nodes_;
+    };
+}
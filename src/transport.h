@@ -0,0 +1,463 @@
+#pragma once
+#include <new>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <stdexcept>
+#include <algorithm>
+#include <iostream>
+#include <functional>
+#include <filesystem>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+namespace AP
+{
+    /// Communication between the worker processes of a distributed fit, see DistributedAffinityPropagation
+    namespace Distributed
+    {
+        /// @brief Collective operations between the ranks of a group of processes.
+        ///        Every rank has to make the same sequence of calls with the same counts
+        class Transport
+        {
+        public:
+            virtual ~Transport() = default;
+
+            virtual unsigned int rank() const = 0;
+            virtual unsigned int size() const = 0;
+
+            /// @brief Replace data on every rank with the element-wise sum over all ranks.
+            ///        The sum is taken in rank order, so every rank gets bit-identical results
+            virtual void allreduce(double *data, size_t count) = 0;
+        };
+
+        inline std::runtime_error systemError(const std::string &what)
+        {
+            return std::runtime_error(what + ": " + std::strerror(errno));
+        }
+
+        /// @brief Allreduce through a POSIX shared memory segment: every rank writes its contribution to its own slot,
+        ///        sums one segment of the result across all slots and copies the whole result back, with a barrier between the steps.
+        ///        Longer reductions are split into chunks of the segment capacity
+        class SharedMemoryTransport : public Transport
+        {
+        public:
+            /// @brief Doubles every rank contributes per chunk
+            static constexpr size_t DEFAULT_CAPACITY = size_t(1) << 16;
+
+            /// @brief Create the segment for a group, before any rank opens it. Remove it with unlink() once every rank has opened it
+            /// @param name POSIX shared memory name starting with '/'
+            static inline void create(const std::string &name, unsigned int size, size_t capacity = DEFAULT_CAPACITY)
+            {
+                int fd = ::shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+                if (fd < 0)
+                {
+                    throw systemError("Error creating shared memory " + name);
+                }
+                size_t bytes = segmentSize(size, capacity);
+                if (::ftruncate(fd, static_cast<off_t>(bytes)) != 0)
+                {
+                    ::close(fd);
+                    ::shm_unlink(name.c_str());
+                    throw systemError("Error sizing shared memory " + name);
+                }
+
+                void *address = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                ::close(fd);
+                if (address == MAP_FAILED)
+                {
+                    ::shm_unlink(name.c_str());
+                    throw systemError("Error mapping shared memory " + name);
+                }
+                Control *control = new (address) Control{};
+                control->size = size;
+                control->capacity = capacity;
+                ::munmap(address, bytes);
+            }
+
+            static inline void unlink(const std::string &name)
+            {
+                ::shm_unlink(name.c_str());
+            }
+
+            /// @brief Join the group through a segment made by create()
+            SharedMemoryTransport(const std::string &name, unsigned int rank, unsigned int size)
+                : rank_(rank), size_(size)
+            {
+                if (rank >= size)
+                {
+                    throw std::invalid_argument("Rank has to be smaller than the group size");
+                }
+                int fd = ::shm_open(name.c_str(), O_RDWR, 0600);
+                if (fd < 0)
+                {
+                    throw systemError("Error opening shared memory " + name);
+                }
+                struct stat info;
+                if (::fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(Control))
+                {
+                    ::close(fd);
+                    throw std::runtime_error("Shared memory " + name + " is not a transport segment");
+                }
+
+                bytes_ = static_cast<size_t>(info.st_size);
+                address_ = ::mmap(nullptr, bytes_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                ::close(fd);
+                if (address_ == MAP_FAILED)
+                {
+                    throw systemError("Error mapping shared memory " + name);
+                }
+
+                control_ = static_cast<Control *>(address_);
+                if (control_->size != size || bytes_ < segmentSize(size, control_->capacity))
+                {
+                    ::munmap(address_, bytes_);
+                    throw std::runtime_error("Shared memory " + name + " was created for a different group");
+                }
+                capacity_ = control_->capacity;
+                slots_ = reinterpret_cast<double *>(static_cast<char *>(address_) + CONTROL_BYTES);
+                result_ = slots_ + size_ * capacity_;
+            }
+
+            SharedMemoryTransport(const SharedMemoryTransport &) = delete;
+            SharedMemoryTransport &operator=(const SharedMemoryTransport &) = delete;
+
+            ~SharedMemoryTransport() override
+            {
+                ::munmap(address_, bytes_);
+            }
+
+            unsigned int rank() const override { return rank_; }
+            unsigned int size() const override { return size_; }
+
+            void allreduce(double *data, size_t count) override
+            {
+                for (size_t offset = 0; offset < count; offset += capacity_)
+                {
+                    size_t chunk = std::min(capacity_, count - offset);
+                    std::memcpy(slots_ + rank_ * capacity_, data + offset, chunk * sizeof(double));
+                    barrier();
+
+                    size_t begin = chunk * rank_ / size_;
+                    size_t end = chunk * (rank_ + 1) / size_;
+                    for (size_t j = begin; j < end; ++j)
+                    {
+                        double sum = 0.0;
+                        for (unsigned int r = 0; r < size_; ++r)
+                        {
+                            sum += slots_[r * capacity_ + j];
+                        }
+                        result_[j] = sum;
+                    }
+                    barrier();
+
+                    // The next write to result_ comes after the next first barrier, which every rank only reaches once done copying
+                    std::memcpy(data + offset, result_, chunk * sizeof(double));
+                }
+            }
+
+        private:
+            struct Control
+            {
+                std::atomic<uint32_t> arrived{0};
+                std::atomic<uint32_t> generation{0};
+                uint32_t size = 0;
+                uint64_t capacity = 0;
+            };
+            static constexpr size_t CONTROL_BYTES = 128;
+            static_assert(sizeof(Control) <= CONTROL_BYTES, "Transport control block outgrew its space");
+
+            static inline size_t segmentSize(unsigned int size, size_t capacity)
+            {
+                return CONTROL_BYTES + (size + 1) * capacity * sizeof(double);
+            }
+
+            /// @brief Sense-reversing barrier. Futex waits are process private, so waiting ranks spin and yield
+            inline void barrier()
+            {
+                uint32_t generation = control_->generation.load(std::memory_order_acquire);
+                if (control_->arrived.fetch_add(1, std::memory_order_acq_rel) == size_ - 1)
+                {
+                    control_->arrived.store(0, std::memory_order_relaxed);
+                    control_->generation.fetch_add(1, std::memory_order_release);
+                    return;
+                }
+                for (unsigned int spins = 0; control_->generation.load(std::memory_order_acquire) == generation; ++spins)
+                {
+                    if (spins > 1024)
+                        std::this_thread::yield();
+                }
+            }
+
+            unsigned int rank_;
+            unsigned int size_;
+            size_t capacity_ = 0;
+            size_t bytes_ = 0;
+            void *address_ = nullptr;
+            Control *control_ = nullptr;
+            double *slots_ = nullptr;
+            double *result_ = nullptr;
+        };
+
+        /// @brief Allreduce over Unix domain stream sockets in a star around rank 0,
+        ///        which receives every contribution, sums them in rank order and sends the result back
+        class SocketTransport : public Transport
+        {
+        public:
+            /// @param path socket path, rank 0 creates it and the other ranks connect to it
+            /// @param timeout how long the other ranks keep trying to connect while rank 0 starts up
+            SocketTransport(const std::string &path, unsigned int rank, unsigned int size, std::chrono::milliseconds timeout = std::chrono::seconds(30))
+                : rank_(rank), size_(size), path_(path)
+            {
+                if (rank >= size)
+                {
+                    throw std::invalid_argument("Rank has to be smaller than the group size");
+                }
+
+                sockaddr_un address{};
+                address.sun_family = AF_UNIX;
+                if (path.size() >= sizeof(address.sun_path))
+                {
+                    throw std::invalid_argument("Socket path too long: " + path);
+                }
+                std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+                if (rank == 0)
+                {
+                    int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+                    if (listener < 0)
+                        throw systemError("Error creating socket");
+                    ::unlink(path.c_str());
+                    if (::bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || ::listen(listener, static_cast<int>(size)) != 0)
+                    {
+                        ::close(listener);
+                        throw systemError("Error listening on " + path);
+                    }
+
+                    peers_.assign(size, -1);
+                    for (unsigned int accepted = 1; accepted < size; ++accepted)
+                    {
+                        int peer = ::accept(listener, nullptr, nullptr);
+                        uint32_t peer_rank = 0;
+                        if (peer < 0 || !receiveAll(peer, &peer_rank, sizeof(peer_rank)) || peer_rank == 0 || peer_rank >= size || peers_[peer_rank] >= 0)
+                        {
+                            ::close(listener);
+                            throw std::runtime_error("Bad connection on " + path);
+                        }
+                        peers_[peer_rank] = peer;
+                    }
+                    ::close(listener);
+                    ::unlink(path.c_str());
+                }
+                else
+                {
+                    auto deadline = std::chrono::steady_clock::now() + timeout;
+                    while (true)
+                    {
+                        int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+                        if (fd < 0)
+                            throw systemError("Error creating socket");
+                        if (::connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0)
+                        {
+                            peers_.assign(1, fd);
+                            break;
+                        }
+                        ::close(fd);
+                        if (std::chrono::steady_clock::now() > deadline)
+                            throw systemError("Error connecting to " + path);
+                        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                    }
+                    uint32_t own_rank = rank;
+                    if (!sendAll(peers_[0], &own_rank, sizeof(own_rank)))
+                        throw systemError("Error sending to " + path);
+                }
+            }
+
+            SocketTransport(const SocketTransport &) = delete;
+            SocketTransport &operator=(const SocketTransport &) = delete;
+
+            ~SocketTransport() override
+            {
+                for (int fd : peers_)
+                {
+                    if (fd >= 0)
+                        ::close(fd);
+                }
+            }
+
+            unsigned int rank() const override { return rank_; }
+            unsigned int size() const override { return size_; }
+
+            void allreduce(double *data, size_t count) override
+            {
+                size_t bytes = count * sizeof(double);
+                if (rank_ != 0)
+                {
+                    if (!sendAll(peers_[0], data, bytes) || !receiveAll(peers_[0], data, bytes))
+                        throw systemError("Allreduce failed on " + path_);
+                    return;
+                }
+
+                buffer_.resize(count);
+                for (unsigned int r = 1; r < size_; ++r)
+                {
+                    if (!receiveAll(peers_[r], buffer_.data(), bytes))
+                        throw systemError("Allreduce failed on " + path_);
+                    for (size_t j = 0; j < count; ++j)
+                    {
+                        data[j] += buffer_[j];
+                    }
+                }
+                for (unsigned int r = 1; r < size_; ++r)
+                {
+                    if (!sendAll(peers_[r], data, bytes))
+                        throw systemError("Allreduce failed on " + path_);
+                }
+            }
+
+        private:
+            static inline bool sendAll(int fd, const void *data, size_t bytes)
+            {
+                const char *pos = static_cast<const char *>(data);
+                while (bytes > 0)
+                {
+                    ssize_t sent = ::send(fd, pos, bytes, MSG_NOSIGNAL);
+                    if (sent < 0 && errno == EINTR)
+                        continue;
+                    if (sent <= 0)
+                        return false;
+                    pos += sent;
+                    bytes -= static_cast<size_t>(sent);
+                }
+                return true;
+            }
+
+            static inline bool receiveAll(int fd, void *data, size_t bytes)
+            {
+                char *pos = static_cast<char *>(data);
+                while (bytes > 0)
+                {
+                    ssize_t received = ::recv(fd, pos, bytes, 0);
+                    if (received < 0 && errno == EINTR)
+                        continue;
+                    if (received <= 0)
+                        return false;
+                    pos += received;
+                    bytes -= static_cast<size_t>(received);
+                }
+                return true;
+            }
+
+            unsigned int rank_;
+            unsigned int size_;
+            std::string path_;
+            /// @brief On rank 0 the connection to every other rank by rank, elsewhere only the connection to rank 0
+            std::vector<int> peers_;
+            std::vector<double> buffer_;
+        };
+
+        /// @brief How the workers of launch() exchange messages
+        enum class TransportKind
+        {
+            SharedMemory,
+            Socket
+        };
+
+        /// @brief Fork workers processes, each running worker with its own transport of the given kind, and wait for all of them.
+        ///        Call it before starting any thread pool, the children only inherit the calling thread.
+        ///        When a worker throws or dies the others are killed, since they would wait for it forever
+        /// @return whether every worker finished without an error
+        inline bool launch(unsigned int workers, TransportKind kind, const std::function<void(Transport &)> &worker)
+        {
+            if (workers == 0)
+            {
+                throw std::invalid_argument("At least one worker is needed");
+            }
+
+            static unsigned int launches = 0;
+            std::string tag = "ap-" + std::to_string(::getpid()) + "-" + std::to_string(launches++);
+            std::string name = "/" + tag;
+            std::string path = (std::filesystem::temp_directory_path() / (tag + ".sock")).string();
+            if (kind == TransportKind::SharedMemory)
+            {
+                SharedMemoryTransport::create(name, workers);
+            }
+
+            std::cout.flush();
+            std::cerr.flush();
+            std::vector<pid_t> children;
+            for (unsigned int rank = 0; rank < workers; ++rank)
+            {
+                pid_t pid = ::fork();
+                if (pid == 0)
+                {
+                    int status = 0;
+                    try
+                    {
+                        std::unique_ptr<Transport> transport;
+                        if (kind == TransportKind::SharedMemory)
+                            transport = std::make_unique<SharedMemoryTransport>(name, rank, workers);
+                        else
+                            transport = std::make_unique<SocketTransport>(path, rank, workers);
+                        worker(*transport);
+                    }
+                    catch (const std::exception &e)
+                    {
+                        std::cerr << "Worker " << rank << " failed: " << e.what() << std::endl;
+                        status = 1;
+                    }
+                    std::cout.flush();
+                    std::cerr.flush();
+                    ::_exit(status);
+                }
+                if (pid < 0)
+                {
+                    std::cerr << "Cannot start worker " << rank << ": " << std::strerror(errno) << std::endl;
+                    break;
+                }
+                children.push_back(pid);
+            }
+
+            bool success = children.size() == workers;
+            if (!success)
+            {
+                for (pid_t child : children)
+                    ::kill(child, SIGKILL);
+            }
+            while (!children.empty())
+            {
+                int status = 0;
+                pid_t pid = ::waitpid(-1, &status, 0);
+                if (pid < 0)
+                    break;
+                auto child = std::find(children.begin(), children.end(), pid);
+                if (child == children.end())
+                    continue;
+                children.erase(child);
+                if (success && !(WIFEXITED(status) && WEXITSTATUS(status) == 0))
+                {
+                    success = false;
+                    for (pid_t other : children)
+                        ::kill(other, SIGKILL);
+                }
+            }
+
+            if (kind == TransportKind::SharedMemory)
+                SharedMemoryTransport::unlink(name);
+            else
+                ::unlink(path.c_str());
+            return success;
+        }
+    }
+}